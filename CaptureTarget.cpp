@@ -0,0 +1,166 @@
+#include "CaptureTarget.h"
+#include <iostream>
+
+// A triangle covering the viewport, with no vertex data
+static const char* boxVertexSource = R"(#version 330 core
+void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+// Averages the factor x factor block of texels under each capture pixel
+static const char* boxFragmentSource = R"(#version 330 core
+uniform sampler2D frame;
+uniform int factor;
+out vec4 color;
+
+void main()
+{
+    ivec2 origin = ivec2(gl_FragCoord.xy) * factor;
+    vec4 sum = vec4(0.0);
+    for (int y = 0; y < factor; ++y)
+        for (int x = 0; x < factor; ++x)
+            sum += texelFetch(frame, origin + ivec2(x, y), 0);
+    color = sum / float(factor * factor);
+}
+)";
+
+// Function to compile one stage of the box filter program, printing the log if it fails
+static GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetShaderInfoLog(shader, 512, NULL, infoLog);
+        std::cout << "Failed to compile the capture box filter shader\n" << infoLog << std::endl;
+    }
+    return shader;
+}
+
+CaptureTarget::CaptureTarget(int width, int height, int scale)
+    : width(width),
+    height(height),
+    boxFactor(1),
+    boxProgram(0),
+    boxVertexArray(0)
+{
+    if (scale < 1)
+        scale = 1;
+
+    // The level drawn into, then halves of it while the scale left is even. A linear blit averages
+    // the 2x2 pixels under each target pixel exactly when halving; larger steps would skip pixels
+    addLevel(width * scale, height * scale, true);
+    while (scale % 2 == 0) {
+        scale /= 2;
+        addLevel(width * scale, height * scale, false);
+    }
+
+    // An odd factor left over (3 for a scale of 3 or 6) is averaged in one pass by a shader instead
+    boxFactor = scale;
+    if (boxFactor > 1) {
+        addLevel(width, height, false);
+
+        GLuint vertexShader = compileShader(GL_VERTEX_SHADER, boxVertexSource);
+        GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, boxFragmentSource);
+        boxProgram = glCreateProgram();
+        glAttachShader(boxProgram, vertexShader);
+        glAttachShader(boxProgram, fragmentShader);
+        glLinkProgram(boxProgram);
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+
+        glUseProgram(boxProgram);
+        glUniform1i(glGetUniformLocation(boxProgram, "frame"), 0);
+        glUniform1i(glGetUniformLocation(boxProgram, "factor"), boxFactor);
+        glUseProgram(0);
+
+        // core profile draws need a vertex array bound, even with no attributes
+        glGenVertexArrays(1, &boxVertexArray);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Method to create one framebuffer in the chain
+void CaptureTarget::addLevel(int levelWidth, int levelHeight, bool withDepth) {
+    Level level;
+    level.width = levelWidth;
+    level.height = levelHeight;
+    level.depth = 0;
+
+    glGenFramebuffers(1, &level.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, level.framebuffer);
+
+    // a texture rather than a renderbuffer, so the frame can also be sampled
+    glGenTextures(1, &level.color);
+    glBindTexture(GL_TEXTURE_2D, level.color);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, levelWidth, levelHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, level.color, 0);
+
+    if (withDepth) {
+        glGenRenderbuffers(1, &level.depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, level.depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, levelWidth, levelHeight);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, level.depth);
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    levels.push_back(level);
+}
+
+// Method to start drawing into the capture target
+void CaptureTarget::bind() {
+    glBindFramebuffer(GL_FRAMEBUFFER, levels[0].framebuffer);
+    glViewport(0, 0, levels[0].width, levels[0].height);
+}
+
+// Method to filter the drawn frame down to the capture size
+void CaptureTarget::resolve() {
+    size_t blits = boxFactor > 1 ? levels.size() - 1 : levels.size();
+    for (size_t i = 1; i < blits; ++i) {
+        const Level& from = levels[i - 1];
+        const Level& to = levels[i];
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, from.framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, to.framebuffer);
+        glBlitFramebuffer(0, 0, from.width, from.height, 0, 0, to.width, to.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    }
+
+    if (boxFactor > 1) {
+        const Level& from = levels[levels.size() - 2];
+        const Level& to = levels.back();
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, to.framebuffer);
+        glViewport(0, 0, to.width, to.height);
+
+        glUseProgram(boxProgram);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, from.color);
+        glBindVertexArray(boxVertexArray);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glUseProgram(0);
+    }
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, levels.back().framebuffer);
+}
+
+// Method to free the GPU objects
+void CaptureTarget::deleteBuffers() {
+    for (Level& level : levels) {
+        glDeleteFramebuffers(1, &level.framebuffer);
+        glDeleteTextures(1, &level.color);
+        if (level.depth)
+            glDeleteRenderbuffers(1, &level.depth);
+    }
+    levels.clear();
+    glDeleteProgram(boxProgram);
+    glDeleteVertexArrays(1, &boxVertexArray);
+    boxProgram = boxVertexArray = 0;
+}
@@ -0,0 +1,56 @@
+//Import libraries
+#ifndef CAPTURE_TARGET_H
+#define CAPTURE_TARGET_H
+#include <cstddef>
+#include <vector>
+#include <glad/glad.h>
+
+// An offscreen framebuffer the scene is drawn into for recording, at a resolution of its own, so
+// the recording doesn't depend on the window's size. With a scale above 1 the scene is drawn at
+// scale times the capture size and filtered down to it, which smooths the edges of the recording:
+// halved while the scale is even, then any odd factor left is box-filtered in one shader pass, so
+// every capture pixel averages all the pixels drawn for it whatever the scale.
+class CaptureTarget {
+public:
+    // Constructor - needs a current OpenGL context
+    CaptureTarget(int width, int height, int scale = 1);
+
+    // Binds the framebuffer to draw into and sets the viewport to its size
+    void bind();
+
+    // Filters what was drawn down to the capture size and leaves the result bound as the read
+    // framebuffer, ready for FrameCapture::readFrame()
+    void resolve();
+
+    // Texture holding the captured frame after resolve(), e.g. for PaletteQuantizer
+    GLuint getColorTexture() const { return levels.back().color; }
+
+    // Size of the captured frames, and the aspect ratio to draw them with
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    float getAspect() const { return (float)width / (float)height; }
+
+    // Deletes the framebuffers - call while the context is still current
+    void deleteBuffers();
+
+private:
+    // A framebuffer and its color texture; the first one, drawn into, also has a depth buffer
+    struct Level {
+        GLuint framebuffer;
+        GLuint color;
+        GLuint depth;
+        int width;
+        int height;
+    };
+
+    void addLevel(int levelWidth, int levelHeight, bool withDepth);
+
+    std::vector<Level> levels;
+    int width;
+    int height;
+    int boxFactor;          // odd factor the last level is box-filtered by, 1 if it is only halved to
+    GLuint boxProgram;
+    GLuint boxVertexArray;
+};
+
+#endif
@@ -1,16 +1,19 @@
 #include "Character.h"
 
 Character::Character()
-// Initialize offsets for different body parts
-    : headOffset(0.0f, 1.0f, 0.0f),
-    leftArmOffset(-0.6f, 0.0f, 0.0f),
-    rightArmOffset(0.6f, 0.0f, 0.0f),
-    leftLegOffset(-0.3f, -1.0f, 0.0f),
-    rightLegOffset(0.3f, -1.0f, 0.0f),
+    // Start at the origin with no rotation or scale, so the setters have something to compare against
+    : rootTransform(),
     // Initialize animation-related variables
     armSwing(0.0f),
     legSwing(0.0f),
-    swingSpeed(7.0f)
+    swingSpeed(7.0f),
+    tracker(NULL),
+    // Initialize offsets for different body parts
+    headOffset(0.0f, 1.0f, 0.0f),
+    leftArmOffset(-0.6f, 0.0f, 0.0f),
+    rightArmOffset(0.6f, 0.0f, 0.0f),
+    leftLegOffset(-0.3f, -1.0f, 0.0f),
+    rightLegOffset(0.3f, -1.0f, 0.0f)
 {    
     
 }
@@ -104,6 +107,9 @@ void Character::drawPart(GLuint shaderProgram, GLuint VAO, const glm::mat4& mode
 
 // Method to update the swing animation of the character
 void Character::updateSwing(float deltaTime, bool isMoving) {
+    float lastArmSwing = armSwing;
+    float lastLegSwing = legSwing;
+
     if (isMoving) {
         // Calculate arm and leg swing based on time and swing speed
         armSwing = 45.0f * sin(glfwGetTime() * swingSpeed);
@@ -114,4 +120,7 @@ void Character::updateSwing(float deltaTime, bool isMoving) {
         armSwing = 0.0f;
         legSwing = 0.0f;
     }
+
+    if (armSwing != lastArmSwing || legSwing != lastLegSwing)
+        markChanged();
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #ifndef CHARACTER_H
 #define CHARACTER_H
 #include "Character.h"
+#include "SceneTracker.h"
 #include <iostream>
 #include <cmath>
 #include <numbers>
@@ -36,16 +37,19 @@ public:
     void updateSwing(float deltaTime, bool isMoving);
 
 
+    // Tracker told about every change to how the character is drawn (NULL for none)
+    void setTracker(SceneTracker* sceneTracker) { tracker = sceneTracker; }
+
     // Getters and setters for position
-    void setPosition(const glm::vec3& pos) { rootTransform.position = pos; }
+    void setPosition(const glm::vec3& pos) { if (pos != rootTransform.position) markChanged(); rootTransform.position = pos; }
     glm::vec3 getPosition() const { return rootTransform.position; }
 
     // Getters and setters for rotation
-    void setRotation(const glm::vec3& rot) { rootTransform.rotation = rot; }
+    void setRotation(const glm::vec3& rot) { if (rot != rootTransform.rotation) markChanged(); rootTransform.rotation = rot; }
     glm::vec3 getRotation() const { return rootTransform.rotation; }
 
     // Getters and setters for scale
-    void setScale(const glm::vec3& sc) { rootTransform.scale = sc; }
+    void setScale(const glm::vec3& sc) { if (sc != rootTransform.scale) markChanged(); rootTransform.scale = sc; }
     glm::vec3 getScale() const { return rootTransform.scale; }
 
 private:
@@ -53,6 +57,7 @@ private:
     float armSwing;
     float legSwing;
     float swingSpeed;
+    SceneTracker* tracker;
     
     // Relative offsets from the torso (root)
     const glm::vec3 headOffset;
@@ -61,7 +66,8 @@ private:
     const glm::vec3 leftLegOffset;
     const glm::vec3 rightLegOffset;
 
-    // Private helper method
+    // Private helper methods
+    void markChanged() { if (tracker) tracker->markChanged(); }
     void drawPart(GLuint shaderProgram, GLuint VAO, const glm::mat4& model, 
                  const glm::mat4& view, const glm::mat4& projection, 
                  const glm::vec3& color);
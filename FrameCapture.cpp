@@ -0,0 +1,96 @@
+#include "FrameCapture.h"
+
+FrameCapture::FrameCapture(int width, int height, int numBuffers, GLenum format)
+    : slots(numBuffers > 0 ? numBuffers : 1),
+    width(width),
+    height(height),
+    format(format),
+    bytesPerPixel(format == GL_RGBA ? 4 : 1),
+    oldest(0),
+    queued(0),
+    mapped(false)
+{
+    // Allocate the pixel pack buffers; GL_STREAM_READ hints that the GPU writes them and the CPU reads them once
+    for (Slot& slot : slots) {
+        glGenBuffers(1, &slot.buffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width * height * bytesPerPixel, NULL, GL_STREAM_READ);
+        slot.fence = 0;
+        slot.time = 0.0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Method to queue the readback of the current frame
+void FrameCapture::readFrame(double time) {
+    // If every buffer is still waiting to be mapped, make room by dropping the oldest frame
+    if (queued == (int)slots.size() && !mapped) {
+        glDeleteSync(slots[oldest].fence);
+        slots[oldest].fence = 0;
+        oldest = (oldest + 1) % slots.size();
+        --queued;
+    }
+    if (queued == (int)slots.size())
+        return;
+
+    Slot& slot = slots[(oldest + queued) % slots.size()];
+    slot.time = time;
+
+    // With a pack buffer bound, glReadPixels writes into it at offset 0 and returns without waiting
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+    // rows of single bytes need not fill whole words
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, format, GL_UNSIGNED_BYTE, (void*)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ++queued;
+}
+
+// Method to map the oldest frame once enough newer ones are queued behind it
+const uint8_t* FrameCapture::mapFrame(bool drain) {
+    if (mapped || queued == 0 || (!drain && queued < (int)slots.size()))
+        return NULL;
+
+    // Normally the copy finished while the frames after it rendered, and this returns at once
+    Slot& slot = slots[oldest];
+    glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+    const uint8_t* pixels = (const uint8_t*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (GLsizeiptr)width * height * bytesPerPixel, GL_MAP_READ_BIT);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (!pixels) {
+        oldest = (oldest + 1) % slots.size();
+        --queued;
+        return NULL;
+    }
+    mapped = true;
+    return pixels;
+}
+
+// Method to give the mapped buffer back for reuse
+void FrameCapture::unmapFrame() {
+    if (!mapped)
+        return;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[oldest].buffer);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    mapped = false;
+    oldest = (oldest + 1) % slots.size();
+    --queued;
+}
+
+// Method to free the GPU objects
+void FrameCapture::deleteBuffers() {
+    unmapFrame();
+    for (Slot& slot : slots) {
+        if (slot.fence)
+            glDeleteSync(slot.fence);
+        glDeleteBuffers(1, &slot.buffer);
+        slot.fence = 0;
+        slot.buffer = 0;
+    }
+    queued = 0;
+}
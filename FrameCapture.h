@@ -0,0 +1,58 @@
+//Import libraries
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glad/glad.h>
+
+// Reads rendered frames back into a ring of pixel pack buffers without stalling the render loop.
+// readFrame() only queues the copy on the GPU; mapFrame() hands back the frame queued numBuffers-1
+// frames earlier, by which time its copy has normally finished, straight from the mapped buffer.
+// With one buffer (the default) it waits for the frame just read, like a plain glReadPixels; that is the
+// fastest where the driver copies synchronously anyway (integrated and software GPUs), where more buffers
+// only add mapping and fence overhead. Use 2 or 3 on a discrete GPU, whose copies run asynchronously over PCIe.
+class FrameCapture {
+public:
+    // Constructor - needs a current OpenGL context. format is GL_RGBA for 4 bytes per pixel, or
+    // GL_RED_INTEGER for 1 (the palette indices of a PaletteQuantizer)
+    FrameCapture(int width, int height, int numBuffers = 1, GLenum format = GL_RGBA);
+
+    // Queues a copy of the bottom-left width x height pixels of the read framebuffer (in the
+    // constructor's format, bottom row first, rows tightly packed), along with the time it was rendered
+    void readFrame(double time);
+
+    // Maps the oldest queued frame once numBuffers-1 newer ones are queued behind it, or any queued
+    // frame when draining at the end. Returns NULL if there is none; otherwise the pixels stay valid
+    // until unmapFrame()
+    const uint8_t* mapFrame(bool drain = false);
+    void unmapFrame();
+
+    // Time passed to readFrame() for the mapped frame
+    double getFrameTime() const { return slots[oldest].time; }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    // Deletes the buffers and fences - call while the context is still current
+    void deleteBuffers();
+
+private:
+    // A pixel pack buffer and the fence that signals when the copy into it is done
+    struct Slot {
+        GLuint buffer;
+        GLsync fence;
+        double time;
+    };
+
+    std::vector<Slot> slots;
+    int width;
+    int height;
+    GLenum format;
+    int bytesPerPixel;
+    int oldest;   // index of the oldest queued frame
+    int queued;   // number of frames queued and not yet unmapped
+    bool mapped;
+};
+
+#endif
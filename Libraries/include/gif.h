@@ -18,13 +18,51 @@
 //
 // If capturing a buffer with a bottom-left origin (such as OpenGL), define GIF_FLIP_VERT
 // to automatically flip the buffer data when writing the image (the buffer itself is
-// unchanged.
+// unchanged). Palette building, dithering and the LZW pass all read the rows in image order,
+// so the output is byte-for-byte what a top-down copy of the same buffer would give.
 //
 // USAGE:
 // Create a GifWriter struct. Pass it to GifBegin() to initialize and write the header.
 // Pass subsequent frames to GifWriteFrame().
 // Finally, call GifEnd() to close the file handle and free memory.
 //
+// GifBeginSink() is the same as GifBegin() but hands the encoded bytes to a callback instead of
+// a file - once for the header (held back until the first frame), once per frame and once at
+// the end - e.g. to stream to a pipe. Each frame is passed on when the next one arrives, since
+// frames identical to it are merged into it by adding up their delays.
+// GifBufferSink collects the whole GIF in memory.
+//
+// GifBeginSegments() splits a long recording into a series of complete GIFs, starting a new file every so
+// many frames or bytes; the files are written and closed on a background thread.
+//
+// To take encoding off the calling thread, call GifSetAsync() right after GifBegin().
+// GifWriteFrame() then only copies the frame into a queue; a pool of worker threads
+// LZW-compresses several frames at once, and the finished image blocks are written to the
+// file in frame order. Palettes and thresholding still run one frame at a time, in order,
+// since each frame is palettized against the one before (and may reuse its palette); the
+// pool overlaps that with the compression and writing of the frames before it.
+//
+// For instant replay, GifReplayBegin() keeps just the last few seconds of frames in a bounded amount of memory,
+// stored as their changes from the frame before; GifReplaySave() writes them to a GIF on a background thread.
+//
+// GifCaptureBegin() records frames to a raw capture file instead, cheaply enough to keep up with rendering;
+// GifTranscodeCapture() converts it to a GIF afterwards on all cores, and GifCaptureReadFrame() reads any
+// frame back for inspection.
+//
+// GifPipeBegin() skips GIF altogether and streams frames as YUV4MPEG2 or raw RGBA to stdout or a named pipe,
+// for an external video encoder; frames the encoder can't keep up with are dropped and counted.
+//
+// When a frame is known to be the same as the one before - nothing in the scene moved - GifRepeatFrame(),
+// GifReplayRepeatFrame(), GifCaptureRepeatFrame() and GifPipeRepeatFrame() extend the previous frame
+// without it having to be read back or passed in again.
+//
+// GifSetPaletteReuse() keeps a frame's palette for the following frames until it no longer
+// fits them well enough, which saves building a palette per frame and shrinks the file.
+//
+// With one palette for the whole animation (GifSetFixedPalette()), frames can be palettized before they reach
+// the encoder - e.g. on the GPU with GifGetPaletteLutIndices() - and passed as one index per pixel to
+// GifWriteIndexedFrame(), which then skips every color lookup.
+//
 
 #ifndef gif_h
 #define gif_h
@@ -34,11 +72,40 @@
 #include <stdint.h>  // for integer typedefs
 #include <stdbool.h> // for bool macros
 
+// The palette search uses AVX2 or SSE2 when the compiler targets them.
+// Define GIF_NO_SIMD to force the portable scalar code.
+#if !defined(GIF_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define GIF_AVX2
+#define GIF_SSE2
+#elif !defined(GIF_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define GIF_SSE2
+#endif
+
+#include <thread>              // for the asynchronous encoder
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>           // for std::nth_element
+#include <new>                 // for placement new
+
+#if defined(_WIN32)
+#include <io.h>                // for _commit, to flush rolling segments to disk, and _setmode
+#include <fcntl.h>             // for _O_BINARY, to stream frames to stdout
+#else
+#include <unistd.h>            // for fsync
+#endif
+
 // Define these macros to hook into a custom memory allocator.
 // TEMP_MALLOC and TEMP_FREE will only be called in stack fashion - frees in the reverse order of mallocs
 // and any temp memory allocated by a function will be freed before it exits.
-// MALLOC and FREE are used only by GifBegin and GifEnd respectively (to allocate a buffer the size of the image, which
-// is used to find changed pixels for delta-encoding.)
+// MALLOC and FREE are used for memory that lasts from frame to frame: the buffers GifBegin allocates and GifEnd frees
+// (e.g. one the size of the image, which is used to find changed pixels for delta-encoding), and the scratch memory
+// a GifWriter keeps for the temporary buffers of encoding a frame. That grows over the first frames to the most they
+// need, after which a steady stream of frames is encoded without allocating (see GifGetAllocStats). Threads are
+// kept the same way: the ones a writer needs start with the option that asks for them and stop in GifEnd.
 
 #ifndef GIF_TEMP_MALLOC
 #include <stdlib.h>
@@ -60,6 +127,226 @@
 #define GIF_FREE free
 #endif
 
+// Counts of the allocations made through the macros above, by all writers together
+typedef struct
+{
+    uint64_t numAllocs;       // GIF_MALLOC calls
+    uint64_t numTempAllocs;   // GIF_TEMP_MALLOC calls
+    uint64_t numBytes;        // total size asked for by both
+} GifAllocStats;
+
+struct GifAllocCounters
+{
+    std::atomic<uint64_t> numAllocs;
+    std::atomic<uint64_t> numTempAllocs;
+    std::atomic<uint64_t> numBytes;
+};
+
+GifAllocCounters* GifGetAllocCounters()
+{
+    static GifAllocCounters counters; // zero-initialized
+    return &counters;
+}
+
+// Allocation counts so far; compare two snapshots to see what a stretch of frames allocated
+GifAllocStats GifGetAllocStats()
+{
+    GifAllocCounters* counters = GifGetAllocCounters();
+    GifAllocStats stats;
+    stats.numAllocs = counters->numAllocs.load();
+    stats.numTempAllocs = counters->numTempAllocs.load();
+    stats.numBytes = counters->numBytes.load();
+    return stats;
+}
+
+void* GifMalloc( size_t size )
+{
+    GifAllocCounters* counters = GifGetAllocCounters();
+    counters->numAllocs.fetch_add(1, std::memory_order_relaxed);
+    counters->numBytes.fetch_add(size, std::memory_order_relaxed);
+    return GIF_MALLOC(size);
+}
+
+void* GifTempMalloc( size_t size )
+{
+    GifAllocCounters* counters = GifGetAllocCounters();
+    counters->numTempAllocs.fetch_add(1, std::memory_order_relaxed);
+    counters->numBytes.fetch_add(size, std::memory_order_relaxed);
+    return GIF_TEMP_MALLOC(size);
+}
+
+// Scratch memory kept from frame to frame for one thread's temporary buffers, handed out in the same stack
+// fashion as TEMP_MALLOC. A request that doesn't fit falls back to TEMP_MALLOC; once everything has been
+// given back, the arena grows to hold the most that was asked for, so it stops allocating after a few frames.
+// Functions taking a GifArena* use TEMP_MALLOC directly when it's NULL.
+typedef struct
+{
+    uint8_t* data;
+    size_t capacity;
+    size_t used;
+    size_t spilled;   // bytes handed out from TEMP_MALLOC for requests that didn't fit, and not given back yet
+    size_t peak;      // most asked for at once, including requests that didn't fit
+} GifArena;
+
+void* GifArenaAlloc( GifArena* arena, size_t size )
+{
+    if(!arena) return GifTempMalloc(size);
+
+    // sizes are rounded to whole cache lines, so every buffer is as aligned as the first
+    size = (size + 63) & ~(size_t)63;
+    if(arena->used + arena->spilled + size > arena->peak) arena->peak = arena->used + arena->spilled + size;
+    if(arena->used + size > arena->capacity)
+    {
+        // a cache line in front of the buffer keeps its size, for GifArenaFree
+        uint8_t* block = (uint8_t*)GifTempMalloc(size + 64);
+        memcpy(block, &size, sizeof(size));
+        arena->spilled += size;
+        return block + 64;
+    }
+
+    void* ptr = arena->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+void GifArenaFree( GifArena* arena, void* ptr )
+{
+    if(!arena)
+    {
+        GIF_TEMP_FREE(ptr);
+        return;
+    }
+
+    if((uint8_t*)ptr < arena->data || (uint8_t*)ptr >= arena->data + arena->capacity)
+    {
+        uint8_t* block = (uint8_t*)ptr - 64;
+        size_t size;
+        memcpy(&size, block, sizeof(size));
+        arena->spilled -= size;
+        GIF_TEMP_FREE(block);
+    }
+    else
+    {
+        arena->used = (size_t)((uint8_t*)ptr - arena->data);
+    }
+
+    if(arena->used == 0 && arena->spilled == 0 && arena->peak > arena->capacity)
+    {
+        GIF_FREE(arena->data);
+        arena->data = (uint8_t*)GifMalloc(arena->peak);
+        arena->capacity = arena->peak;
+    }
+}
+
+// Frees the arena's memory; it can be used again afterwards, and starts out empty
+void GifArenaRelease( GifArena* arena )
+{
+    GIF_FREE(arena->data);
+    memset(arena, 0, sizeof(GifArena));
+}
+
+// count tasks handed to GifRunTasks: run(context, task) for every task from 0 to count-1
+struct GifTaskBatch
+{
+    void (*run)( void* context, uint32_t task );
+    void* context;
+    uint32_t count;
+    uint32_t next;      // the next task to hand out
+    uint32_t finished;
+};
+
+// Threads a writer keeps for the parts of a frame that split into independent tasks - LZW strips, and
+// counting colors in two-pass mode - so that frames don't start threads of their own. The thread handing
+// in a batch of tasks works on it too, so async workers handing in batches at once never wait on each other.
+struct GifWorkers
+{
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable wake;        // signalled when a batch is handed in or the workers are stopping
+    std::condition_variable finished;    // signalled when a task finishes
+    std::vector<GifTaskBatch*> batches;  // batches with tasks not handed out yet, oldest first
+    bool stopping;
+};
+
+// Takes the next task of the oldest batch; the caller holds workers->lock
+uint32_t GifTakeTask( GifWorkers* workers, GifTaskBatch* batch )
+{
+    uint32_t task = batch->next++;
+    if(batch->next == batch->count)
+        workers->batches.erase(std::find(workers->batches.begin(), workers->batches.end(), batch));
+    return task;
+}
+
+void GifWorkerThread( GifWorkers* workers )
+{
+    std::unique_lock<std::mutex> guard(workers->lock);
+    for(;;)
+    {
+        workers->wake.wait(guard, [workers]{ return workers->stopping || !workers->batches.empty(); });
+        if(workers->batches.empty()) break;
+
+        GifTaskBatch* batch = workers->batches.front();
+        uint32_t task = GifTakeTask(workers, batch);
+        guard.unlock();
+        batch->run(batch->context, task);
+        guard.lock();
+        ++batch->finished;
+        workers->finished.notify_all();
+    }
+}
+
+// Starts numThreads-1 threads, the caller of GifRunTasks being the last; NULL if that leaves none
+GifWorkers* GifWorkersStart( uint32_t numThreads )
+{
+    if(numThreads < 2) return NULL;
+
+    GifWorkers* workers = new GifWorkers;
+    workers->stopping = false;
+    workers->batches.reserve(16);
+    for(uint32_t ii=1; ii<numThreads; ++ii)
+        workers->threads.push_back(std::thread(GifWorkerThread, workers));
+    return workers;
+}
+
+void GifWorkersStop( GifWorkers* workers )
+{
+    if(!workers) return;
+    {
+        std::lock_guard<std::mutex> guard(workers->lock);
+        workers->stopping = true;
+    }
+    workers->wake.notify_all();
+    for(size_t ii=0; ii<workers->threads.size(); ++ii)
+        workers->threads[ii].join();
+    delete workers;
+}
+
+// Runs count tasks on the workers and the calling thread, and returns once they're all done.
+// With no workers (NULL), the tasks run one after another on the calling thread.
+void GifRunTasks( GifWorkers* workers, void (*run)( void* context, uint32_t task ), void* context, uint32_t count )
+{
+    if(!workers || count < 2)
+    {
+        for(uint32_t ii=0; ii<count; ++ii) run(context, ii);
+        return;
+    }
+
+    GifTaskBatch batch = { run, context, count, 0, 0 };
+    std::unique_lock<std::mutex> guard(workers->lock);
+    workers->batches.push_back(&batch);
+    workers->wake.notify_all();
+
+    while(batch.next < batch.count)
+    {
+        uint32_t task = GifTakeTask(workers, &batch);
+        guard.unlock();
+        run(context, task);
+        guard.lock();
+        ++batch.finished;
+    }
+    workers->finished.wait(guard, [&batch]{ return batch.finished == batch.count; });
+}
+
 const int kGifTransIndex = 0;
 
 typedef struct
@@ -82,6 +369,18 @@ int GifIMax(int l, int r) { return l>r?l:r; }
 int GifIMin(int l, int r) { return l<r?l:r; }
 int GifIAbs(int i) { return i<0?-i:i; }
 
+// The row of the buffer that holds row y of the image, counting from the top:
+// with GIF_FLIP_VERT the buffer holds the bottom row first
+uint32_t GifBufferRow( uint32_t height, uint32_t y )
+{
+#ifdef GIF_FLIP_VERT
+    return height-1-y;
+#else
+    (void)height;
+    return y;
+#endif
+}
+
 // walks the k-d tree to pick the palette entry for a desired color.
 // Takes as in/out parameters the current best color and its error -
 // only changes them if it finds a better color in its subtree.
@@ -134,88 +433,422 @@ void GifGetClosestPaletteColor( GifPalette* pPal, int r, int g, int b, int* best
     }
 }
 
-void GifSwapPixels(uint8_t* image, int pixA, int pixB)
+#if defined(GIF_SSE2)
+// The smallest of sixteen 16-bit keys, compared as unsigned
+int GifMinKey16( __m128i lo, __m128i hi )
 {
-    uint8_t rA = image[pixA*4];
-    uint8_t gA = image[pixA*4+1];
-    uint8_t bA = image[pixA*4+2];
-    uint8_t aA = image[pixA*4+3];
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    __m128i keys = _mm_min_epi16(_mm_xor_si128(lo, bias), _mm_xor_si128(hi, bias));
+    keys = _mm_min_epi16(keys, _mm_shuffle_epi32(keys, _MM_SHUFFLE(1, 0, 3, 2)));
+    keys = _mm_min_epi16(keys, _mm_shuffle_epi32(keys, _MM_SHUFFLE(2, 3, 0, 1)));
+    keys = _mm_min_epi16(keys, _mm_shufflelo_epi16(keys, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (_mm_cvtsi128_si32(keys) & 0xffff) ^ 0x8000;
+}
+#endif
 
-    uint8_t rB = image[pixB*4];
-    uint8_t gB = image[pixB*4+1];
-    uint8_t bB = image[pixB*4+2];
-    uint8_t aB = image[pixA*4+3];
+// Picks the palette entry nearest a color, like GifGetClosestPaletteColor, by measuring the distance to
+// every entry and keeping the smallest; of equally distant entries it takes the lowest index. Takes the
+// current best color and its error as in/out parameters, and only changes them if it finds a closer entry.
+// 16 or 32 entries are measured at once in bytes, with distances saturating at 255; each byte
+// lane keeps the nearest entry it has seen, and the lanes are merged as 16-bit (distance << 8 | index) keys.
+// The nearest entry is almost always much closer than that; when it isn't, every entry is measured exactly.
+// Without SIMD, measuring every entry is slower than walking the k-d tree, so the tree is walked instead;
+// that finds an entry just as near, but not always the same one when several are.
+void GifFindPaletteColor( GifPalette* pPal, int r, int g, int b, int* bestInd, int* bestDiff )
+{
+#if !defined(GIF_SSE2)
+    GifGetClosestPaletteColor(pPal, r, g, b, bestInd, bestDiff, 1);
+#else
+    const int numColors = 1 << pPal->bitDepth;
 
-    image[pixA*4] = rB;
-    image[pixA*4+1] = gB;
-    image[pixA*4+2] = bB;
-    image[pixA*4+3] = aB;
+    // dithering can ask for colors outside 0-255; every entry is then farther away by the
+    // same amount, so measure from the clamped color and add the difference back
+    int overshoot = GifIMax(r-255, 0) + GifIMax(g-255, 0) + GifIMax(b-255, 0)
+                  + GifIMax(-r, 0) + GifIMax(-g, 0) + GifIMax(-b, 0);
+    r = GifIMin(GifIMax(r, 0), 255);
+    g = GifIMin(GifIMax(g, 0), 255);
+    b = GifIMin(GifIMax(b, 0), 255);
 
-    image[pixB*4] = rA;
-    image[pixB*4+1] = gA;
-    image[pixB*4+2] = bA;
-    image[pixB*4+3] = aA;
-}
+    int best = 1000000;
+    int bestEntry = kGifTransIndex;
+    int ii = 0;
 
-// just the partition operation from quicksort
-int GifPartition(uint8_t* image, const int left, const int right, const int elt, int pivotValue)
-{
-    int storeIndex = left;
-    bool split = 0;
-    for(int ii=left; ii<right; ++ii)
+    if(numColors >= 16)
     {
-        int arrayVal = image[ii*4+elt];
-        if( arrayVal < pivotValue )
+        int key = 0xffff;
+#if defined(GIF_AVX2)
+        if(numColors >= 32)
         {
-            GifSwapPixels(image, ii, storeIndex);
-            ++storeIndex;
+            const __m256i vr = _mm256_set1_epi8((char)r);
+            const __m256i vg = _mm256_set1_epi8((char)g);
+            const __m256i vb = _mm256_set1_epi8((char)b);
+            const __m256i step = _mm256_set1_epi8(32);
+            __m256i index = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                             16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+            __m256i laneMin = _mm256_set1_epi8((char)0xff);
+            __m256i laneIndex = _mm256_setzero_si256();
+
+            // the transparent entry is never picked
+            __m256i diff0 = _mm256_setr_epi8(-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+            for(; ii<numColors; ii+=32)
+            {
+                __m256i pr = _mm256_loadu_si256((const __m256i*)(pPal->r+ii));
+                __m256i pg = _mm256_loadu_si256((const __m256i*)(pPal->g+ii));
+                __m256i pb = _mm256_loadu_si256((const __m256i*)(pPal->b+ii));
+                __m256i dr = _mm256_or_si256(_mm256_subs_epu8(pr, vr), _mm256_subs_epu8(vr, pr));
+                __m256i dg = _mm256_or_si256(_mm256_subs_epu8(pg, vg), _mm256_subs_epu8(vg, pg));
+                __m256i db = _mm256_or_si256(_mm256_subs_epu8(pb, vb), _mm256_subs_epu8(vb, pb));
+                __m256i diff = _mm256_or_si256(_mm256_adds_epu8(_mm256_adds_epu8(dr, dg), db), diff0);
+                diff0 = _mm256_setzero_si256();
+
+                // a lane moves to the new entry only if it is strictly closer, so it keeps the first
+                __m256i notCloser = _mm256_cmpeq_epi8(_mm256_subs_epu8(laneMin, diff), _mm256_setzero_si256());
+                laneMin = _mm256_min_epu8(laneMin, diff);
+                laneIndex = _mm256_blendv_epi8(index, laneIndex, notCloser);
+                index = _mm256_add_epi8(index, step);
+            }
+
+            __m256i keys = _mm256_min_epu16(_mm256_unpacklo_epi8(laneIndex, laneMin), _mm256_unpackhi_epi8(laneIndex, laneMin));
+            key = GifMinKey16(_mm256_castsi256_si128(keys), _mm256_extracti128_si256(keys, 1));
         }
-        else if( arrayVal == pivotValue )
+        else
+#endif
         {
-            if(split)
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i vr = _mm_set1_epi8((char)r);
+            const __m128i vg = _mm_set1_epi8((char)g);
+            const __m128i vb = _mm_set1_epi8((char)b);
+            const __m128i step = _mm_set1_epi8(16);
+            __m128i index = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+            __m128i laneMin = _mm_set1_epi8((char)0xff);
+            __m128i laneIndex = zero;
+
+            // the transparent entry is never picked
+            __m128i diff0 = _mm_setr_epi8(-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+            for(; ii<numColors; ii+=16)
             {
-                GifSwapPixels(image, ii, storeIndex);
-                ++storeIndex;
+                __m128i pr = _mm_loadu_si128((const __m128i*)(pPal->r+ii));
+                __m128i pg = _mm_loadu_si128((const __m128i*)(pPal->g+ii));
+                __m128i pb = _mm_loadu_si128((const __m128i*)(pPal->b+ii));
+                __m128i dr = _mm_or_si128(_mm_subs_epu8(pr, vr), _mm_subs_epu8(vr, pr));
+                __m128i dg = _mm_or_si128(_mm_subs_epu8(pg, vg), _mm_subs_epu8(vg, pg));
+                __m128i db = _mm_or_si128(_mm_subs_epu8(pb, vb), _mm_subs_epu8(vb, pb));
+                __m128i diff = _mm_or_si128(_mm_adds_epu8(_mm_adds_epu8(dr, dg), db), diff0);
+                diff0 = zero;
+
+                // a lane moves to the new entry only if it is strictly closer, so it keeps the first
+                __m128i notCloser = _mm_cmpeq_epi8(_mm_subs_epu8(laneMin, diff), zero);
+                laneMin = _mm_min_epu8(laneMin, diff);
+                laneIndex = _mm_or_si128(_mm_andnot_si128(notCloser, index), _mm_and_si128(notCloser, laneIndex));
+                index = _mm_add_epi8(index, step);
             }
-            split = !split;
+
+            key = GifMinKey16(_mm_unpacklo_epi8(laneIndex, laneMin), _mm_unpackhi_epi8(laneIndex, laneMin));
+        }
+
+        if((key >> 8) < 255)
+        {
+            best = key >> 8;
+            bestEntry = key & 0xff;
+        }
+        else
+        {
+            ii = 0; // nothing within 255 in bytes: measure every entry exactly
         }
     }
-    return storeIndex;
+
+    // palettes too small for a vector, and colors far from every entry
+    for(; ii<numColors; ++ii)
+    {
+        if(ii == kGifTransIndex) continue;
+        int diff = GifIAbs(r - pPal->r[ii]) + GifIAbs(g - pPal->g[ii]) + GifIAbs(b - pPal->b[ii]);
+        if(diff < best)
+        {
+            best = diff;
+            bestEntry = ii;
+        }
+    }
+
+    if(best + overshoot < *bestDiff)
+    {
+        *bestInd = bestEntry;
+        *bestDiff = best + overshoot;
+    }
+#endif
+}
+
+// Colors of a frame, counted before the palette is built, so that the median split
+// works on the distinct colors rather than on every pixel.
+// If a frame has more than kGifMaxHistogramBins distinct colors, the histogram drops the
+// low bit of each component until they fit; a bin then holds every color that shares the
+// remaining bits, and keeps their average and extremes.
+const int kGifMaxHistogramBins = 1 << 15;
+
+typedef struct
+{
+    uint64_t sum[3];      // totals of each component over the pixels in the bin
+    uint32_t count;       // number of pixels
+    uint8_t color[3];     // average color, which the k-d tree is split on
+    uint8_t minColor[3];  // darkest and brightest value of each component,
+    uint8_t maxColor[3];  // for the dither palette's end entries
+    uint8_t padding[3];   // make padding explicit
+} GifColorBin;
+
+typedef struct
+{
+    GifColorBin* bins;
+    int numBins;
+    int maxBins;
+    uint32_t* slotKeys;   // color key + 1, 0 for an empty slot
+    uint16_t* slotBins;   // bin of each slot
+    int slotBits;
+    int shift;            // low bits dropped from each component
+} GifHistogram;
+
+uint32_t GifHistogramKey( const GifHistogram* hist, uint32_t r, uint32_t g, uint32_t b )
+{
+    return (r >> hist->shift) << 16 | (g >> hist->shift) << 8 | (b >> hist->shift);
+}
+
+// finds the bin for a key, or the empty slot to put it in
+uint32_t GifHistogramSlot( const GifHistogram* hist, uint32_t key )
+{
+    const uint32_t mask = (1u << hist->slotBits) - 1;
+    uint32_t slot = (key * 2654435761u) >> (32 - hist->slotBits);
+    while(hist->slotKeys[slot] && hist->slotKeys[slot] != key+1)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+// Drops another bit from each component and merges the bins that now share a key
+void GifHistogramCoarsen( GifHistogram* hist )
+{
+    ++hist->shift;
+    memset(hist->slotKeys, 0, sizeof(uint32_t) << hist->slotBits);
+
+    int numBins = 0;
+    for(int ii=0; ii<hist->numBins; ++ii)
+    {
+        GifColorBin* bin = &hist->bins[ii];
+        uint32_t key = GifHistogramKey(hist, bin->minColor[0], bin->minColor[1], bin->minColor[2]);
+        uint32_t slot = GifHistogramSlot(hist, key);
+
+        if(!hist->slotKeys[slot])
+        {
+            hist->slotKeys[slot] = key+1;
+            hist->slotBins[slot] = (uint16_t)numBins;
+            hist->bins[numBins++] = *bin;
+            continue;
+        }
+
+        GifColorBin* merged = &hist->bins[hist->slotBins[slot]];
+        merged->count += bin->count;
+        for(int cc=0; cc<3; ++cc)
+        {
+            merged->sum[cc] += bin->sum[cc];
+            merged->minColor[cc] = (uint8_t)GifIMin(merged->minColor[cc], bin->minColor[cc]);
+            merged->maxColor[cc] = (uint8_t)GifIMax(merged->maxColor[cc], bin->maxColor[cc]);
+        }
+    }
+    hist->numBins = numBins;
+}
+
+// Returns the bin a color goes in, starting an empty one for it if there is none yet
+GifColorBin* GifHistogramBin( GifHistogram* hist, const uint8_t* color )
+{
+    uint32_t key = GifHistogramKey(hist, color[0], color[1], color[2]);
+    uint32_t slot = GifHistogramSlot(hist, key);
+    if(!hist->slotKeys[slot])
+    {
+        while(!hist->slotKeys[slot] && hist->numBins == hist->maxBins)
+        {
+            GifHistogramCoarsen(hist);
+            key = GifHistogramKey(hist, color[0], color[1], color[2]);
+            slot = GifHistogramSlot(hist, key);
+        }
+
+        if(!hist->slotKeys[slot])
+        {
+            GifColorBin* bin = &hist->bins[hist->numBins];
+            memset(bin, 0, sizeof(GifColorBin));
+            memcpy(bin->minColor, color, 3);
+            memcpy(bin->maxColor, color, 3);
+
+            hist->slotKeys[slot] = key+1;
+            hist->slotBins[slot] = (uint16_t)hist->numBins++;
+        }
+    }
+
+    return &hist->bins[hist->slotBins[slot]];
+}
+
+// Counts count pixels of color 0x00BBGGRR
+void GifHistogramAdd( GifHistogram* hist, uint32_t rgb, uint32_t count )
+{
+    uint8_t color[3] = { (uint8_t)(rgb & 0xff), (uint8_t)((rgb >> 8) & 0xff), (uint8_t)((rgb >> 16) & 0xff) };
+
+    GifColorBin* bin = GifHistogramBin(hist, color);
+    bin->count += count;
+    for(int cc=0; cc<3; ++cc)
+    {
+        bin->sum[cc] += (uint64_t)color[cc] * count;
+        bin->minColor[cc] = (uint8_t)GifIMin(bin->minColor[cc], color[cc]);
+        bin->maxColor[cc] = (uint8_t)GifIMax(bin->maxColor[cc], color[cc]);
+    }
+}
+
+// Adds the counts of another histogram to hist
+void GifHistogramMerge( GifHistogram* hist, const GifHistogram* other )
+{
+    while(hist->shift < other->shift)
+        GifHistogramCoarsen(hist);
+
+    for(int ii=0; ii<other->numBins; ++ii)
+    {
+        const GifColorBin* from = &other->bins[ii];
+        GifColorBin* bin = GifHistogramBin(hist, from->minColor);
+        bin->count += from->count;
+        for(int cc=0; cc<3; ++cc)
+        {
+            bin->sum[cc] += from->sum[cc];
+            bin->minColor[cc] = (uint8_t)GifIMin(bin->minColor[cc], from->minColor[cc]);
+            bin->maxColor[cc] = (uint8_t)GifIMax(bin->maxColor[cc], from->maxColor[cc]);
+        }
+    }
+}
+
+// Sets up an empty histogram with room for the colors of numPixels pixels (all of them being different),
+// in temp memory (from arena) unless it's to outlive the function making it
+void GifHistogramInit( GifHistogram* hist, uint32_t numPixels, bool persistent, GifArena* arena = NULL )
+{
+    hist->maxBins = numPixels < (uint32_t)kGifMaxHistogramBins? (int)GifIMax((int)numPixels, 1) : kGifMaxHistogramBins;
+    hist->numBins = 0;
+    hist->shift = 0;
+    hist->slotBits = 1;
+    while((1 << hist->slotBits) < hist->maxBins * 2) ++hist->slotBits;
+
+    size_t binsSize = sizeof(GifColorBin) * (size_t)hist->maxBins;
+    hist->bins = (GifColorBin*)(persistent? GifMalloc(binsSize) : GifArenaAlloc(arena, binsSize));
+    hist->slotKeys = (uint32_t*)(persistent? GifMalloc(sizeof(uint32_t) << hist->slotBits) : GifArenaAlloc(arena, sizeof(uint32_t) << hist->slotBits));
+    hist->slotBins = (uint16_t*)(persistent? GifMalloc(sizeof(uint16_t) << hist->slotBits) : GifArenaAlloc(arena, sizeof(uint16_t) << hist->slotBits));
+    memset(hist->slotKeys, 0, sizeof(uint32_t) << hist->slotBits);
+}
+
+void GifHistogramFree( GifHistogram* hist, bool persistent, GifArena* arena = NULL )
+{
+    if(persistent)
+    {
+        GIF_FREE(hist->slotBins);
+        GIF_FREE(hist->slotKeys);
+        GIF_FREE(hist->bins);
+    }
+    else
+    {
+        GifArenaFree(arena, hist->slotBins);
+        GifArenaFree(arena, hist->slotKeys);
+        GifArenaFree(arena, hist->bins);
+    }
 }
 
-// Perform an incomplete sort, finding all elements above and below the desired median
-void GifPartitionByMedian(uint8_t* image, int left, int right, int com, int neededCenter)
+// Counts the colors of the pixels of nextFrame that differ from lastFrame (all of them if lastFrame is NULL).
+// Runs of one color - most of a rendered frame - are counted without a hash lookup per pixel,
+// four pixels at a time where SIMD is available.
+void GifBuildHistogram( GifHistogram* hist, const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t numPixels )
 {
-    if(left < right-1)
+    uint32_t runColor = 0xffffffff;  // never matches a pixel, whose alpha byte is cleared
+    uint32_t runCount = 0;
+
+    uint32_t ii = 0;
+#ifdef GIF_SSE2
+    const __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+    for( ; ii+4 <= numPixels; ii+=4 )
+    {
+        __m128i next = _mm_and_si128(_mm_loadu_si128((const __m128i*)(nextFrame + ii*4)), rgbMask);
+        int inRun = _mm_movemask_epi8(_mm_cmpeq_epi32(next, _mm_set1_epi32((int)runColor)));
+        int unchanged = 0;
+        if(lastFrame)
+        {
+            __m128i last = _mm_and_si128(_mm_loadu_si128((const __m128i*)(lastFrame + ii*4)), rgbMask);
+            unchanged = _mm_movemask_epi8(_mm_cmpeq_epi32(next, last));
+        }
+
+        if((inRun | unchanged) == 0xffff)
+        {
+            // every pixel either continues the run or is skipped
+            int counted = inRun & ~unchanged;
+            runCount += (uint32_t)((counted & 1) + ((counted >> 4) & 1) + ((counted >> 8) & 1) + ((counted >> 12) & 1));
+            continue;
+        }
+
+        for(uint32_t jj=ii; jj<ii+4; ++jj)
+        {
+            if((unchanged >> ((jj-ii)*4)) & 1) continue;
+
+            const uint8_t* pix = nextFrame + jj*4;
+            uint32_t rgb = (uint32_t)pix[0] | (uint32_t)pix[1] << 8 | (uint32_t)pix[2] << 16;
+            if(rgb == runColor) { ++runCount; continue; }
+
+            if(runCount) GifHistogramAdd(hist, runColor, runCount);
+            runColor = rgb;
+            runCount = 1;
+        }
+    }
+#endif
+
+    for( ; ii<numPixels; ++ii )
     {
-        int pivotValue = image[(neededCenter)*4+com];
-        GifSwapPixels(image, neededCenter, right-1);
-        int pivotIndex = GifPartition(image, left, right-1, com, pivotValue);
-        GifSwapPixels(image, pivotIndex, right-1);
+        const uint8_t* pix = nextFrame + ii*4;
+        if(lastFrame)
+        {
+            const uint8_t* lastPix = lastFrame + ii*4;
+            if(lastPix[0] == pix[0] && lastPix[1] == pix[1] && lastPix[2] == pix[2])
+                continue;
+        }
+
+        uint32_t rgb = (uint32_t)pix[0] | (uint32_t)pix[1] << 8 | (uint32_t)pix[2] << 16;
+        if(rgb == runColor) { ++runCount; continue; }
 
-        // Only "sort" the section of the array that contains the median
-        if(pivotIndex > neededCenter)
-            GifPartitionByMedian(image, left, pivotIndex, com, neededCenter);
+        if(runCount) GifHistogramAdd(hist, runColor, runCount);
+        runColor = rgb;
+        runCount = 1;
+    }
+
+    if(runCount) GifHistogramAdd(hist, runColor, runCount);
+}
 
-        if(pivotIndex < neededCenter)
-            GifPartitionByMedian(image, pivotIndex+1, right, com, neededCenter);
+// Works out the average color of each bin (just the color itself, unless the histogram was coarsened)
+void GifHistogramFinish( GifHistogram* hist )
+{
+    for(int bb=0; bb<hist->numBins; ++bb)
+    {
+        GifColorBin* bin = &hist->bins[bb];
+        for(int cc=0; cc<3; ++cc)
+            bin->color[cc] = (uint8_t)((bin->sum[cc] + bin->count/2) / bin->count);
     }
 }
 
-// Just partition around a given pivot, returning the split point
-int GifPartitionByMean(uint8_t* image, int left, int right, int com, int neededMean)
+// Moves the bins whose component com is below splitValue to the front, returning how many there are
+int GifPartitionBins( GifColorBin* bins, int numBins, int com, int splitValue )
 {
-    if(left < right-1)
+    int storeIndex = 0;
+    for(int ii=0; ii<numBins; ++ii)
     {
-        return GifPartition(image, left, right-1, com, neededMean);
+        if(bins[ii].color[com] < splitValue)
+        {
+            GifColorBin temp = bins[ii];
+            bins[ii] = bins[storeIndex];
+            bins[storeIndex] = temp;
+            ++storeIndex;
+        }
     }
-    return left;
+    return storeIndex;
 }
 
-// Builds a palette by creating a balanced k-d tree of all pixels in the image
-void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel, bool buildForDither, GifPalette* pal)
+// Builds a palette by creating a balanced k-d tree of the colors in the histogram, weighted by pixel count
+void GifSplitPalette(GifColorBin* bins, int numBins, int treeNode, int treeLevel, bool buildForDither, GifPalette* pal)
 {
-    if(numPixels == 0)
+    if(numBins == 0)
         return;
 
     int numColors = (1 << pal->bitDepth);
@@ -234,11 +867,11 @@ void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel,
             {
                 // special case: the darkest color in the image
                 uint32_t r=255, g=255, b=255;
-                for(int ii=0; ii<numPixels; ++ii)
+                for(int ii=0; ii<numBins; ++ii)
                 {
-                    r = (uint32_t)GifIMin((int32_t)r, image[ii * 4 + 0]);
-                    g = (uint32_t)GifIMin((int32_t)g, image[ii * 4 + 1]);
-                    b = (uint32_t)GifIMin((int32_t)b, image[ii * 4 + 2]);
+                    r = (uint32_t)GifIMin((int32_t)r, bins[ii].minColor[0]);
+                    g = (uint32_t)GifIMin((int32_t)g, bins[ii].minColor[1]);
+                    b = (uint32_t)GifIMin((int32_t)b, bins[ii].minColor[2]);
                 }
 
                 pal->r[entry] = (uint8_t)r;
@@ -252,11 +885,11 @@ void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel,
             {
                 // special case: the lightest color in the image
                 uint32_t r=0, g=0, b=0;
-                for(int ii=0; ii<numPixels; ++ii)
+                for(int ii=0; ii<numBins; ++ii)
                 {
-                    r = (uint32_t)GifIMax((int32_t)r, image[ii * 4 + 0]);
-                    g = (uint32_t)GifIMax((int32_t)g, image[ii * 4 + 1]);
-                    b = (uint32_t)GifIMax((int32_t)b, image[ii * 4 + 2]);
+                    r = (uint32_t)GifIMax((int32_t)r, bins[ii].maxColor[0]);
+                    g = (uint32_t)GifIMax((int32_t)g, bins[ii].maxColor[1]);
+                    b = (uint32_t)GifIMax((int32_t)b, bins[ii].maxColor[2]);
                 }
 
                 pal->r[entry] = (uint8_t)r;
@@ -268,21 +901,22 @@ void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel,
         }
 
         // otherwise, take the average of all colors in this subcube
-        uint64_t r=0, g=0, b=0;
-        for(int ii=0; ii<numPixels; ++ii)
+        uint64_t r=0, g=0, b=0, numPixels=0;
+        for(int ii=0; ii<numBins; ++ii)
         {
-            r += image[ii*4+0];
-            g += image[ii*4+1];
-            b += image[ii*4+2];
+            r += bins[ii].sum[0];
+            g += bins[ii].sum[1];
+            b += bins[ii].sum[2];
+            numPixels += bins[ii].count;
         }
 
-        r += (uint64_t)numPixels / 2;  // round to nearest
-        g += (uint64_t)numPixels / 2;
-        b += (uint64_t)numPixels / 2;
+        r += numPixels / 2;  // round to nearest
+        g += numPixels / 2;
+        b += numPixels / 2;
 
-        r /= (uint64_t)numPixels;
-        g /= (uint64_t)numPixels;
-        b /= (uint64_t)numPixels;
+        r /= numPixels;
+        g /= numPixels;
+        b /= numPixels;
 
         pal->r[entry] = (uint8_t)r;
         pal->g[entry] = (uint8_t)g;
@@ -295,11 +929,12 @@ void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel,
     int minR = 255, maxR = 0;
     int minG = 255, maxG = 0;
     int minB = 255, maxB = 0;
-    for(int ii=0; ii<numPixels; ++ii)
+    uint64_t numPixels = 0;
+    for(int ii=0; ii<numBins; ++ii)
     {
-        int r = image[ii*4+0];
-        int g = image[ii*4+1];
-        int b = image[ii*4+2];
+        int r = bins[ii].color[0];
+        int g = bins[ii].color[1];
+        int b = bins[ii].color[2];
 
         if(r > maxR) maxR = r;
         if(r < minR) minR = r;
@@ -309,6 +944,8 @@ void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel,
 
         if(b > maxB) maxB = b;
         if(b < minB) minB = b;
+
+        numPixels += bins[ii].count;
     }
 
     int rRange = maxR - minR;
@@ -320,81 +957,97 @@ void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel,
     if(bRange > gRange) { splitCom = 2; rangeMin = minB; rangeMax = maxB; }
     if(rRange > bRange && rRange > gRange) { splitCom = 0; rangeMin = minR; rangeMax = maxR; }
 
-    int subPixelsA = numPixels / 2;
+    // the leaves under this node - except the one the transparent entry takes from the leftmost subtree
+    int numLeaves = numColors >> treeLevel;
+    bool holdsTransparent = (treeNode & (treeNode-1)) == 0;
+
+    if( numBins <= numLeaves - (holdsTransparent? 1 : 0) )
+    {
+        // few enough colors for each to get an entry of its own: split them by count rather than
+        // by pixels, so that neither subtree ends up with more colors than entries
+        int leavesA = numLeaves/2 - (holdsTransparent? 1 : 0);
+        int leavesB = numLeaves/2;
+        int subBinsA = GifIMin(GifIMax(numBins/2, numBins - leavesB), leavesA);
+
+        std::nth_element(bins, bins + subBinsA, bins + numBins,
+                         [splitCom](const GifColorBin& a, const GifColorBin& b) { return a.color[splitCom] < b.color[splitCom]; });
+        int splitValue = bins[subBinsA].color[splitCom];
+
+        pal->treeSplitElt[treeNode] = (uint8_t)splitCom;
+        pal->treeSplit[treeNode] = (uint8_t)splitValue;
+
+        GifSplitPalette(bins,          subBinsA,         treeNode*2,   treeLevel+1, buildForDither, pal);
+        GifSplitPalette(bins+subBinsA, numBins-subBinsA, treeNode*2+1, treeLevel+1, buildForDither, pal);
+        return;
+    }
+
+    // the median pixel's value along that axis, from a count of the pixels at each value
+    uint32_t valueCounts[256];
+    memset(valueCounts, 0, sizeof(valueCounts));
+    for(int ii=0; ii<numBins; ++ii)
+        valueCounts[bins[ii].color[splitCom]] += bins[ii].count;
 
-    GifPartitionByMedian(image, 0, numPixels, splitCom, subPixelsA);
-    int splitValue = image[subPixelsA*4+splitCom];
+    int splitValue = rangeMin;
+    uint64_t below = 0;
+    while(below + valueCounts[splitValue] <= numPixels / 2)
+        below += valueCounts[splitValue++];
 
     // if the split is very unbalanced, split at the mean instead of the median to preserve rare colors
     int splitUnbalance = GifIAbs( (splitValue - rangeMin) - (rangeMax - splitValue) );
     if( splitUnbalance > (1536 >> treeLevel) )
-    {
         splitValue = rangeMin + (rangeMax-rangeMin) / 2;
-        subPixelsA = GifPartitionByMean(image, 0, numPixels, splitCom, splitValue);
-    }
+
+    // a bin can't be divided between the subtrees like the pixels of one color could,
+    // so make sure the lower subtree gets at least one
+    if( splitValue == rangeMin && rangeMax > rangeMin )
+        ++splitValue;
+
+    int subBinsA = GifPartitionBins(bins, numBins, splitCom, splitValue);
 
     // add the bottom node for the transparency index
     if( treeNode == numColors/2 )
     {
-        subPixelsA = 0;
+        subBinsA = 0;
         splitValue = 0;
     }
 
-    int subPixelsB = numPixels-subPixelsA;
+    int subBinsB = numBins-subBinsA;
     pal->treeSplitElt[treeNode] = (uint8_t)splitCom;
     pal->treeSplit[treeNode] = (uint8_t)splitValue;
 
-    GifSplitPalette(image,              subPixelsA, treeNode*2,   treeLevel+1, buildForDither, pal);
-    GifSplitPalette(image+subPixelsA*4, subPixelsB, treeNode*2+1, treeLevel+1, buildForDither, pal);
+    GifSplitPalette(bins,          subBinsA, treeNode*2,   treeLevel+1, buildForDither, pal);
+    GifSplitPalette(bins+subBinsA, subBinsB, treeNode*2+1, treeLevel+1, buildForDither, pal);
 }
 
-// Finds all pixels that have changed from the previous image and
-// moves them to the fromt of th buffer.
-// This allows us to build a palette optimized for the colors of the
-// changed pixels only.
-int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixels )
+// Creates a palette by placing the histogram's colors in a k-d tree and then averaging the blocks at the bottom.
+// This is known as the "median split" technique
+void GifPaletteFromHistogram( GifHistogram* hist, int bitDepth, bool buildForDither, GifPalette* pPal )
 {
-    int numChanged = 0;
-    uint8_t* writeIter = frame;
-
-    for (int ii=0; ii<numPixels; ++ii)
+    GifHistogramFinish(hist);
+
+    // the splits break ties by the order of the bins, which is the order the colors were first seen in;
+    // sort them so that the palette only depends on the colors (e.g. not on which way up the frame is)
+    std::sort(hist->bins, hist->bins + hist->numBins, [hist](const GifColorBin& a, const GifColorBin& b) {
+        return GifHistogramKey(hist, a.minColor[0], a.minColor[1], a.minColor[2]) <
+               GifHistogramKey(hist, b.minColor[0], b.minColor[1], b.minColor[2]);
+    });
+
+    // bitDepth is the most bits to use: a frame with few colors (typically a delta frame) gets a
+    // palette just big enough to hold every one of them exactly - next to the transparent entry -
+    // which also makes for a smaller local color table and shorter LZW codes.
+    // GIF needs at least 2 bits for the LZW codes.
+    if(hist->shift == 0)
     {
-        if(lastFrame[0] != frame[0] ||
-           lastFrame[1] != frame[1] ||
-           lastFrame[2] != frame[2])
-        {
-            writeIter[0] = frame[0];
-            writeIter[1] = frame[1];
-            writeIter[2] = frame[2];
-            ++numChanged;
-            writeIter += 4;
-        }
-        lastFrame += 4;
-        frame += 4;
+        while(bitDepth > 2 && hist->numBins < (1 << (bitDepth-1)))
+            --bitDepth;
     }
 
-    return numChanged;
-}
-
-// Creates a palette by placing all the image pixels in a k-d tree and then averaging the blocks at the bottom.
-// This is known as the "median split" technique
-void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal )
-{
+    // entries in subtrees with no pixels are never assigned by GifSplitPalette;
+    // clear them so the output doesn't depend on uninitialized memory
+    memset(pPal, 0, sizeof(GifPalette));
     pPal->bitDepth = bitDepth;
 
-    // SplitPalette is destructive (it sorts the pixels by color) so
-    // we must create a copy of the image for it to destroy
-    size_t imageSize = (size_t)(width * height * 4 * sizeof(uint8_t));
-    uint8_t* destroyableImage = (uint8_t*)GIF_TEMP_MALLOC(imageSize);
-    memcpy(destroyableImage, nextFrame, imageSize);
-
-    int numPixels = (int)(width * height);
-    if(lastFrame)
-        numPixels = GifPickChangedPixels(lastFrame, destroyableImage, numPixels);
-
-    GifSplitPalette(destroyableImage, numPixels, 1, 0, buildForDither, pPal);
-
-    GIF_TEMP_FREE(destroyableImage);
+    GifSplitPalette(hist->bins, hist->numBins, 1, 0, buildForDither, pPal);
 
     // add the bottom node for the transparency index
     pPal->treeSplit[1 << (bitDepth-1)] = 0;
@@ -403,34 +1056,113 @@ void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_
     pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
 }
 
-// Implements Floyd-Steinberg dithering, writes palette value to alpha
-void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+// Creates a palette for the pixels of nextFrame that differ from lastFrame (all of them if lastFrame is NULL)
+void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal, GifArena* arena = NULL )
 {
-    int numPixels = (int)(width * height);
+    // count the colors of the changed pixels, so that the palette is optimized for those only
+    GifHistogram hist;
+    GifHistogramInit(&hist, width * height, false, arena);
+    GifBuildHistogram(&hist, lastFrame, nextFrame, width * height);
 
-    // quantPixels initially holds color*256 for all pixels
-    // The extra 8 bits of precision allow for sub-single-color error values
-    // to be propagated
-    int32_t *quantPixels = (int32_t *)GIF_TEMP_MALLOC(sizeof(int32_t) * (size_t)numPixels * 4);
+    GifPaletteFromHistogram(&hist, bitDepth, buildForDither, pPal);
+
+    GifHistogramFree(&hist, false, arena);
+}
+
+// One strip of rows for GifCountFrameColors to count
+struct GifCountStrip
+{
+    GifHistogram hist;
+    const uint8_t* lastFrame;
+    const uint8_t* nextFrame;
+    uint32_t numPixels;
+};
+
+void GifCountStripTask( void* context, uint32_t task )
+{
+    GifCountStrip* strip = (GifCountStrip*)context + task;
+    GifBuildHistogram(&strip->hist, strip->lastFrame, strip->nextFrame, strip->numPixels);
+}
 
-    for( int ii=0; ii<numPixels*4; ++ii )
+// Adds the colors of the pixels of nextFrame that differ from lastFrame (all of them if lastFrame is NULL)
+// to hist. Large frames are counted in strips on the writer's workers, if given, then merged.
+void GifCountFrameColors( GifHistogram* hist, const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, GifArena* arena = NULL, GifWorkers* workers = NULL )
+{
+    const uint32_t kMinPixelsPerStrip = 1 << 16;
+    const uint32_t kMaxStrips = 8;
+
+    uint32_t numStrips = workers? GifIMin((int)workers->threads.size() + 1, (int)kMaxStrips) : 1;
+    numStrips = GifIMin((int)numStrips, (int)(width * height / kMinPixelsPerStrip));
+    if(numStrips < 1) numStrips = 1;
+
+    GifCountStrip strips[kMaxStrips];
+    for(uint32_t tt=0; tt<numStrips; ++tt)
     {
-        uint8_t pix = nextFrame[ii];
-        int32_t pix16 = (int32_t)(pix) * 256;
-        quantPixels[ii] = pix16;
+        uint32_t firstRow = height * tt / numStrips;
+        uint32_t endRow = height * (tt+1) / numStrips;
+        size_t offset = (size_t)firstRow * width * 4;
+
+        GifHistogramInit(&strips[tt].hist, (endRow - firstRow) * width, false, arena);
+        strips[tt].lastFrame = lastFrame? lastFrame + offset : NULL;
+        strips[tt].nextFrame = nextFrame + offset;
+        strips[tt].numPixels = (endRow - firstRow) * width;
     }
 
-    for( uint32_t yy=0; yy<height; ++yy )
-    {
-        for( uint32_t xx=0; xx<width; ++xx )
-        {
-            int32_t* nextPix = quantPixels + 4*(yy*width+xx);
-            const uint8_t* lastPix = lastFrame? lastFrame + 4*(yy*width+xx) : NULL;
+    GifRunTasks(workers, GifCountStripTask, strips, numStrips);
 
-            // Compute the colors we want (rounding to nearest)
-            int32_t rr = (nextPix[0] + 127) / 256;
-            int32_t gg = (nextPix[1] + 127) / 256;
-            int32_t bb = (nextPix[2] + 127) / 256;
+    for(uint32_t tt=0; tt<numStrips; ++tt)
+        GifHistogramMerge(hist, &strips[tt].hist);
+    for(uint32_t tt=numStrips; tt>0; --tt)
+        GifHistogramFree(&strips[tt-1].hist, false, arena);
+}
+
+// Adds a share of a pixel's quantization error to a neighbor, keeping it from going negative
+void GifDitherAddError( int32_t* pix, int32_t r_err, int32_t g_err, int32_t b_err, int weight )
+{
+    pix[0] += GifIMax( -pix[0], r_err * weight / 16 );
+    pix[1] += GifIMax( -pix[1], g_err * weight / 16 );
+    pix[2] += GifIMax( -pix[2], b_err * weight / 16 );
+}
+
+// Implements Floyd-Steinberg dithering, writes palette value to alpha.
+// Each pixel depends on the one before it, across row ends too, so a frame is dithered on one thread;
+// GifSetAsync dithers several frames at once instead.
+void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifArena* arena = NULL )
+{
+    int numPixels = (int)(width * height);
+
+    // quantPixels initially holds color*256 for all pixels, top row first
+    // The extra 8 bits of precision allow for sub-single-color error values
+    // to be propagated
+    int32_t* quantPixels = (int32_t*)GifArenaAlloc(arena, sizeof(int32_t) * (size_t)numPixels * 3);
+
+    for( uint32_t yy=0; yy<height; ++yy )
+    {
+        const uint8_t* row = nextFrame + (size_t)GifBufferRow(height, yy)*width*4;
+        int32_t* quantRow = quantPixels + (size_t)yy*width*3;
+        for( uint32_t xx=0; xx<width; ++xx )
+        {
+            quantRow[xx*3+0] = (int32_t)(row[xx*4+0]) * 256;
+            quantRow[xx*3+1] = (int32_t)(row[xx*4+1]) * 256;
+            quantRow[xx*3+2] = (int32_t)(row[xx*4+2]) * 256;
+        }
+    }
+
+    for( uint32_t yy=0; yy<height; ++yy )
+    {
+        // error runs down the image, which is up the buffer with GIF_FLIP_VERT
+        size_t rowStart = (size_t)GifBufferRow(height, yy)*width;
+
+        for( uint32_t xx=0; xx<width; ++xx )
+        {
+            int32_t* nextPix = quantPixels + 3*((size_t)yy*width+xx);
+            uint8_t* outPix = outFrame + 4*(rowStart+xx);
+            const uint8_t* lastPix = lastFrame? lastFrame + 4*(rowStart+xx) : NULL;
+
+            // Compute the colors we want (rounding to nearest)
+            int32_t rr = (nextPix[0] + 127) / 256;
+            int32_t gg = (nextPix[1] + 127) / 256;
+            int32_t bb = (nextPix[2] + 127) / 256;
 
             // if it happens that we want the color from last frame, then just write out
             // a transparent pixel
@@ -439,10 +1171,10 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
                lastPix[1] == gg &&
                lastPix[2] == bb )
             {
-                nextPix[0] = rr;
-                nextPix[1] = gg;
-                nextPix[2] = bb;
-                nextPix[3] = kGifTransIndex;
+                outPix[0] = (uint8_t)rr;
+                outPix[1] = (uint8_t)gg;
+                outPix[2] = (uint8_t)bb;
+                outPix[3] = kGifTransIndex;
                 continue;
             }
 
@@ -450,17 +1182,17 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
             int32_t bestInd = kGifTransIndex;
 
             // Search the palete
-            GifGetClosestPaletteColor(pPal, rr, gg, bb, &bestInd, &bestDiff, 1);
+            GifFindPaletteColor(pPal, rr, gg, bb, &bestInd, &bestDiff);
 
-            // Write the result to the temp buffer
             int32_t r_err = nextPix[0] - (int32_t)(pPal->r[bestInd]) * 256;
             int32_t g_err = nextPix[1] - (int32_t)(pPal->g[bestInd]) * 256;
             int32_t b_err = nextPix[2] - (int32_t)(pPal->b[bestInd]) * 256;
 
-            nextPix[0] = pPal->r[bestInd];
-            nextPix[1] = pPal->g[bestInd];
-            nextPix[2] = pPal->b[bestInd];
-            nextPix[3] = bestInd;
+            // Write the result to the output buffer (lastPix may be the same memory, and is done with)
+            outPix[0] = pPal->r[bestInd];
+            outPix[1] = pPal->g[bestInd];
+            outPix[2] = pPal->b[bestInd];
+            outPix[3] = (uint8_t)bestInd;
 
             // Propagate the error to the four adjacent locations
             // that we haven't touched yet
@@ -470,50 +1202,60 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
             int quantloc_1 = (int)(yy * width + width + xx + 1);
 
             if(quantloc_7 < numPixels)
-            {
-                int32_t* pix7 = quantPixels+4*quantloc_7;
-                pix7[0] += GifIMax( -pix7[0], r_err * 7 / 16 );
-                pix7[1] += GifIMax( -pix7[1], g_err * 7 / 16 );
-                pix7[2] += GifIMax( -pix7[2], b_err * 7 / 16 );
-            }
-
+                GifDitherAddError(quantPixels+3*quantloc_7, r_err, g_err, b_err, 7);
             if(quantloc_3 < numPixels)
-            {
-                int32_t* pix3 = quantPixels+4*quantloc_3;
-                pix3[0] += GifIMax( -pix3[0], r_err * 3 / 16 );
-                pix3[1] += GifIMax( -pix3[1], g_err * 3 / 16 );
-                pix3[2] += GifIMax( -pix3[2], b_err * 3 / 16 );
-            }
-
+                GifDitherAddError(quantPixels+3*quantloc_3, r_err, g_err, b_err, 3);
             if(quantloc_5 < numPixels)
-            {
-                int32_t* pix5 = quantPixels+4*quantloc_5;
-                pix5[0] += GifIMax( -pix5[0], r_err * 5 / 16 );
-                pix5[1] += GifIMax( -pix5[1], g_err * 5 / 16 );
-                pix5[2] += GifIMax( -pix5[2], b_err * 5 / 16 );
-            }
-
+                GifDitherAddError(quantPixels+3*quantloc_5, r_err, g_err, b_err, 5);
             if(quantloc_1 < numPixels)
-            {
-                int32_t* pix1 = quantPixels+4*quantloc_1;
-                pix1[0] += GifIMax( -pix1[0], r_err / 16 );
-                pix1[1] += GifIMax( -pix1[1], g_err / 16 );
-                pix1[2] += GifIMax( -pix1[2], b_err / 16 );
-            }
+                GifDitherAddError(quantPixels+3*quantloc_1, r_err, g_err, b_err, 1);
         }
     }
 
-    // Copy the palettized result to the output buffer
-    for( int ii=0; ii<numPixels*4; ++ii )
-    {
-        outFrame[ii] = (uint8_t)quantPixels[ii];
-    }
+    GifArenaFree(arena, quantPixels);
+}
+
+const int kGifColorCacheBits = 12;
+
+// Remembers the palette index picked for recently seen colors, so pixels that repeat
+// a color skip the palette search. Direct-mapped: a colliding color replaces the old one.
+// Entries are only valid for the palette they were computed with.
+typedef struct
+{
+    GifPalette pal;
+    uint32_t keys[1 << kGifColorCacheBits];     // 0x01RRGGBB when in use, 0 when empty
+    uint8_t indices[1 << kGifColorCacheBits];
+} GifColorCache;
+
+// Points the cache at the palette about to be used; entries carry over only if it is
+// identical to the palette they were computed with (e.g. the previous frame's)
+void GifColorCacheSetPalette( GifColorCache* cache, const GifPalette* pPal )
+{
+    if(memcmp(&cache->pal, pPal, sizeof(GifPalette)) == 0) return;
 
-    GIF_TEMP_FREE(quantPixels);
+    cache->pal = *pPal;
+    memset(cache->keys, 0, sizeof(cache->keys));
 }
 
-// Picks palette colors for the image using simple thresholding, no dithering
-void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+// Palette index for a color, from the cache if it has been seen with this palette before
+uint8_t GifCachedPaletteColor( GifPalette* pPal, GifColorCache* cache, uint8_t r, uint8_t g, uint8_t b )
+{
+    uint32_t key = 0x1000000u | ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+    uint32_t slot = (key * 2654435761u) >> (32 - kGifColorCacheBits);
+    if(cache->keys[slot] == key) return cache->indices[slot];
+
+    int32_t bestDiff = 1000000;
+    int32_t bestInd = 1;
+    GifFindPaletteColor(pPal, r, g, b, &bestInd, &bestDiff);
+
+    cache->keys[slot] = key;
+    cache->indices[slot] = (uint8_t)bestInd;
+    return (uint8_t)bestInd;
+}
+
+// Picks palette colors for the image using simple thresholding, no dithering.
+// cache may be NULL; otherwise it must have been pointed at pPal with GifColorCacheSetPalette.
+void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal, GifColorCache* cache )
 {
     uint32_t numPixels = width*height;
     for( uint32_t ii=0; ii<numPixels; ++ii )
@@ -533,15 +1275,29 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
         else
         {
             // palettize the pixel
-            int32_t bestDiff = 1000000;
             int32_t bestInd = 1;
-            GifGetClosestPaletteColor(pPal, nextFrame[0], nextFrame[1], nextFrame[2], &bestInd, &bestDiff, 1);
+            if(cache)
+            {
+                bestInd = GifCachedPaletteColor(pPal, cache, nextFrame[0], nextFrame[1], nextFrame[2]);
+            }
+            else
+            {
+                int32_t bestDiff = 1000000;
+                GifFindPaletteColor(pPal, nextFrame[0], nextFrame[1], nextFrame[2], &bestInd, &bestDiff);
+            }
+
+            // if it palettizes to the color already shown, it doesn't need to be redrawn either -
+            // common when the palette is carried over from the previous frame
+            bool unchanged = lastFrame &&
+                             lastFrame[0] == pPal->r[bestInd] &&
+                             lastFrame[1] == pPal->g[bestInd] &&
+                             lastFrame[2] == pPal->b[bestInd];
 
             // Write the resulting color to the output buffer
             outFrame[0] = pPal->r[bestInd];
             outFrame[1] = pPal->g[bestInd];
             outFrame[2] = pPal->b[bestInd];
-            outFrame[3] = (uint8_t)bestInd;
+            outFrame[3] = unchanged? (uint8_t)kGifTransIndex : (uint8_t)bestInd;
         }
 
         if(lastFrame) lastFrame += 4;
@@ -550,75 +1306,357 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
     }
 }
 
-// Simple structure to write out the LZW-compressed portion of the image
-// one bit at a time
+const int kGifLutBits = 5;
+
+// Palettized pixel - palette color, then its index - for every color at kGifLutBits bits per component,
+// so that a palette which never changes (see GifSetFixedPalette) is applied with one lookup per pixel.
+// 128KB, small enough to stay in cache.
 typedef struct
 {
-    uint32_t chunkIndex;
-    uint8_t chunk[256];   // bytes are written in here until we have 256 of them, then written to the file
-
-    uint8_t bitIndex;  // how many bits in the partial byte written so far
-    uint8_t byte;      // current partial byte
+    uint32_t pixels[1 << (3*kGifLutBits)];  // bytes R, G, B, index in memory order
+} GifPaletteLut;
 
-    uint8_t padding[2];    // make padding explicit
-} GifBitStatus;
+uint32_t GifPaletteLutKey( uint8_t r, uint8_t g, uint8_t b )
+{
+    return (uint32_t)(r >> (8-kGifLutBits)) << (2*kGifLutBits) | (uint32_t)(g >> (8-kGifLutBits)) << kGifLutBits | (uint32_t)(b >> (8-kGifLutBits));
+}
 
-// insert a single bit
-void GifWriteBit( GifBitStatus* stat, uint32_t bit )
+// Fills the table with the palette entry closest to the center of each cell of the color cube
+void GifBuildPaletteLut( GifPalette* pPal, GifPaletteLut* lut )
 {
-    bit = bit & 1;
-    bit = bit << stat->bitIndex;
-    stat->byte |= bit;
+    const int cells = 1 << kGifLutBits;
+    const int cellSize = 256 / cells;
 
-    ++stat->bitIndex;
-    if( stat->bitIndex > 7 )
+    for(int rr=0; rr<cells; ++rr)
+    for(int gg=0; gg<cells; ++gg)
+    for(int bb=0; bb<cells; ++bb)
     {
-        // move the newly-finished byte to the chunk buffer
-        stat->chunk[stat->chunkIndex++] = stat->byte;
-        // and start a new byte
-        stat->bitIndex = 0;
-        stat->byte = 0;
+        int32_t bestDiff = 1000000;
+        int32_t bestInd = 1;
+        GifFindPaletteColor(pPal, rr*cellSize + cellSize/2, gg*cellSize + cellSize/2, bb*cellSize + cellSize/2, &bestInd, &bestDiff);
+
+        uint8_t pixel[4] = { pPal->r[bestInd], pPal->g[bestInd], pPal->b[bestInd], (uint8_t)bestInd };
+        memcpy(&lut->pixels[(rr << (2*kGifLutBits)) | (gg << kGifLutBits) | bb], pixel, 4);
     }
 }
 
-// write all bytes so far to the file
-void GifWriteChunk( FILE* f, GifBitStatus* stat )
+// Same as GifThresholdImage, but with every color looked up in lut instead of searched for in the palette.
+// With SIMD, four pixels are keyed, looked up and compared against the previous frame at once.
+void GifLutThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t numPixels, const GifPaletteLut* lut )
 {
-    fputc((int)stat->chunkIndex, f);
-    fwrite(stat->chunk, 1, stat->chunkIndex, f);
+    uint32_t ii = 0;
 
-    stat->bitIndex = 0;
-    stat->byte = 0;
-    stat->chunkIndex = 0;
+#if defined(GIF_SSE2)
+    // pixels are loaded as little-endian 32-bit lanes: R in the low byte, alpha in the high one
+    const __m128i cellMask = _mm_set1_epi32((1 << kGifLutBits) - 1);
+    const __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+    const __m128i transparent = _mm_set1_epi32(kGifTransIndex << 24);
+
+    for(; ii+4<=numPixels; ii+=4)
+    {
+        __m128i next = _mm_loadu_si128((const __m128i*)(nextFrame + ii*4));
+
+        __m128i key = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(next, 8-kGifLutBits), cellMask), 2*kGifLutBits);
+        key = _mm_or_si128(key, _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(next, 16-kGifLutBits), cellMask), kGifLutBits));
+        key = _mm_or_si128(key, _mm_and_si128(_mm_srli_epi32(next, 24-kGifLutBits), cellMask));
+
+#if defined(GIF_AVX2)
+        __m128i mapped = _mm_i32gather_epi32((const int*)lut->pixels, key, 4);
+#else
+        uint32_t keys[4];
+        _mm_storeu_si128((__m128i*)keys, key);
+        __m128i mapped = _mm_set_epi32((int)lut->pixels[keys[3]], (int)lut->pixels[keys[2]], (int)lut->pixels[keys[1]], (int)lut->pixels[keys[0]]);
+#endif
+
+        if(!lastFrame)
+        {
+            _mm_storeu_si128((__m128i*)(outFrame + ii*4), mapped);
+            continue;
+        }
+
+        // a pixel whose color, or palettized color, is the one already shown stays transparent
+        __m128i last = _mm_and_si128(_mm_loadu_si128((const __m128i*)(lastFrame + ii*4)), rgbMask);
+        __m128i keep = _mm_or_si128(_mm_cmpeq_epi32(last, _mm_and_si128(next, rgbMask)),
+                                    _mm_cmpeq_epi32(last, _mm_and_si128(mapped, rgbMask)));
+        __m128i out = _mm_or_si128(_mm_and_si128(keep, _mm_or_si128(last, transparent)), _mm_andnot_si128(keep, mapped));
+        _mm_storeu_si128((__m128i*)(outFrame + ii*4), out);
+    }
+#endif
+
+    for(; ii<numPixels; ++ii)
+    {
+        const uint8_t* next = nextFrame + ii*4;
+        uint8_t* out = outFrame + ii*4;
+
+        uint8_t mapped[4];
+        memcpy(mapped, &lut->pixels[GifPaletteLutKey(next[0], next[1], next[2])], 4);
+
+        if(lastFrame)
+        {
+            const uint8_t* last = lastFrame + ii*4;
+            if((last[0] == next[0] && last[1] == next[1] && last[2] == next[2]) ||
+               (last[0] == mapped[0] && last[1] == mapped[1] && last[2] == mapped[2]))
+            {
+                out[0] = last[0];
+                out[1] = last[1];
+                out[2] = last[2];
+                out[3] = kGifTransIndex;
+                continue;
+            }
+        }
+
+        memcpy(out, mapped, 4);
+    }
+}
+
+// Palette index for every cell of the GifPaletteLut color cube, cell (r>>3, g>>3, b>>3) at
+// indices[r>>3 << 10 | g>>3 << 5 | b>>3] - e.g. for a 3D texture that palettizes frames on the GPU
+// the way GifLutThresholdImage would, see GifWriteIndexedFrame
+void GifGetPaletteLutIndices( GifPalette* pPal, uint8_t* indices, GifArena* arena = NULL )
+{
+    GifPaletteLut* lut = (GifPaletteLut*)GifArenaAlloc(arena, sizeof(GifPaletteLut));
+    GifBuildPaletteLut(pPal, lut);
+    for(uint32_t ii=0; ii<(1u << (3*kGifLutBits)); ++ii)
+        indices[ii] = (uint8_t)(lut->pixels[ii] >> 24);
+    GifArenaFree(arena, lut);
 }
 
-void GifWriteCode( FILE* f, GifBitStatus* stat, uint32_t code, uint32_t length )
+// Same as GifLutThresholdImage for a frame that arrives already palettized, one palette index per pixel.
+// The frame's own colors aren't known, so a pixel is kept when its palette color is the one already
+// shown; GifLutThresholdImage also keeps it when the frame's color is, which only differs for a color
+// that is exactly a palette entry yet falls in a cell the LUT maps to another entry.
+void GifIndexedThresholdImage( const uint8_t* lastFrame, const uint8_t* indices, uint8_t* outFrame, uint32_t numPixels, const GifPalette* pPal )
 {
-    for( uint32_t ii=0; ii<length; ++ii )
+    // palettized pixel for each index - palette color, then the index
+    uint32_t entries[256];
+    for(int ii=0; ii<256; ++ii)
+    {
+        uint8_t pixel[4] = { pPal->r[ii], pPal->g[ii], pPal->b[ii], (uint8_t)ii };
+        memcpy(&entries[ii], pixel, 4);
+    }
+
+    uint32_t ii = 0;
+
+#if defined(GIF_SSE2)
+    const __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+    const __m128i transparent = _mm_set1_epi32(kGifTransIndex << 24);
+
+    for(; ii+4<=numPixels; ii+=4)
+    {
+        __m128i mapped = _mm_set_epi32((int)entries[indices[ii+3]], (int)entries[indices[ii+2]], (int)entries[indices[ii+1]], (int)entries[indices[ii]]);
+
+        if(!lastFrame)
+        {
+            _mm_storeu_si128((__m128i*)(outFrame + ii*4), mapped);
+            continue;
+        }
+
+        __m128i last = _mm_and_si128(_mm_loadu_si128((const __m128i*)(lastFrame + ii*4)), rgbMask);
+        __m128i keep = _mm_cmpeq_epi32(last, _mm_and_si128(mapped, rgbMask));
+        __m128i out = _mm_or_si128(_mm_and_si128(keep, _mm_or_si128(last, transparent)), _mm_andnot_si128(keep, mapped));
+        _mm_storeu_si128((__m128i*)(outFrame + ii*4), out);
+    }
+#endif
+
+    for(; ii<numPixels; ++ii)
     {
-        GifWriteBit(stat, code);
-        code = code >> 1;
+        // lastFrame may be outFrame, so compare before writing
+        uint8_t mapped[4];
+        memcpy(mapped, &entries[indices[ii]], 4);
 
-        if( stat->chunkIndex == 255 )
+        if(lastFrame)
         {
-            GifWriteChunk(f, stat);
+            const uint8_t* last = lastFrame + ii*4;
+            if(last[0] == mapped[0] && last[1] == mapped[1] && last[2] == mapped[2])
+                mapped[3] = kGifTransIndex;
         }
+
+        memcpy(outFrame + ii*4, mapped, 4);
+    }
+}
+
+// Makes a palette of evenly spaced levels of each component, e.g. 6x7x6 - at most 255 colors in all,
+// next to the transparent entry. Returns false if there are too many.
+bool GifMakeCubePalette( int rLevels, int gLevels, int bLevels, GifPalette* pPal )
+{
+    if(rLevels < 2 || gLevels < 2 || bLevels < 2 || rLevels*gLevels*bLevels > 255) return false;
+
+    // with a bin per color, the palette holds each of them exactly
+    GifHistogram hist;
+    GifHistogramInit(&hist, (uint32_t)(rLevels*gLevels*bLevels), false);
+    for(int rr=0; rr<rLevels; ++rr)
+    for(int gg=0; gg<gLevels; ++gg)
+    for(int bb=0; bb<bLevels; ++bb)
+    {
+        uint32_t r = (uint32_t)(rr*255/(rLevels-1));
+        uint32_t g = (uint32_t)(gg*255/(gLevels-1));
+        uint32_t b = (uint32_t)(bb*255/(bLevels-1));
+        GifHistogramAdd(&hist, b << 16 | g << 8 | r, 1);
+    }
+
+    GifPaletteFromHistogram(&hist, 8, false, pPal);
+    GifHistogramFree(&hist, false);
+    return true;
+}
+
+// Growable byte buffer that an encoded image block is collected in
+// before it is written to the file
+typedef struct
+{
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} GifBuffer;
+
+// make room for at least extra more bytes
+void GifBufferReserve( GifBuffer* buf, size_t extra )
+{
+    if( buf->size + extra <= buf->capacity ) return;
+
+    size_t capacity = buf->capacity? buf->capacity : 4096;
+    while( capacity < buf->size + extra ) capacity *= 2;
+
+    uint8_t* data = (uint8_t*)GifMalloc(capacity);
+    if( buf->size ) memcpy(data, buf->data, buf->size);
+    GIF_FREE(buf->data);
+
+    buf->data = data;
+    buf->capacity = capacity;
+}
+
+void GifBufferPut( GifBuffer* buf, uint8_t byte )
+{
+    GifBufferReserve(buf, 1);
+    buf->data[buf->size++] = byte;
+}
+
+void GifBufferWrite( GifBuffer* buf, const void* data, size_t size )
+{
+    GifBufferReserve(buf, size);
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+void GifBufferFree( GifBuffer* buf )
+{
+    GIF_FREE(buf->data);
+    buf->data = NULL;
+    buf->size = buf->capacity = 0;
+}
+
+// Simple structure to write out the LZW-compressed portion of the image.
+// Codes are packed straight into the output buffer as data sub-blocks of up to 255 bytes;
+// the length byte in front of each sub-block is reserved when it starts and filled in when it ends.
+// Without subBlocks the bytes are just appended, for a strip that is stitched into the image later.
+typedef struct
+{
+    GifBuffer* out;
+    size_t chunkStart;    // offset in out of the current sub-block's length byte
+    uint32_t chunkIndex;  // bytes in the current sub-block so far
+
+    uint32_t bits;        // bits not yet making up a whole byte, lowest first
+    uint32_t bitIndex;    // how many of them there are
+
+    bool subBlocks;
+    uint8_t padding[7];   // make padding explicit
+} GifBitStatus;
+
+void GifBitStart( GifBitStatus* stat, GifBuffer* out, bool subBlocks = true )
+{
+    stat->out = out;
+    stat->chunkStart = 0;
+    stat->chunkIndex = 0;
+    stat->bits = 0;
+    stat->bitIndex = 0;
+    stat->subBlocks = subBlocks;
+}
+
+// append a finished byte to the current sub-block, starting a new one if needed
+void GifWriteByte( GifBitStatus* stat, uint8_t byte )
+{
+    GifBuffer* out = stat->out;
+    if( !stat->subBlocks )
+    {
+        GifBufferPut(out, byte);
+        return;
+    }
+
+    if( stat->chunkIndex == 0 )
+    {
+        stat->chunkStart = out->size;
+        GifBufferPut(out, 0);
+    }
+
+    GifBufferPut(out, byte);
+
+    if( ++stat->chunkIndex == 255 )
+    {
+        out->data[stat->chunkStart] = 255;
+        stat->chunkIndex = 0;
+    }
+}
+
+void GifWriteCode( GifBitStatus* stat, uint32_t code, uint32_t length )
+{
+    stat->bits |= code << stat->bitIndex;
+    stat->bitIndex += length;
+
+    while( stat->bitIndex >= 8 )
+    {
+        GifWriteByte(stat, (uint8_t)stat->bits);
+        stat->bits >>= 8;
+        stat->bitIndex -= 8;
     }
 }
 
-// The LZW dictionary is a 256-ary tree constructed as the file is encoded,
-// this is one node
+// pad out the last partial byte with zeros and close the last sub-block
+void GifBitFinish( GifBitStatus* stat )
+{
+    if( stat->bitIndex ) GifWriteCode(stat, 0, 8 - stat->bitIndex);
+    if( stat->chunkIndex ) stat->out->data[stat->chunkStart] = (uint8_t)stat->chunkIndex;
+}
+
+// The LZW dictionary maps (prefix code, next byte) to the code for the longer run.
+// It's an open-addressing hash table, at most half full since GIF codes stop at 4095.
+// Each entry is tagged with a generation so clearing the dictionary is just a new generation.
+const int kGifLzwHashBits = 13;
+
 typedef struct
 {
-    uint16_t m_next[256];
-} GifLzwNode;
+    uint32_t keys[1 << kGifLzwHashBits];    // generation << 20 | prefix << 8 | byte; generation 0 is an empty slot
+    uint16_t codes[1 << kGifLzwHashBits];
+    uint32_t generation;
+} GifLzwDict;
+
+void GifLzwClear( GifLzwDict* dict )
+{
+    // generations use the top 12 bits of the key, wipe the table when they run out
+    if(++dict->generation == 0x1000)
+    {
+        memset(dict->keys, 0, sizeof(dict->keys));
+        dict->generation = 1;
+    }
+}
+
+// Returns the slot for (prefix, byte): either the slot holding it, or the empty slot it would go in
+uint32_t GifLzwFind( const GifLzwDict* dict, uint32_t prefix, uint32_t byte )
+{
+    const uint32_t mask = (1u << kGifLzwHashBits) - 1;
+    uint32_t key = (dict->generation << 20) | (prefix << 8) | byte;
+    uint32_t slot = (key * 2654435761u) >> (32 - kGifLzwHashBits);
+
+    while(dict->keys[slot] != key && (dict->keys[slot] >> 20) == dict->generation)
+        slot = (slot + 1) & mask;
+
+    return slot;
+}
 
-// write a 256-color (8-bit) image palette to the file
-void GifWritePalette( const GifPalette* pPal, FILE* f )
+// write a 256-color (8-bit) image palette to the output
+void GifWritePalette( const GifPalette* pPal, GifBuffer* out )
 {
-    fputc(0, f);  // first color: transparency
-    fputc(0, f);
-    fputc(0, f);
+    GifBufferPut(out, 0);  // first color: transparency
+    GifBufferPut(out, 0);
+    GifBufferPut(out, 0);
 
     for(int ii=1; ii<(1 << pPal->bitDepth); ++ii)
     {
@@ -626,72 +1664,100 @@ void GifWritePalette( const GifPalette* pPal, FILE* f )
         uint32_t g = pPal->g[ii];
         uint32_t b = pPal->b[ii];
 
-        fputc((int)r, f);
-        fputc((int)g, f);
-        fputc((int)b, f);
+        GifBufferPut(out, (uint8_t)r);
+        GifBufferPut(out, (uint8_t)g);
+        GifBufferPut(out, (uint8_t)b);
     }
 }
 
-// write the image header, LZW-compress and write out the image
-void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal)
+void GifWriteGraphicControl( GifBuffer* out, uint32_t delay )
 {
-    // graphics control extension
-    fputc(0x21, f);
-    fputc(0xf9, f);
-    fputc(0x04, f);
-    fputc(0x05, f); // leave prev frame in place, this frame has transparency
-    fputc(delay & 0xff, f);
-    fputc((delay >> 8) & 0xff, f);
-    fputc(kGifTransIndex, f); // transparent color index
-    fputc(0, f);
+    GifBufferPut(out, 0x21);
+    GifBufferPut(out, 0xf9);
+    GifBufferPut(out, 0x04);
+    GifBufferPut(out, 0x05); // leave prev frame in place, this frame has transparency
+    GifBufferPut(out, (uint8_t)(delay & 0xff));
+    GifBufferPut(out, (uint8_t)((delay >> 8) & 0xff));
+    GifBufferPut(out, kGifTransIndex); // transparent color index
+    GifBufferPut(out, 0);
+}
 
-    fputc(0x2c, f); // image descriptor block
+// Fewest pixels worth giving a strip of its own
+const uint32_t kGifMinLzwStripPixels = 1 << 16;
 
-    fputc(left & 0xff, f);           // corner of image in canvas space
-    fputc((left >> 8) & 0xff, f);
-    fputc(top & 0xff, f);
-    fputc((top >> 8) & 0xff, f);
+const int kGifLossyCandidates = 8;
 
-    fputc(width & 0xff, f);          // width and height of image
-    fputc((width >> 8) & 0xff, f);
-    fputc(height & 0xff, f);
-    fputc((height >> 8) & 0xff, f);
+// For lossy LZW (see GifSetLossyLzw): the palette entries that may stand in for each entry,
+// nearest first. The transparent entry neither has nor is a stand-in.
+typedef struct
+{
+    uint8_t count[256];
+    uint8_t entries[256][kGifLossyCandidates];
+} GifLossyTable;
 
-    //fputc(0, f); // no local color table, no transparency
-    //fputc(0x80, f); // no local color table, but transparency
+// Picks the up to kGifLossyCandidates entries within maxError (sum of absolute RGB differences) of each entry
+void GifBuildLossyTable( const GifPalette* pPal, int maxError, GifLossyTable* table )
+{
+    const int numColors = 1 << pPal->bitDepth;
+    memset(table->count, 0, sizeof(table->count));
 
-    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
-    GifWritePalette(pPal, f);
+    for(int ii=1; ii<numColors; ++ii)
+    {
+        int dists[kGifLossyCandidates];
+        int count = 0;
 
-    const int minCodeSize = pPal->bitDepth;
-    const uint32_t clearCode = 1 << pPal->bitDepth;
+        for(int jj=1; jj<numColors; ++jj)
+        {
+            if(jj == ii) continue;
+
+            int dist = GifIAbs(pPal->r[ii] - pPal->r[jj]) + GifIAbs(pPal->g[ii] - pPal->g[jj]) + GifIAbs(pPal->b[ii] - pPal->b[jj]);
+            if(dist > maxError || (count == kGifLossyCandidates && dist >= dists[count-1])) continue;
+
+            // insertion into the short sorted list
+            int pos = count < kGifLossyCandidates? count++ : count-1;
+            while(pos > 0 && dists[pos-1] > dist)
+            {
+                dists[pos] = dists[pos-1];
+                table->entries[ii][pos] = table->entries[ii][pos-1];
+                --pos;
+            }
+            dists[pos] = dist;
+            table->entries[ii][pos] = (uint8_t)jj;
+        }
+
+        table->count[ii] = (uint8_t)count;
+    }
+}
 
-    fputc(minCodeSize, f); // min code size 8 bits
+// LZW-compresses rows firstRow to endRow-1 of the width-wide rectangle at left, top of the image,
+// starting from a fresh dictionary, and ends with a clear code so that another strip can follow.
+// With a lossy table, a pixel that would end the current run instead continues it if the run followed by one
+// of the pixel's stand-ins is in the dictionary - the decoder then shows the stand-in's color. Only existing
+// dictionary entries are used this way, so the stream stays valid LZW.
+void GifLzwCompressRows( GifBitStatus* stat, GifLzwDict* dict, const uint8_t* image, uint32_t imageWidth, uint32_t imageHeight,
+                         uint32_t left, uint32_t top, uint32_t width, uint32_t firstRow, uint32_t endRow, int minCodeSize,
+                         const GifLossyTable* lossy )
+{
+    (void)imageHeight; // only needed to flip
 
-    GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*4096);
+    const uint32_t clearCode = 1u << minCodeSize;
 
-    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+    memset(dict->keys, 0, sizeof(dict->keys));
+    dict->generation = 1;
     int32_t curCode = -1;
     uint32_t codeSize = (uint32_t)minCodeSize + 1;
     uint32_t maxCode = clearCode+1;
 
-    GifBitStatus stat;
-    stat.byte = 0;
-    stat.bitIndex = 0;
-    stat.chunkIndex = 0;
-
-    GifWriteCode(f, &stat, clearCode, codeSize);  // start with a fresh LZW dictionary
-
-    for(uint32_t yy=0; yy<height; ++yy)
+    for(uint32_t yy=firstRow; yy<endRow; ++yy)
     {
         for(uint32_t xx=0; xx<width; ++xx)
         {
     #ifdef GIF_FLIP_VERT
             // bottom-left origin image (such as an OpenGL capture)
-            uint8_t nextValue = image[((height-1-yy)*width+xx)*4+3];
+            uint8_t nextValue = image[((imageHeight-1-top-yy)*imageWidth+left+xx)*4+3];
     #else
             // top-left origin
-            uint8_t nextValue = image[(yy*width+xx)*4+3];
+            uint8_t nextValue = image[((top+yy)*imageWidth+left+xx)*4+3];
     #endif
 
             // "worst possible mode" - no compression, every single code is followed immediately by a clear
@@ -702,19 +1768,38 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
             {
                 // first value in a new run
                 curCode = nextValue;
+                continue;
             }
-            else if( codetree[curCode].m_next[nextValue] )
+
+            uint32_t slot = GifLzwFind(dict, (uint32_t)curCode, nextValue);
+            if( (dict->keys[slot] >> 20) == dict->generation )
             {
                 // current run already in the dictionary
-                curCode = codetree[curCode].m_next[nextValue];
+                curCode = dict->codes[slot];
+                continue;
             }
-            else
+
+            bool extended = false;
+            for( int cc=0; lossy && cc<lossy->count[nextValue]; ++cc )
+            {
+                uint32_t standIn = GifLzwFind(dict, (uint32_t)curCode, lossy->entries[nextValue][cc]);
+                if( (dict->keys[standIn] >> 20) == dict->generation )
+                {
+                    // close enough: carry on with the run
+                    curCode = dict->codes[standIn];
+                    extended = true;
+                    break;
+                }
+            }
+
+            if( !extended )
             {
                 // finish the current run, write a code
-                GifWriteCode(f, &stat, (uint32_t)curCode, codeSize);
+                GifWriteCode(stat, (uint32_t)curCode, codeSize);
 
                 // insert the new run into the dictionary
-                codetree[curCode].m_next[nextValue] = (uint16_t)++maxCode;
+                dict->keys[slot] = (dict->generation << 20) | ((uint32_t)curCode << 8) | nextValue;
+                dict->codes[slot] = (uint16_t)++maxCode;
 
                 if( maxCode >= (1ul << codeSize) )
                 {
@@ -725,9 +1810,9 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
                 if( maxCode == 4095 )
                 {
                     // the dictionary is full, clear it out and begin anew
-                    GifWriteCode(f, &stat, clearCode, codeSize); // clear tree
+                    GifWriteCode(stat, clearCode, codeSize); // clear tree
 
-                    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+                    GifLzwClear(dict);
                     codeSize = (uint32_t)(minCodeSize + 1);
                     maxCode = clearCode+1;
                 }
@@ -737,128 +1822,2520 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
         }
     }
 
-    // compression footer
-    GifWriteCode(f, &stat, (uint32_t)curCode, codeSize);
-    GifWriteCode(f, &stat, clearCode, codeSize);
-    GifWriteCode(f, &stat, clearCode + 1, (uint32_t)minCodeSize + 1);
+    // finish the last run
+    GifWriteCode(stat, (uint32_t)curCode, codeSize);
 
-    // write out the last partial chunk
-    while( stat.bitIndex ) GifWriteBit(&stat, 0);
-    if( stat.chunkIndex ) GifWriteChunk(f, &stat);
-
-    fputc(0, f); // image block terminator
+    // a decoder adds a dictionary entry on reading that code too (unless it's the first since a clear),
+    // which may take it to the next code size before it reads the clear code
+    if( maxCode > clearCode+1 && maxCode+1 == (1ul << codeSize) && codeSize < 12 )
+        codeSize++;
 
-    GIF_TEMP_FREE(codetree);
+    GifWriteCode(stat, clearCode, codeSize);
 }
 
-typedef struct
+// One strip of rows for GifWriteLzwImage to compress, with what every strip shares
+struct GifLzwStrip
 {
-    FILE* f;
-    uint8_t* oldImage;
-    bool firstFrame;
-
-    uint8_t padding[7];    // make padding explicit
-} GifWriter;
+    GifBitStatus* stat;
+    GifLzwDict* dict;
+    uint32_t firstRow, endRow;
+    const uint8_t* image;
+    uint32_t imageWidth, imageHeight;
+    uint32_t left, top, width;
+    int minCodeSize;
+    const GifLossyTable* lossy;
+};
+
+void GifLzwStripTask( void* context, uint32_t task )
+{
+    GifLzwStrip* strip = (GifLzwStrip*)context + task;
+    GifLzwCompressRows(strip->stat, strip->dict, strip->image, strip->imageWidth, strip->imageHeight, strip->left, strip->top,
+                       strip->width, strip->firstRow, strip->endRow, strip->minCodeSize, strip->lossy);
+}
 
-// Creates a gif file.
-// The input GIFWriter is assumed to be uninitialized.
-// The delay value is the time between frames in hundredths of a second - note that not all viewers pay much attention to this value.
-bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
+// write the image header, LZW-compress and write out the image.
+// image is the whole imageWidth x imageHeight canvas; only the rectangle at left, top
+// of size width x height (in top-left-origin canvas coordinates) is encoded
+// If useGlobalPalette is set, pPal has the same colors as the global color table and no local one is written.
+// The rectangle is compressed in numStrips horizontal strips, on the workers if given (see GifSetLzwStrips).
+// A lossyError above 0 lets pixels be encoded as a color up to that far off (see GifSetLossyLzw).
+void GifWriteLzwImage(GifBuffer* out, const uint8_t* image, uint32_t imageWidth, uint32_t imageHeight, uint32_t left, uint32_t top, uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal, bool useGlobalPalette = false, uint32_t numStrips = 1, GifArena* arena = NULL, int lossyError = 0, GifWorkers* workers = NULL)
 {
-    (void)bitDepth; (void)dither; // Mute "Unused argument" warnings
-#if defined(_MSC_VER) && (_MSC_VER >= 1400)
-	writer->f = 0;
-    fopen_s(&writer->f, filename, "wb");
-#else
-    writer->f = fopen(filename, "wb");
-#endif
-    if(!writer->f) return false;
+    // graphics control extension
+    GifWriteGraphicControl(out, delay);
 
-    writer->firstFrame = true;
+    GifBufferPut(out, 0x2c); // image descriptor block
 
-    // allocate
-    writer->oldImage = (uint8_t*)GIF_MALLOC(width*height*4);
+    GifBufferPut(out, (uint8_t)(left & 0xff));           // corner of image in canvas space
+    GifBufferPut(out, (uint8_t)((left >> 8) & 0xff));
+    GifBufferPut(out, (uint8_t)(top & 0xff));
+    GifBufferPut(out, (uint8_t)((top >> 8) & 0xff));
 
-    fputs("GIF89a", writer->f);
+    GifBufferPut(out, (uint8_t)(width & 0xff));          // width and height of image
+    GifBufferPut(out, (uint8_t)((width >> 8) & 0xff));
+    GifBufferPut(out, (uint8_t)(height & 0xff));
+    GifBufferPut(out, (uint8_t)((height >> 8) & 0xff));
 
-    // screen descriptor
-    fputc(width & 0xff, writer->f);
-    fputc((width >> 8) & 0xff, writer->f);
-    fputc(height & 0xff, writer->f);
-    fputc((height >> 8) & 0xff, writer->f);
-
-    fputc(0xf0, writer->f);  // there is an unsorted global color table of 2 entries
-    fputc(0, writer->f);     // background color
-    fputc(0, writer->f);     // pixels are square (we need to specify this because it's 1989)
-
-    // now the "global" palette (really just a dummy palette)
-    // color 0: black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    // color 1: also black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
+    //GifBufferPut(out, 0); // no local color table, no transparency
+    //GifBufferPut(out, 0x80); // no local color table, but transparency
 
-    if( delay != 0 )
+    if(useGlobalPalette)
     {
-        // animation header
-        fputc(0x21, writer->f); // extension
-        fputc(0xff, writer->f); // application specific
-        fputc(11, writer->f); // length 11
-        fputs("NETSCAPE2.0", writer->f); // yes, really
-        fputc(3, writer->f); // 3 bytes of NETSCAPE2.0 data
-
-        fputc(1, writer->f); // this is the Netscape 2.0 sub-block ID and it must be 1, otherwise some viewers error
-        fputc(0, writer->f); // loop infinitely (byte 0)
-        fputc(0, writer->f); // loop infinitely (byte 1)
-
-        fputc(0, writer->f); // block terminator
+        GifBufferPut(out, 0); // no local color table
+    }
+    else
+    {
+        GifBufferPut(out, (uint8_t)(0x80 + pPal->bitDepth-1)); // local color table present, 2 ^ bitDepth entries
+        GifWritePalette(pPal, out);
     }
 
-    return true;
-}
+    const int minCodeSize = pPal->bitDepth;
+    const uint32_t clearCode = 1 << pPal->bitDepth;
 
-// Writes out a new frame to a GIF in progress.
-// The GIFWriter should have been created by GIFBegin.
-// AFAIK, it is legal to use different bit depths for different frames of an image -
-// this may be handy to save bits in animations that don't change much.
-bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth = 8, bool dither = false )
-{
-    if(!writer->f) return false;
+    GifBufferPut(out, (uint8_t)minCodeSize); // min code size 8 bits
 
-    const uint8_t* oldImage = writer->firstFrame? NULL : writer->oldImage;
-    writer->firstFrame = false;
+    // strips need enough pixels each to be worth a thread and a fresh dictionary
+    uint32_t maxStrips = (uint32_t)GifIMax(1, (int)(width * height / kGifMinLzwStripPixels));
+    numStrips = (uint32_t)GifIMin((int)numStrips, (int)maxStrips);
+    numStrips = (uint32_t)GifIMax(1, GifIMin((int)numStrips, (int)height));
 
-    GifPalette pal;
-    GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, dither, &pal);
+    GifLzwDict* dicts = (GifLzwDict*)GifArenaAlloc(arena, sizeof(GifLzwDict) * numStrips);
 
-    if(dither)
-        GifDitherImage(oldImage, image, writer->oldImage, width, height, &pal);
-    else
-        GifThresholdImage(oldImage, image, writer->oldImage, width, height, &pal);
+    GifLossyTable* lossy = NULL;
+    if(lossyError > 0)
+    {
+        lossy = (GifLossyTable*)GifArenaAlloc(arena, sizeof(GifLossyTable));
+        GifBuildLossyTable(pPal, lossyError, lossy);
+    }
 
-    GifWriteLzwImage(writer->f, writer->oldImage, 0, 0, width, height, delay, &pal);
+    GifBitStatus stat;
+    GifBitStart(&stat, out);
 
-    return true;
-}
+    GifWriteCode(&stat, clearCode, (uint32_t)minCodeSize + 1);  // start with a fresh LZW dictionary
 
-// Writes the EOF code, closes the file handle, and frees temp memory used by a GIF.
+    if(numStrips == 1)
+    {
+        GifLzwCompressRows(&stat, dicts, image, imageWidth, imageHeight, left, top, width, 0, height, minCodeSize, lossy);
+    }
+    else
+    {
+        // the first strip goes straight into out; the others are compressed alongside it, each
+        // into a buffer of its own, then appended at whatever bit position the previous one ended on
+        GifBuffer* stripBytes = (GifBuffer*)GifArenaAlloc(arena, sizeof(GifBuffer) * numStrips);
+        GifBitStatus* stripStats = (GifBitStatus*)GifArenaAlloc(arena, sizeof(GifBitStatus) * numStrips);
+        GifLzwStrip* strips = (GifLzwStrip*)GifArenaAlloc(arena, sizeof(GifLzwStrip) * numStrips);
+        for(uint32_t ss=0; ss<numStrips; ++ss)
+        {
+            GifLzwStrip strip = { &stat, dicts + ss, height * ss / numStrips, height * (ss+1) / numStrips,
+                                  image, imageWidth, imageHeight, left, top, width, minCodeSize, lossy };
+            strips[ss] = strip;
+            if(ss == 0) continue;
+
+            // room for the most a strip can take - a 12-bit code per pixel, plus the clear codes - so it never grows
+            size_t stripPixels = (size_t)(strip.endRow - strip.firstRow) * width;
+            stripBytes[ss].capacity = stripPixels * 2 + 64;
+            stripBytes[ss].data = (uint8_t*)GifArenaAlloc(arena, stripBytes[ss].capacity);
+            stripBytes[ss].size = 0;
+
+            GifBitStart(&stripStats[ss], &stripBytes[ss], false);
+            strips[ss].stat = &stripStats[ss];
+        }
+
+        GifRunTasks(workers, GifLzwStripTask, strips, numStrips);
+
+        for(uint32_t ss=1; ss<numStrips; ++ss)
+        {
+            const GifBuffer* strip = &stripBytes[ss];
+            for(size_t ii=0; ii<strip->size; ++ii)
+            {
+                if(stat.bitIndex == 0)
+                    GifWriteByte(&stat, strip->data[ii]);
+                else
+                    GifWriteCode(&stat, strip->data[ii], 8);
+            }
+            GifWriteCode(&stat, stripStats[ss].bits, stripStats[ss].bitIndex);
+        }
+
+        for(uint32_t ss=numStrips-1; ss>=1; --ss)
+            GifArenaFree(arena, stripBytes[ss].data);
+        GifArenaFree(arena, strips);
+        GifArenaFree(arena, stripStats);
+        GifArenaFree(arena, stripBytes);
+    }
+
+    // compression footer: the last strip ended with a clear code, which leaves the code size at its minimum
+    GifWriteCode(&stat, clearCode + 1, (uint32_t)minCodeSize + 1);
+
+    // write out the last partial chunk
+    GifBitFinish(&stat);
+
+    GifBufferPut(out, 0); // image block terminator
+
+    if(lossy) GifArenaFree(arena, lossy);
+    GifArenaFree(arena, dicts);
+}
+
+// Writes a frame that leaves the canvas untouched but still takes up its delay:
+// a single transparent pixel using the global color table. (A graphic control extension
+// on its own is not enough - decoders apply it to the next image, so the delay would be lost.)
+void GifWriteEmptyFrame( GifBuffer* out, uint32_t delay )
+{
+    GifWriteGraphicControl(out, delay);
+
+    GifBufferPut(out, 0x2c); // image descriptor block
+    for(int ii=0; ii<4; ++ii) GifBufferPut(out, 0); // at the top-left corner
+    GifBufferPut(out, 1);    // 1 x 1
+    GifBufferPut(out, 0);
+    GifBufferPut(out, 1);
+    GifBufferPut(out, 0);
+    GifBufferPut(out, 0);    // no local color table
+
+    const uint32_t minCodeSize = 2; // the smallest the format allows
+    const uint32_t clearCode = 1 << minCodeSize;
+    GifBufferPut(out, (uint8_t)minCodeSize);
+
+    GifBitStatus stat;
+    GifBitStart(&stat, out);
+
+    GifWriteCode(&stat, clearCode, minCodeSize + 1);
+    GifWriteCode(&stat, kGifTransIndex, minCodeSize + 1);
+    GifWriteCode(&stat, clearCode + 1, minCodeSize + 1);
+    GifBitFinish(&stat);
+
+    GifBufferPut(out, 0); // image block terminator
+}
+
+// Finds the bounding box of the pixels a palettized frame changes, i.e. those that aren't
+// transparent, in top-left-origin canvas coordinates. Returns false if the frame changes nothing.
+bool GifChangedRect( const uint8_t* image, uint32_t width, uint32_t height, uint32_t* left, uint32_t* top, uint32_t* rectWidth, uint32_t* rectHeight )
+{
+    // rows of the buffer, which is upside down when GIF_FLIP_VERT is set
+    uint32_t firstRow = 0, lastRow = height;
+    while(firstRow < height)
+    {
+        const uint8_t* row = image + (size_t)firstRow*width*4;
+        uint32_t xx = 0;
+        while(xx < width && row[xx*4+3] == kGifTransIndex) ++xx;
+        if(xx < width) break;
+        ++firstRow;
+    }
+    if(firstRow == height) return false;
+
+    while(lastRow-1 > firstRow)
+    {
+        const uint8_t* row = image + (size_t)(lastRow-1)*width*4;
+        uint32_t xx = 0;
+        while(xx < width && row[xx*4+3] == kGifTransIndex) ++xx;
+        if(xx < width) break;
+        --lastRow;
+    }
+
+    // columns: each row only needs scanning up to the extent found so far
+    uint32_t minX = width, maxX = 0;
+    for(uint32_t yy=firstRow; yy<lastRow; ++yy)
+    {
+        const uint8_t* row = image + (size_t)yy*width*4;
+        for(uint32_t xx=0; xx<minX; ++xx)
+        {
+            if(row[xx*4+3] != kGifTransIndex) { minX = xx; break; }
+        }
+        for(uint32_t xx=width; xx>maxX+1; --xx)
+        {
+            if(row[(xx-1)*4+3] != kGifTransIndex) { maxX = xx-1; break; }
+        }
+    }
+    if(maxX < minX) maxX = minX; // a single changed column
+
+#ifdef GIF_FLIP_VERT
+    *top = height - lastRow;
+#else
+    *top = firstRow;
+#endif
+    *left = minX;
+    *rectWidth = maxX - minX + 1;
+    *rectHeight = lastRow - firstRow;
+    return true;
+}
+
+// Writes the image block for a palettized frame, covering only the part of the canvas it changes
+void GifWriteFrameBlock( GifBuffer* out, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal, bool useGlobalPalette, uint32_t numStrips, GifArena* arena, int lossyError, GifWorkers* workers )
+{
+    uint32_t left, top, rectWidth, rectHeight;
+    if(GifChangedRect(image, width, height, &left, &top, &rectWidth, &rectHeight))
+        GifWriteLzwImage(out, image, width, height, left, top, rectWidth, rectHeight, delay, pPal, useGlobalPalette, numStrips, arena, lossyError, workers);
+    else
+        GifWriteEmptyFrame(out, delay);
+}
+
+// whether two palettes would be written out as the same color table
+bool GifSamePaletteColors( const GifPalette* pA, const GifPalette* pB )
+{
+    size_t numColors = (size_t)1 << pA->bitDepth;
+    return pA->bitDepth == pB->bitDepth &&
+           memcmp(pA->r, pB->r, numColors) == 0 &&
+           memcmp(pA->g, pB->g, numColors) == 0 &&
+           memcmp(pA->b, pB->b, numColors) == 0;
+}
+
+// Mean error (sum of absolute RGB differences) of palettizing the pixels that changed
+// from lastFrame with an existing palette, i.e. how well that palette fits the new frame
+int GifPaletteError( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t numPixels, GifPalette* pPal, GifColorCache* cache )
+{
+    uint64_t totalError = 0;
+    uint32_t numChanged = 0;
+
+    for( uint32_t ii=0; ii<numPixels; ++ii, nextFrame += 4 )
+    {
+        if(lastFrame)
+        {
+            const uint8_t* lastPix = lastFrame + ii*4;
+            if(lastPix[0] == nextFrame[0] && lastPix[1] == nextFrame[1] && lastPix[2] == nextFrame[2])
+                continue;
+        }
+
+        int ind = GifCachedPaletteColor(pPal, cache, nextFrame[0], nextFrame[1], nextFrame[2]);
+        totalError += (uint64_t)(GifIAbs(nextFrame[0] - pPal->r[ind]) + GifIAbs(nextFrame[1] - pPal->g[ind]) + GifIAbs(nextFrame[2] - pPal->b[ind]));
+        ++numChanged;
+    }
+
+    return numChanged? (int)(totalError / numChanged) : 0;
+}
+
+// 128 bits identifying a frame, to recognize a repeat of the previous one without keeping a copy of it to compare:
+// a 64-bit multiplicative hash, in four independent lanes so the multiplies don't wait on each other, and in
+// check a 64-bit sum and sum of sums of the frame's words (as in Fletcher's checksum), which come for free
+// alongside. A changed frame passes for a repeat only if both match, which in practice never happens.
+uint64_t GifHashImage( const uint8_t* image, size_t size, uint64_t* check )
+{
+    const uint64_t kMul = 0x9e3779b97f4a7c15ull;
+    uint64_t lanes[4] = { 1, 2, 3, 4 };
+    uint64_t sum = 0, sumOfSums = 0;
+
+    size_t ii = 0;
+    for( ; ii+32 <= size; ii+=32 )
+    {
+        for(int ll=0; ll<4; ++ll)
+        {
+            uint64_t word;
+            memcpy(&word, image + ii + ll*8, 8);
+            lanes[ll] = (lanes[ll] ^ word) * kMul;
+            lanes[ll] ^= lanes[ll] >> 29;
+            sum += word;
+            sumOfSums += sum;
+        }
+    }
+
+    uint64_t hash = size;
+    for( ; ii<size; ++ii )
+    {
+        hash = (hash ^ image[ii]) * kMul;
+        sum += image[ii];
+        sumOfSums += sum;
+    }
+    for(int ll=0; ll<4; ++ll)
+    {
+        hash = (hash ^ lanes[ll]) * kMul;
+        hash ^= hash >> 32;
+    }
+    *check = sum ^ (sumOfSums * kMul);
+    return hash;
+}
+
+// Receives the encoded GIF: called once for the header, once per frame and once for the trailer,
+// always in order. Return false to report a write error.
+typedef bool (*GifSinkFunc)( const void* data, size_t size, void* user );
+
+// sink for GifBegin's file
+bool GifFileSink( const void* data, size_t size, void* user )
+{
+    return fwrite(data, 1, size, (FILE*)user) == size;
+}
+
+// sink that appends the GIF to a GifBuffer passed as user, e.g. to keep a recording in memory
+bool GifBufferSink( const void* data, size_t size, void* user )
+{
+    GifBufferWrite((GifBuffer*)user, data, size);
+    return true;
+}
+
+struct GifAsync;
+struct GifSegments;
+
+typedef struct
+{
+    FILE* f;               // file opened by GifBegin, NULL when writing to a caller's sink
+    GifSinkFunc sink;
+    void* sinkUser;
+    uint8_t* oldImage;
+    GifBuffer out;         // encoded bytes, handed to the sink once per frame
+    GifColorCache* colorCache;
+    GifArena arena;        // scratch memory for encoding on the calling thread, and for the palette stage
+    GifAsync* async;       // worker pool, NULL when frames are encoded on the calling thread
+    GifWorkers* workers;   // threads for LZW strips and two-pass color counting, NULL when not needed
+    GifSegments* segments; // file writer thread, when recording to rolling segments with GifBeginSegments
+    uint64_t lastHash;     // GifHashImage of the previous frame, if hasLastHash
+    uint64_t lastCheck;    // and its check
+
+    // the header is held back until the first frame, whose palette may become the global color table
+    uint32_t width, height, delay;
+
+    uint32_t heldDelay;    // delay of the frame block held in out, if hasHeldFrame
+    uint32_t lzwStrips;    // see GifSetLzwStrips
+    int lzwMaxError;       // see GifSetLossyLzw, 0 for lossless
+
+    // two-pass mode, see GifSetTwoPass: frames wait in the spill file until GifEnd
+    FILE* spill;
+    uint8_t* spillFrame;       // the latest frame, spilled once the next one turns out to differ
+    GifHistogram* spillColors; // colors of all the frames so far
+    uint32_t spillDelay;       // delay of spillFrame, with that of any repeats
+    uint32_t spillFrames;      // frames written to the spill file
+    int spillBitDepth;
+    int spillMaxBitDepth;      // the largest bitDepth of any frame
+    bool spillDither;
+    bool spillAnyDither;
+    bool ownsSpill;            // spill is a temporary file for GifEnd to close
+    bool fixedPalette;         // every frame uses the global palette as is
+    GifPaletteLut* paletteLut; // lookup table for the fixed palette, see GifSetFixedPalette
+
+    // palette reuse, see GifSetPaletteReuse
+    int paletteMaxError;   // -1 when a new palette is built for every frame
+    GifPalette lastPal;    // palette of the previous frame
+    GifPalette globalPal;  // colors of the global color table, if hasGlobalPal
+
+    bool firstFrame;
+    bool failed;           // the sink has reported an error
+    bool headerWritten;
+    bool hasLastPal;
+    bool hasGlobalPal;
+    bool hasLastHash;
+    bool hasHeldFrame;
+
+    uint8_t padding[1];    // make padding explicit
+} GifWriter;
+
+// Builds the palette for a frame - or reuses the previous one if it still fits - and palettizes
+// the frame into writer->oldImage (palette index in alpha), delta-encoding against the previous
+// frame's palettized output already there unless this is the first frame.
+// With paletteIndices, nextFrame holds an index into the fixed palette for each pixel instead of RGBA.
+void GifQuantizeFrame( GifWriter* writer, bool firstFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool dither, GifPalette* pPal, bool paletteIndices = false )
+{
+    const uint8_t* lastFrame = firstFrame? NULL : writer->oldImage;
+    uint8_t* outFrame = writer->oldImage;
+    GifColorCache* cache = writer->colorCache;
+
+    if(writer->fixedPalette)
+    {
+        // one palette for the whole animation, set by GifSetFixedPalette or made by two-pass mode
+        *pPal = writer->globalPal;
+    }
+    else
+    {
+        bool reuse = false;
+        if(writer->paletteMaxError >= 0 && writer->hasLastPal && lastFrame && writer->lastPal.bitDepth <= bitDepth)
+        {
+            // the cache still holds the previous frame's lookups, so checking the fit is cheap
+            GifColorCacheSetPalette(cache, &writer->lastPal);
+            reuse = GifPaletteError(lastFrame, nextFrame, width*height, &writer->lastPal, cache) <= writer->paletteMaxError;
+        }
+
+        if(reuse)
+            *pPal = writer->lastPal;
+        else
+            GifMakePalette((dither? NULL : lastFrame), nextFrame, width, height, bitDepth, dither, pPal, &writer->arena);
+
+        if(writer->paletteMaxError >= 0)
+        {
+            writer->lastPal = *pPal;
+            writer->hasLastPal = true;
+
+            // the first frame's palette goes in the global color table (of its segment, see GifBeginSegments)
+            if(firstFrame)
+            {
+                writer->globalPal = *pPal;
+                writer->hasGlobalPal = true;
+            }
+        }
+    }
+
+    if(paletteIndices)
+    {
+        GifIndexedThresholdImage(lastFrame, nextFrame, outFrame, width*height, pPal);
+    }
+    else if(dither)
+    {
+        GifDitherImage(lastFrame, nextFrame, outFrame, width, height, pPal, &writer->arena);
+    }
+    else if(writer->paletteLut)
+    {
+        GifLutThresholdImage(lastFrame, nextFrame, outFrame, width*height, writer->paletteLut);
+    }
+    else
+    {
+        GifColorCacheSetPalette(cache, pPal);
+        GifThresholdImage(lastFrame, nextFrame, outFrame, width, height, pPal, cache);
+    }
+}
+
+// Makes sure the writer has threads for at least numThreads tasks at once, see GifWorkers
+void GifUseWorkers( GifWriter* writer, uint32_t numThreads )
+{
+    if(writer->workers && writer->workers->threads.size() + 1 >= numThreads) return;
+
+    GifWorkersStop(writer->workers);
+    writer->workers = GifWorkersStart(numThreads);
+}
+
+// Keeps the previous frame's palette for as long as it fits new frames: a palette is only rebuilt once
+// the mean error (sum of absolute RGB differences per changed pixel) of the old one exceeds maxError.
+// Frames using the first frame's palette share it through the global color table instead of
+// repeating it as a local one. Pass a negative maxError to build a palette for every frame (the default).
+// Call right after GifBegin, before any frame has been written.
+bool GifSetPaletteReuse( GifWriter* writer, int maxError )
+{
+    if(!writer->sink || !writer->firstFrame) return false;
+
+    writer->paletteMaxError = maxError < 0? -1 : maxError;
+    return true;
+}
+
+// Compresses each image in up to numStrips horizontal strips on as many threads, for when a single
+// large frame has to be encoded quickly. Every strip starts over with an empty LZW dictionary, so
+// more strips trade compression ratio for speed; 1 (the default) gives the smallest files.
+// Strips are kept to at least kGifMinLzwStripPixels pixels.
+// Call right after GifBegin, before any frame has been written.
+bool GifSetLzwStrips( GifWriter* writer, uint32_t numStrips )
+{
+    if(!writer->sink || !writer->firstFrame) return false;
+
+    writer->lzwStrips = numStrips? numStrips : 1;
+    GifUseWorkers(writer, writer->lzwStrips);
+    return true;
+}
+
+// Encodes every frame with pPal rather than building palettes, and writes it once as the global color table.
+// Meant for previews, where speed matters more than color: without dithering, pixels are then palettized by
+// a lookup in a GifPaletteLut made here, which matches colors at kGifLutBits bits per component and makes
+// the cost per pixel that of reading and writing it. pPal can come from GifMakeCubePalette, or from
+// GifMakePalette run once on a reference frame. The bitDepth passed with each frame is ignored.
+// Call right after GifBegin, before any frame has been written.
+bool GifSetFixedPalette( GifWriter* writer, const GifPalette* pPal )
+{
+    if(!writer->sink || !writer->firstFrame || writer->spill || writer->fixedPalette) return false;
+
+    writer->globalPal = *pPal;
+    writer->hasGlobalPal = true;
+    writer->fixedPalette = true;
+
+    writer->paletteLut = (GifPaletteLut*)GifMalloc(sizeof(GifPaletteLut));
+    GifBuildPaletteLut(&writer->globalPal, writer->paletteLut);
+    return true;
+}
+
+// Lossy LZW, for long recordings where file size and write bandwidth matter more than exact colors.
+// A pixel may be encoded as another palette color up to maxError away (sum of absolute RGB differences,
+// as for GifSetPaletteReuse) whenever that lets the current LZW run go on, giving longer runs and fewer codes.
+// Pixels are never turned transparent or opaque this way, and since later frames are delta-encoded against
+// the intended colors the error doesn't build up. 0 (the default) is lossless.
+// Call right after GifBegin, before any frame has been written.
+bool GifSetLossyLzw( GifWriter* writer, int maxError )
+{
+    if(!writer->sink || !writer->firstFrame) return false;
+
+    writer->lzwMaxError = maxError > 0? maxError : 0;
+    return true;
+}
+
+// Two-pass mode, for final renders where file size matters more than latency. Frames are only stored -
+// in spill, a file open for reading and writing, or a temporary file if it's NULL - and their colors
+// counted until GifEnd. That makes one palette for the whole animation, writes it as the global color
+// table and then encodes every frame with it, so no frame needs a local color table.
+// Memory use stays at two frames and a color histogram however long the animation is.
+// Call right after GifBegin, before any frame has been written.
+bool GifSetTwoPass( GifWriter* writer, FILE* spill = NULL )
+{
+    if(!writer->sink || !writer->firstFrame || writer->spill || writer->fixedPalette || writer->segments) return false;
+
+    writer->ownsSpill = (spill == NULL);
+    if(!spill)
+    {
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+        if(tmpfile_s(&spill) != 0) spill = NULL;
+#else
+        spill = tmpfile();
+#endif
+        if(!spill) return false;
+    }
+
+    writer->spill = spill;
+    GifUseWorkers(writer, GifIMin((int)std::thread::hardware_concurrency(), 8));
+    writer->spillFrame = (uint8_t*)GifMalloc((size_t)writer->width * writer->height * 4);
+    writer->spillColors = (GifHistogram*)GifMalloc(sizeof(GifHistogram));
+    GifHistogramInit(writer->spillColors, (uint32_t)kGifMaxHistogramBins, true);
+    writer->spillFrames = 0;
+    writer->spillMaxBitDepth = 0;
+    writer->spillAnyDither = false;
+    return true;
+}
+
+// A frame in the spill file: this, then the frame's pixels
+typedef struct
+{
+    uint32_t delay;
+    int32_t bitDepth;
+    uint8_t dither;
+    uint8_t padding[3];    // make padding explicit
+} GifSpillRecord;
+
+// Writes the latest frame to the spill file
+void GifSpillHeldFrame( GifWriter* writer )
+{
+    GifSpillRecord record;
+    memset(&record, 0, sizeof(record));
+    record.delay = writer->spillDelay;
+    record.bitDepth = writer->spillBitDepth;
+    record.dither = writer->spillDither? 1 : 0;
+
+    size_t frameSize = (size_t)writer->width * writer->height * 4;
+    if(fwrite(&record, sizeof(record), 1, writer->spill) != 1 ||
+       fwrite(writer->spillFrame, 1, frameSize, writer->spill) != frameSize)
+        writer->failed = true;
+    ++writer->spillFrames;
+}
+
+// First pass of two-pass mode: counts the colors of a frame and holds on to it - repeats
+// only add to its delay - until the next one arrives
+bool GifSpillFrame( GifWriter* writer, const uint8_t* image, bool firstFrame, bool repeat, uint32_t delay, int bitDepth, bool dither )
+{
+    if(repeat)
+    {
+        writer->spillDelay += delay;
+        return !writer->failed;
+    }
+
+    if(!firstFrame)
+        GifSpillHeldFrame(writer);
+
+    // weight the palette towards the colors that will actually be encoded: the ones that change
+    GifCountFrameColors(writer->spillColors, firstFrame? NULL : writer->spillFrame, image, writer->width, writer->height, &writer->arena, writer->workers);
+
+    memcpy(writer->spillFrame, image, (size_t)writer->width * writer->height * 4);
+    writer->spillDelay = delay;
+    writer->spillBitDepth = bitDepth;
+    writer->spillDither = dither;
+    writer->spillMaxBitDepth = GifIMax(writer->spillMaxBitDepth, bitDepth);
+    writer->spillAnyDither = writer->spillAnyDither || dither;
+
+    return !writer->failed;
+}
+
+// Writes the file header, with pGlobalPal as the global color table, or a dummy 2-entry one if it's NULL
+void GifWriteHeader( GifBuffer* out, uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pGlobalPal )
+{
+    GifBufferWrite(out, "GIF89a", 6);
+
+    // screen descriptor
+    GifBufferPut(out, (uint8_t)(width & 0xff));
+    GifBufferPut(out, (uint8_t)((width >> 8) & 0xff));
+    GifBufferPut(out, (uint8_t)(height & 0xff));
+    GifBufferPut(out, (uint8_t)((height >> 8) & 0xff));
+
+    if(pGlobalPal)
+    {
+        GifBufferPut(out, (uint8_t)(0xf0 + pGlobalPal->bitDepth-1));  // there is an unsorted global color table of 2 ^ bitDepth entries
+        GifBufferPut(out, 0);     // background color
+        GifBufferPut(out, 0);     // pixels are square (we need to specify this because it's 1989)
+        GifWritePalette(pGlobalPal, out);
+    }
+    else
+    {
+        GifBufferPut(out, 0xf0);  // there is an unsorted global color table of 2 entries
+        GifBufferPut(out, 0);     // background color
+        GifBufferPut(out, 0);     // pixels are square (we need to specify this because it's 1989)
+
+        // now the "global" palette (really just a dummy palette)
+        // color 0: black
+        GifBufferPut(out, 0);
+        GifBufferPut(out, 0);
+        GifBufferPut(out, 0);
+        // color 1: also black
+        GifBufferPut(out, 0);
+        GifBufferPut(out, 0);
+        GifBufferPut(out, 0);
+    }
+
+    if( delay != 0 )
+    {
+        // animation header
+        GifBufferPut(out, 0x21); // extension
+        GifBufferPut(out, 0xff); // application specific
+        GifBufferPut(out, 11); // length 11
+        GifBufferWrite(out, "NETSCAPE2.0", 11); // yes, really
+        GifBufferPut(out, 3); // 3 bytes of NETSCAPE2.0 data
+
+        GifBufferPut(out, 1); // this is the Netscape 2.0 sub-block ID and it must be 1, otherwise some viewers error
+        GifBufferPut(out, 0); // loop infinitely (byte 0)
+        GifBufferPut(out, 0); // loop infinitely (byte 1)
+
+        GifBufferPut(out, 0); // block terminator
+    }
+}
+
+// hands everything in out to the sink and empties it
+bool GifFlush( GifWriter* writer, GifBuffer* out )
+{
+    if(out->size && !writer->sink(out->data, out->size, writer->sinkUser))
+        writer->failed = true;
+    out->size = 0;
+    return !writer->failed;
+}
+
+// Sends the header to the sink ahead of the first frame (or the trailer, if there are no frames)
+void GifFlushHeader( GifWriter* writer )
+{
+    if(writer->headerWritten) return;
+    writer->headerWritten = true;
+
+    GifBuffer header;
+    memset(&header, 0, sizeof(GifBuffer));
+    GifWriteHeader(&header, writer->width, writer->height, writer->delay, writer->hasGlobalPal? &writer->globalPal : NULL);
+    GifFlush(writer, &header);
+    GifBufferFree(&header);
+}
+
+// Rolling segments, see GifBeginSegments. The encoded bytes are queued for a background thread, which
+// writes them to the current file and at the end of each segment flushes it to disk, closes it and opens
+// the next, so none of the file I/O happens on the thread writing frames.
+struct GifSegments
+{
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;      // signalled when bytes are queued or the thread is stopping
+    std::vector<GifBuffer> queue;      // bytes waiting to be written, in order; an empty buffer ends the current file
+    std::vector<GifBuffer> spare;      // written buffers, kept for reuse
+    FILE* file;                        // the segment being written, NULL between segments
+    char* baseName;                    // GifBeginSegments' filename
+    char* path;                        // room for a segment's file name
+    size_t extPos;                     // where the index goes in baseName
+    uint32_t fileIndex;                // segment being written
+    uint32_t maxFrames;                // segment limits, 0 for none
+    uint64_t maxBytes;
+    uint32_t framesInSegment;          // frames handed to GifWriteFrame since the last segment started
+    uint32_t segmentsStarted;          // segments GifWriteFrame has started
+    std::atomic<uint32_t> segmentsWritten; // segments that have reached the queue
+    std::atomic<uint64_t> bytesInSegment;  // bytes queued for the latest of those
+    std::atomic<bool> failed;
+    bool stopping;
+};
+
+// Names segment index after baseName, with _000, _001, ... before the extension
+void GifSegmentPath( GifSegments* segs, uint32_t index )
+{
+    size_t size = strlen(segs->baseName) + 16;
+    snprintf(segs->path, size, "%.*s_%03u%s", (int)segs->extPos, segs->baseName, index, segs->baseName + segs->extPos);
+}
+
+bool GifOpenSegment( GifSegments* segs )
+{
+    GifSegmentPath(segs, segs->fileIndex);
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+    if(fopen_s(&segs->file, segs->path, "wb") != 0) segs->file = NULL;
+#else
+    segs->file = fopen(segs->path, "wb");
+#endif
+    return segs->file != NULL;
+}
+
+// Makes sure a finished segment is on disk before moving on, so it can be picked up right away
+bool GifCloseSegment( GifSegments* segs )
+{
+    bool ok = fflush(segs->file) == 0;
+#if defined(_WIN32)
+    ok = _commit(_fileno(segs->file)) == 0 && ok;
+#else
+    ok = fsync(fileno(segs->file)) == 0 && ok;
+#endif
+    ok = fclose(segs->file) == 0 && ok;
+    segs->file = NULL;
+    return ok;
+}
+
+void GifSegmentWriter( GifSegments* segs )
+{
+    std::unique_lock<std::mutex> guard(segs->lock);
+    for(;;)
+    {
+        segs->wake.wait(guard, [segs]{ return segs->stopping || !segs->queue.empty(); });
+        if(segs->queue.empty()) break;
+
+        GifBuffer buf = segs->queue.front();
+        segs->queue.erase(segs->queue.begin());
+        guard.unlock();
+
+        bool ok = true;
+        if(buf.size == 0)
+        {
+            if(segs->file) ok = GifCloseSegment(segs);
+            ++segs->fileIndex;
+        }
+        else
+        {
+            if(!segs->file) ok = GifOpenSegment(segs);
+            ok = ok && fwrite(buf.data, 1, buf.size, segs->file) == buf.size;
+        }
+        if(!ok) segs->failed = true;
+
+        guard.lock();
+        buf.size = 0;
+        segs->spare.push_back(buf);
+    }
+
+    if(segs->file && !GifCloseSegment(segs)) segs->failed = true;
+}
+
+void GifQueueSegmentBytes( GifSegments* segs, const void* data, size_t size )
+{
+    GifBuffer buf;
+    memset(&buf, 0, sizeof(GifBuffer));
+
+    std::unique_lock<std::mutex> guard(segs->lock);
+    if(!segs->spare.empty())
+    {
+        buf = segs->spare.back();
+        segs->spare.pop_back();
+    }
+    guard.unlock();
+
+    if(size) GifBufferWrite(&buf, data, size);
+
+    guard.lock();
+    segs->queue.push_back(buf);
+    segs->wake.notify_one();
+}
+
+// sink for GifBeginSegments
+bool GifSegmentSink( const void* data, size_t size, void* user )
+{
+    GifSegments* segs = (GifSegments*)user;
+    GifQueueSegmentBytes(segs, data, size);
+    segs->bytesInSegment += size;
+    return !segs->failed;
+}
+
+// Decides whether the frame being handed to GifWriteFrame starts a new segment. The byte limit is checked
+// against what has been encoded so far, which with GifSetAsync trails the frames handed in by a few.
+bool GifSegmentNextFrame( GifSegments* segs )
+{
+    bool full = segs->framesInSegment > 0 &&
+                ((segs->maxFrames && segs->framesInSegment >= segs->maxFrames) ||
+                 (segs->maxBytes && segs->segmentsWritten == segs->segmentsStarted && segs->bytesInSegment >= segs->maxBytes));
+    if(full)
+    {
+        ++segs->segmentsStarted;
+        segs->framesInSegment = 0;
+    }
+
+    ++segs->framesInSegment;
+    return full;
+}
+
+// Stops the file writer thread once it has written everything, and frees the segments
+bool GifEndSegments( GifSegments* segs )
+{
+    {
+        std::lock_guard<std::mutex> guard(segs->lock);
+        segs->stopping = true;
+    }
+    segs->wake.notify_all();
+    segs->thread.join();
+
+    bool ok = !segs->failed;
+    for(size_t ii=0; ii<segs->spare.size(); ++ii)
+        GifBufferFree(&segs->spare[ii]);
+    GIF_FREE(segs->path);
+    GIF_FREE(segs->baseName);
+    delete segs;
+    return ok;
+}
+
+// The last frame block stays in writer->out until the next frame turns out to be different,
+// so that repeats of it can be folded into its delay rather than written as frames of their own.
+
+// Writes out the held frame block, if any, so a new one can be started in writer->out
+void GifReleaseHeldFrame( GifWriter* writer )
+{
+    GifFlushHeader(writer);
+    GifFlush(writer, &writer->out);
+    writer->hasHeldFrame = false;
+}
+
+// Room for a frame block coded at up to 12 bits a pixel. With async workers the block buffers pass from
+// job to job through writer->out (see GifHoldFrame), and would otherwise each grow a frame at a time.
+void GifReserveFrameBlock( GifBuffer* block, uint32_t width, uint32_t height )
+{
+    GifBufferReserve(block, (size_t)width * height * 3 / 2 + 4096);
+}
+
+// Holds the frame block in block (taking its contents) in place of the current one
+void GifHoldFrame( GifWriter* writer, GifBuffer* block, uint32_t delay )
+{
+    GifReleaseHeldFrame(writer);
+
+    GifBuffer held = writer->out;
+    writer->out = *block;
+    *block = held;
+
+    writer->heldDelay = delay;
+    writer->hasHeldFrame = true;
+}
+
+// A frame identical to the previous one: add its delay to the held frame's, or if the
+// 16-bit delay field can't take it, hold an empty frame with the delay instead
+void GifHoldRepeatedFrame( GifWriter* writer, uint32_t delay )
+{
+    if(writer->hasHeldFrame && writer->heldDelay + delay <= 0xffff)
+    {
+        writer->heldDelay += delay;
+
+        // the block starts with its graphic control extension, delay at bytes 4-5
+        writer->out.data[4] = (uint8_t)(writer->heldDelay & 0xff);
+        writer->out.data[5] = (uint8_t)((writer->heldDelay >> 8) & 0xff);
+        return;
+    }
+
+    GifReleaseHeldFrame(writer);
+    GifWriteEmptyFrame(&writer->out, delay);
+    writer->heldDelay = delay;
+    writer->hasHeldFrame = true;
+}
+
+// Ends the segment in progress, if there is one, and starts the next GIF with its header; pGlobalPal is
+// the global color table of the frame that comes next, or NULL if that frame has a local one.
+// For a writer without segments, this just writes the header ahead of the first frame.
+void GifStartSegment( GifWriter* writer, const GifPalette* pGlobalPal )
+{
+    if(writer->headerWritten)
+    {
+        GifReleaseHeldFrame(writer);
+        GifBufferPut(&writer->out, 0x3b); // end of file
+        GifFlush(writer, &writer->out);
+
+        if(writer->segments)
+        {
+            GifQueueSegmentBytes(writer->segments, NULL, 0);
+            writer->segments->bytesInSegment = 0;
+            ++writer->segments->segmentsWritten;
+        }
+    }
+
+    GifWriteHeader(&writer->out, writer->width, writer->height, writer->delay, pGlobalPal);
+    GifFlush(writer, &writer->out);
+    writer->headerWritten = true;
+}
+
+// One frame travelling through the asynchronous pipeline. Jobs and their buffers are reused once written.
+struct GifFrameJob
+{
+    uint64_t index;        // position in the animation
+    uint8_t* image;        // copy of the caller's frame, unused for a repeat
+    uint8_t* indexed;      // palettized frame, palette index in alpha
+    uint32_t width, height, delay;
+    int bitDepth;
+    bool dither;
+    bool firstFrame;
+    bool repeat;           // same as the previous frame, only its delay is written
+    bool paletteIndices;   // image holds an index per pixel, see GifWriteIndexedFrame
+    bool useGlobalPalette; // the frame's palette is the global color table
+    bool done;             // image block is encoded and ready to be written
+    GifPalette pal;
+    GifBuffer out;
+    GifArena arena;        // scratch memory for the LZW stage
+};
+
+// The palette and thresholding stage of frame N needs the palettized output of frame N-1,
+// so it runs strictly in frame order; the LZW stage of each frame is independent and runs
+// in parallel. Finished frames are written to the sink in order by one worker at a time,
+// outside the lock, while the others go on encoding.
+struct GifAsync
+{
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;       // signalled when a job is queued or the pool is stopping
+    std::condition_variable quantized;  // signalled when a frame's palettized output is ready
+    std::condition_variable written;    // signalled when frames leave the pipeline
+    std::vector<GifFrameJob*> pending;  // jobs no worker has picked up yet
+    std::vector<GifFrameJob*> inFlight; // every job not yet written, in frame order
+    std::vector<GifFrameJob*> freeJobs; // jobs waiting for a frame, oldest written first
+    uint64_t nextIndex;                 // index of the next frame handed to GifWriteFrame
+    uint64_t nextQuantize;              // index of the frame allowed to run its palette stage
+    size_t maxInFlight;                 // number of jobs, which bounds the memory held by queued frames
+    bool stopping;
+    bool writing;                       // a worker is writing finished frames to the sink
+    bool failed;                        // writer->failed, as of the last frame written
+};
+
+// A job with the buffers for a width x height frame
+GifFrameJob* GifNewJob( uint32_t width, uint32_t height )
+{
+    GifFrameJob* job = (GifFrameJob*)GifMalloc(sizeof(GifFrameJob));
+    memset(job, 0, sizeof(GifFrameJob));
+    job->image = (uint8_t*)GifMalloc((size_t)width * height * 4);
+    job->indexed = (uint8_t*)GifMalloc((size_t)width * height * 4);
+    GifReserveFrameBlock(&job->out, width, height);
+    return job;
+}
+
+void GifFreeJob( GifFrameJob* job )
+{
+    GIF_FREE(job->image);
+    GIF_FREE(job->indexed);
+    GifBufferFree(&job->out);
+    GifArenaRelease(&job->arena);
+    GIF_FREE(job);
+}
+
+void GifAsyncWorker( GifWriter* writer )
+{
+    GifAsync* async = writer->async;
+
+    for(;;)
+    {
+        std::unique_lock<std::mutex> guard(async->lock);
+        async->wake.wait(guard, [async]{ return async->stopping || !async->pending.empty(); });
+        if(async->pending.empty()) break;
+
+        // the queues hold a few frames per worker, so taking from the front is cheap
+        GifFrameJob* job = async->pending.front();
+        async->pending.erase(async->pending.begin());
+
+        // wait for the previous frame's palettized output in writer->oldImage
+        async->quantized.wait(guard, [async, job]{ return async->nextQuantize == job->index; });
+        guard.unlock();
+
+        if(!job->repeat)
+        {
+            GifQuantizeFrame(writer, job->firstFrame, job->image, job->width, job->height, job->bitDepth, job->dither, &job->pal, job->paletteIndices);
+            memcpy(job->indexed, writer->oldImage, (size_t)job->width * job->height * 4);
+            job->useGlobalPalette = writer->hasGlobalPal && GifSamePaletteColors(&job->pal, &writer->globalPal);
+        }
+
+        guard.lock();
+        ++async->nextQuantize;
+        async->quantized.notify_all();
+        guard.unlock();
+
+        if(!job->repeat)
+            GifWriteFrameBlock(&job->out, job->indexed, job->width, job->height, job->delay, &job->pal, job->useGlobalPalette, writer->lzwStrips, &job->arena, writer->lzwMaxError, writer->workers);
+
+        guard.lock();
+        job->done = true;
+        if(async->writing) continue; // the worker writing picks this frame up when it gets to it
+
+        // write out every finished frame at the head of the queue, in order
+        async->writing = true;
+        while(!async->inFlight.empty() && async->inFlight.front()->done)
+        {
+            GifFrameJob* head = async->inFlight.front();
+            async->inFlight.erase(async->inFlight.begin());
+            guard.unlock();
+
+            if(head->repeat)
+            {
+                GifHoldRepeatedFrame(writer, head->delay);
+            }
+            else
+            {
+                if(head->firstFrame)
+                    GifStartSegment(writer, head->useGlobalPalette? &head->pal : NULL);
+                GifHoldFrame(writer, &head->out, head->delay);
+            }
+
+            guard.lock();
+            async->failed = writer->failed;
+            async->freeJobs.push_back(head);
+            async->written.notify_all();
+        }
+        async->writing = false;
+    }
+}
+
+// Moves frame encoding onto numThreads worker threads.
+// Call right after GifBegin, before any frame has been written.
+bool GifSetAsync( GifWriter* writer, uint32_t numThreads )
+{
+    if(!writer->sink || !writer->firstFrame || writer->async) return false;
+    if(numThreads == 0) numThreads = 1;
+
+    GifAsync* async = new GifAsync;
+    async->nextIndex = 0;
+    async->nextQuantize = 0;
+    async->maxInFlight = 2 * (size_t)numThreads;
+    async->stopping = false;
+    async->writing = false;
+    async->failed = false;
+    async->pending.reserve(async->maxInFlight);
+    async->inFlight.reserve(async->maxInFlight);
+    GifReserveFrameBlock(&writer->out, writer->width, writer->height);
+    writer->async = async;
+
+    // every job is made here and then taken in turn, so each has seen the same frames as the others
+    // and stopped growing its buffers by the time the animation repeats itself
+    for(size_t ii=0; ii<async->maxInFlight; ++ii)
+        async->freeJobs.push_back(GifNewJob(writer->width, writer->height));
+
+    for(uint32_t ii=0; ii<numThreads; ++ii)
+        async->workers.push_back(std::thread(GifAsyncWorker, writer));
+
+    return true;
+}
+
+// Starts a GIF that is written through a caller-supplied sink instead of a file.
+// Otherwise the same as GifBegin. If the sink fails, GifWriteFrame and GifEnd return false.
+bool GifBeginSink( GifWriter* writer, GifSinkFunc sink, void* sinkUser, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
+{
+    (void)bitDepth; (void)dither; // Mute "Unused argument" warnings
+    writer->f = NULL;
+    writer->sink = sink;
+    if(!sink) return false;
+
+    writer->sinkUser = sinkUser;
+    writer->firstFrame = true;
+    writer->failed = false;
+    writer->async = NULL;
+    writer->workers = NULL;
+    writer->segments = NULL;
+    memset(&writer->out, 0, sizeof(GifBuffer));
+    memset(&writer->arena, 0, sizeof(GifArena));
+
+    // allocate
+    writer->oldImage = (uint8_t*)GifMalloc(width*height*4);
+    writer->colorCache = (GifColorCache*)GifMalloc(sizeof(GifColorCache));
+    memset(writer->colorCache, 0, sizeof(GifColorCache));
+
+    writer->width = width;
+    writer->height = height;
+    writer->delay = delay;
+    writer->headerWritten = false;
+    writer->paletteMaxError = -1;
+    writer->hasLastPal = false;
+    writer->hasGlobalPal = false;
+    writer->hasLastHash = false;
+    writer->hasHeldFrame = false;
+    writer->lzwStrips = 1;
+    writer->lzwMaxError = 0;
+    writer->spill = NULL;
+    writer->spillFrame = NULL;
+    writer->spillColors = NULL;
+    writer->ownsSpill = false;
+    writer->fixedPalette = false;
+    writer->paletteLut = NULL;
+
+    return true;
+}
+
+// Creates a gif file.
+// The input GIFWriter is assumed to be uninitialized.
+// The delay value is the time between frames in hundredths of a second - note that not all viewers pay much attention to this value.
+bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
+{
+    FILE* f = 0;
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+    fopen_s(&f, filename, "wb");
+#else
+    f = fopen(filename, "wb");
+#endif
+    writer->f = NULL;
+    writer->sink = NULL;
+    if(!f) return false;
+
+    GifBeginSink(writer, GifFileSink, f, width, height, delay, bitDepth, dither);
+    writer->f = f;
+    return true;
+}
+
+// Records to rolling segments instead of one file, for long sessions: a new GIF is started every maxFrames
+// frames or once the current one reaches about maxBytes bytes, whichever comes first (0 for no limit).
+// Segments are named after filename with _000, _001, ... before the extension, and each is a complete GIF
+// that starts with a whole frame. Writing the files, and closing each one, happens on a background thread.
+// Otherwise the same as GifBegin.
+bool GifBeginSegments( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay,
+                       uint32_t maxFrames, uint64_t maxBytes, int32_t bitDepth = 8, bool dither = false )
+{
+    writer->f = NULL;
+    writer->sink = NULL;
+
+    GifSegments* segs = new GifSegments;
+    segs->file = NULL;
+    segs->baseName = (char*)GifMalloc(strlen(filename) + 1);
+    segs->path = (char*)GifMalloc(strlen(filename) + 16);
+    memcpy(segs->baseName, filename, strlen(filename) + 1);
+
+    const char* ext = strrchr(filename, '.');
+    const char* dir = strpbrk(ext? ext : filename, "/\\");
+    segs->extPos = (ext && !dir)? (size_t)(ext - filename) : strlen(filename);
+
+    segs->fileIndex = 0;
+    segs->maxFrames = maxFrames;
+    segs->maxBytes = maxBytes;
+    segs->framesInSegment = 0;
+    segs->segmentsStarted = 0;
+    segs->segmentsWritten = 0;
+    segs->bytesInSegment = 0;
+    segs->failed = false;
+    segs->stopping = false;
+
+    // open the first file here, so that a bad path is reported right away
+    if(!GifOpenSegment(segs))
+    {
+        GIF_FREE(segs->path);
+        GIF_FREE(segs->baseName);
+        delete segs;
+        return false;
+    }
+
+    segs->thread = std::thread(GifSegmentWriter, segs);
+
+    GifBeginSink(writer, GifSegmentSink, segs, width, height, delay, bitDepth, dither);
+    writer->segments = segs;
+    return true;
+}
+
+// GifWriteFrame, GifWriteIndexedFrame and GifRepeatFrame: image is RGBA, with paletteIndices one byte
+// per pixel, or NULL for a repeat of the previous frame
+bool GifWriteFrameData( GifWriter* writer, const uint8_t* image, bool paletteIndices, uint32_t width, uint32_t height, uint32_t delay, int bitDepth, bool dither )
+{
+    bool firstFrame = writer->firstFrame;
+    writer->firstFrame = false;
+
+    // a frame identical to the previous one just extends how long that one is shown. It is recognized by
+    // its 128-bit GifHashImage, so the previous frame needn't be kept to compare against
+    size_t imageSize = (size_t)width * height * (paletteIndices? 1 : 4);
+    bool repeat = !image;
+    if(image)
+    {
+        uint64_t check;
+        uint64_t hash = GifHashImage(image, imageSize, &check);
+        repeat = writer->hasLastHash && hash == writer->lastHash && check == writer->lastCheck;
+        writer->lastHash = hash;
+        writer->lastCheck = check;
+        writer->hasLastHash = true;
+    }
+
+    // the first frame of a new segment is encoded whole, as the start of a GIF of its own
+    if(image && writer->segments && GifSegmentNextFrame(writer->segments))
+    {
+        firstFrame = true;
+        repeat = false;
+    }
+
+    if(writer->spill)
+        return GifSpillFrame(writer, image, firstFrame, repeat, delay, bitDepth, dither);
+
+    if(writer->async)
+    {
+        GifAsync* async = writer->async;
+        std::unique_lock<std::mutex> guard(async->lock);
+        async->written.wait(guard, [async]{ return !async->freeJobs.empty(); });
+
+        // hand a copy of the frame to the worker pool, in the job written longest ago
+        GifFrameJob* job = async->freeJobs.front();
+        async->freeJobs.erase(async->freeJobs.begin());
+        guard.unlock();
+
+        if(!repeat)
+            memcpy(job->image, image, imageSize);
+        job->width = width;
+        job->height = height;
+        job->delay = delay;
+        job->bitDepth = bitDepth;
+        job->dither = dither;
+        job->firstFrame = firstFrame;
+        job->repeat = repeat;
+        job->paletteIndices = paletteIndices;
+        job->done = false;
+        job->out.size = 0;
+
+        guard.lock();
+        job->index = async->nextIndex++;
+        async->pending.push_back(job);
+        async->inFlight.push_back(job);
+        async->wake.notify_one();
+
+        // errors surface on a later frame, once the worker that hit them has written
+        return !async->failed;
+    }
+
+    if(repeat)
+    {
+        GifHoldRepeatedFrame(writer, delay);
+        return !writer->failed;
+    }
+
+    GifPalette pal;
+    GifQuantizeFrame(writer, firstFrame, image, width, height, bitDepth, dither, &pal, paletteIndices);
+    bool useGlobalPalette = writer->hasGlobalPal && GifSamePaletteColors(&pal, &writer->globalPal);
+
+    if(firstFrame)
+        GifStartSegment(writer, useGlobalPalette? &pal : NULL);
+    else
+        GifReleaseHeldFrame(writer);
+    GifWriteFrameBlock(&writer->out, writer->oldImage, width, height, delay, &pal, useGlobalPalette, writer->lzwStrips, &writer->arena, writer->lzwMaxError, writer->workers);
+    writer->heldDelay = delay;
+    writer->hasHeldFrame = true;
+    return !writer->failed;
+}
+
+// Writes out a new frame to a GIF in progress.
+// The GIFWriter should have been created by GIFBegin.
+// AFAIK, it is legal to use different bit depths for different frames of an image -
+// this may be handy to save bits in animations that don't change much.
+// bitDepth is the most the frame will use: frames with fewer colors get a smaller palette.
+bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth = 8, bool dither = false )
+{
+    if(!writer->sink) return false;
+
+    return GifWriteFrameData(writer, image, false, width, height, delay, bitDepth, dither);
+}
+
+// Writes out a frame that was already palettized with the palette given to GifSetFixedPalette, e.g. on the GPU
+// with a 3D texture of GifGetPaletteLutIndices: one palette index per pixel, width*height bytes. The frame is
+// encoded as GifWriteFrame would encode the RGBA frame it came from, without reading or searching any colors
+// (see GifIndexedThresholdImage for the one difference). Returns false if no fixed palette was set.
+bool GifWriteIndexedFrame( GifWriter* writer, const uint8_t* indices, uint32_t width, uint32_t height, uint32_t delay )
+{
+    if(!writer->sink || !writer->paletteLut) return false;
+
+    return GifWriteFrameData(writer, indices, true, width, height, delay, 8, false);
+}
+
+// Shows the previous frame for delay longer, as writing the same image again would, without the image -
+// for a frame known to be unchanged, e.g. because nothing in the scene moved, that was never read back.
+// Never starts a new segment. Returns false if no frame has been written yet.
+bool GifRepeatFrame( GifWriter* writer, uint32_t delay )
+{
+    if(!writer->sink || !writer->hasLastHash) return false;
+
+    return GifWriteFrameData(writer, NULL, false, writer->width, writer->height, delay, 8, false);
+}
+
+// Second pass of two-pass mode: makes the palette from the colors of all the frames,
+// then reads the frames back from the spill file and encodes them with it
+void GifReplaySpill( GifWriter* writer )
+{
+    bool anyFrames = !writer->firstFrame;
+    if(anyFrames)
+    {
+        GifSpillHeldFrame(writer);
+
+        GifPaletteFromHistogram(writer->spillColors, writer->spillMaxBitDepth, writer->spillAnyDither, &writer->globalPal);
+        writer->hasGlobalPal = true;
+        writer->fixedPalette = true;
+    }
+
+    GifHistogramFree(writer->spillColors, true);
+    GIF_FREE(writer->spillColors);
+    writer->spillColors = NULL;
+
+    FILE* spill = writer->spill;
+    writer->spill = NULL; // frames go to the encoder from here on
+    writer->firstFrame = true;
+    writer->hasLastHash = false;
+
+    uint32_t numFrames = 0;
+    if(anyFrames && !writer->failed && fseek(spill, 0, SEEK_SET) == 0)
+    {
+        size_t frameSize = (size_t)writer->width * writer->height * 4;
+        GifSpillRecord record;
+        while(numFrames < writer->spillFrames &&
+              fread(&record, sizeof(record), 1, spill) == 1 &&
+              fread(writer->spillFrame, 1, frameSize, spill) == frameSize)
+        {
+            // repeats may have added up to more than the 16-bit delay field holds;
+            // split it up again, GifWriteFrame folds what it can back together
+            uint32_t delay = record.delay;
+            do
+            {
+                uint32_t part = delay < 0xffff? delay : 0xffff;
+                GifWriteFrame(writer, writer->spillFrame, writer->width, writer->height, part, record.bitDepth, record.dither != 0);
+                delay -= part;
+            } while(delay);
+
+            ++numFrames;
+        }
+    }
+    if(numFrames != writer->spillFrames) writer->failed = true;
+
+    if(writer->ownsSpill) fclose(spill);
+    GIF_FREE(writer->spillFrame);
+    writer->spillFrame = NULL;
+}
+
+// Writes the EOF code, closes the file handle, and frees temp memory used by a GIF.
 // Many if not most viewers will still display a GIF properly if the EOF code is missing,
 // but it's still a good idea to write it out.
 bool GifEnd( GifWriter* writer )
 {
-    if(!writer->f) return false;
+    if(!writer->sink) return false;
+
+    if(writer->spill)
+        GifReplaySpill(writer);
+
+    if(writer->async)
+    {
+        // let the workers drain the queue, then shut them down
+        {
+            std::lock_guard<std::mutex> guard(writer->async->lock);
+            writer->async->stopping = true;
+        }
+        writer->async->wake.notify_all();
+        for(size_t ii=0; ii<writer->async->workers.size(); ++ii)
+            writer->async->workers[ii].join();
+        for(size_t ii=0; ii<writer->async->freeJobs.size(); ++ii)
+            GifFreeJob(writer->async->freeJobs[ii]);
+
+        delete writer->async;
+        writer->async = NULL;
+    }
+
+    GifWorkersStop(writer->workers);
+    writer->workers = NULL;
+
+    GifReleaseHeldFrame(writer);
+    GifBufferPut(&writer->out, 0x3b); // end of file
+    bool ok = GifFlush(writer, &writer->out);
+
+    if(writer->f && fclose(writer->f) != 0) ok = false;
+    if(writer->segments && !GifEndSegments(writer->segments)) ok = false;
+    GIF_FREE(writer->oldImage);
+    GIF_FREE(writer->colorCache);
+    GIF_FREE(writer->paletteLut);
+    GifArenaRelease(&writer->arena);
+    GifBufferFree(&writer->out);
+
+    writer->f = NULL;
+    writer->sink = NULL;
+    writer->segments = NULL;
+    writer->oldImage = NULL;
+    writer->colorCache = NULL;
+    writer->paletteLut = NULL;
+
+    return ok;
+}
+
+// Instant replay, see GifReplayBegin. Frames are kept as the changes from the frame before: runs of
+// unchanged pixels alternate with runs of changed ones, which are stored XORed with the old pixels.
+// Each run length is a little-endian base-128 number (7 bits a byte, high bit set on all but the last).
+
+int GifPutRunLength( uint8_t* out, uint32_t count )
+{
+    int numBytes = 0;
+    while(count >= 0x80)
+    {
+        out[numBytes++] = (uint8_t)(count | 0x80);
+        count >>= 7;
+    }
+    out[numBytes++] = (uint8_t)count;
+    return numBytes;
+}
+
+// Reads a run length written by GifPutRunLength from data, which ends at end, into count.
+// Returns false if the number runs past end or doesn't fit in 32 bits.
+bool GifGetRunLength( const uint8_t** data, const uint8_t* end, uint32_t* count )
+{
+    const uint8_t* in = *data;
+    uint64_t value = 0;
+    int shift = 0;
+    do
+    {
+        if(in == end || shift > 28) return false;
+        value |= (uint64_t)(*in & 0x7f) << shift;
+        shift += 7;
+    } while(*in++ & 0x80);
+    if(value > 0xffffffffu) return false;
+    *data = in;
+    *count = (uint32_t)value;
+    return true;
+}
+
+// The most bytes GifXorRleEncode writes for a frame: each run of changed pixels follows at least one
+// unchanged pixel (but for the first), so the run lengths never cost more than the pixels they skip
+size_t GifXorRleBound( uint32_t numPixels )
+{
+    return (size_t)numPixels*4 + 16;
+}
+
+// Writes the changes from prevFrame to nextFrame into out, and brings prevFrame up to date with nextFrame.
+// Returns the number of bytes written.
+size_t GifXorRleEncode( uint8_t* prevFrame, const uint8_t* nextFrame, uint32_t numPixels, uint8_t* out )
+{
+    uint8_t* start = out;
+    uint32_t ii = 0;
+    while(ii < numPixels)
+    {
+        uint32_t runStart = ii;
+#if defined(GIF_SSE2)
+        // the frames mostly match, so skip unchanged pixels four at a time
+        for(; ii+4 <= numPixels; ii += 4)
+        {
+            __m128i prev = _mm_loadu_si128((const __m128i*)(prevFrame + ii*4));
+            __m128i next = _mm_loadu_si128((const __m128i*)(nextFrame + ii*4));
+            if(_mm_movemask_epi8(_mm_cmpeq_epi32(prev, next)) != 0xffff) break;
+        }
+#endif
+        while(ii < numPixels && memcmp(prevFrame + ii*4, nextFrame + ii*4, 4) == 0) ++ii;
+        out += GifPutRunLength(out, ii - runStart);
+
+        runStart = ii;
+        while(ii < numPixels && memcmp(prevFrame + ii*4, nextFrame + ii*4, 4) != 0) ++ii;
+        out += GifPutRunLength(out, ii - runStart);
+
+        for(uint32_t jj=runStart*4; jj<ii*4; ++jj)
+        {
+            *out++ = prevFrame[jj] ^ nextFrame[jj];
+            prevFrame[jj] = nextFrame[jj];
+        }
+    }
+    return (size_t)(out - start);
+}
+
+// Applies size bytes of changes written by GifXorRleEncode to image. Returns false, with image partly
+// updated, if the changes are cut short or have runs past the end of the image.
+bool GifXorRleApply( uint8_t* image, const uint8_t* data, size_t size, uint32_t numPixels )
+{
+    const uint8_t* end = data + size;
+    uint32_t ii = 0;
+    while(ii < numPixels)
+    {
+        uint32_t skip, count;
+        if(!GifGetRunLength(&data, end, &skip) || skip > numPixels - ii) return false;
+        ii += skip;
+        if(!GifGetRunLength(&data, end, &count) || count > numPixels - ii ||
+           (size_t)count*4 > (size_t)(end - data)) return false;
+        for(size_t jj=(size_t)ii*4; jj<(size_t)(ii+count)*4; ++jj)
+            image[jj] ^= *data++;
+        ii += count;
+    }
+    return true;
+}
+
+// A frame in the replay ring: its changes from the frame before follow
+typedef struct
+{
+    uint32_t size;  // bytes of changes
+    uint32_t delay;
+} GifReplayRecord;
+
+struct GifReplaySaveJob;
+
+typedef struct
+{
+    uint32_t width, height;
+    uint32_t maxDelay;          // the length of the window, in hundredths of a second; 0 to keep what fits
+    uint32_t numRecords;        // frames in the ring, after base
+    uint8_t* ring;              // records, oldest first, each followed by its changes
+    size_t capacity;
+    size_t head;                // the oldest record
+    size_t tail;                // where the next record goes
+    size_t end;                 // when wrapped, the end of the records at the top of the ring
+    size_t used;                // bytes of records in the ring
+    uint8_t* base;              // the oldest frame kept, whole; the records apply to it in turn
+    uint8_t* last;              // the newest frame, whole
+    uint8_t* packed;            // room to pack one frame's changes
+    size_t newest;              // the newest record, while there are any
+    uint32_t baseDelay;
+    uint32_t totalDelay;        // of every frame kept, base included
+    GifReplaySaveJob* saving;   // the save in progress, or finished but not yet joined
+    bool hasFrames;
+    bool wrapped;               // the records run from head to end, then from the start of the ring to tail
+    uint8_t padding[6];
+} GifReplayBuffer;
+
+// Keeps the last maxDelay hundredths of a second of frames in at most maxBytes bytes of changes, on top of
+// three whole frames (the oldest, the newest and a scratch one). Frames that would go over either limit push
+// the oldest ones out. A frame that changes too much to fit at all starts the window over from it.
+bool GifReplayBegin( GifReplayBuffer* replay, uint32_t width, uint32_t height, uint32_t maxDelay, size_t maxBytes )
+{
+    size_t imageSize = (size_t)width * height * 4;
+    memset(replay, 0, sizeof(GifReplayBuffer));
+    replay->width = width;
+    replay->height = height;
+    replay->maxDelay = maxDelay;
+    replay->capacity = maxBytes;
+    replay->ring = (uint8_t*)GifMalloc(maxBytes);
+    replay->base = (uint8_t*)GifMalloc(imageSize);
+    replay->last = (uint8_t*)GifMalloc(imageSize);
+    replay->packed = (uint8_t*)GifMalloc(GifXorRleBound(width*height));
+    if(!replay->ring || !replay->base || !replay->last || !replay->packed)
+    {
+        GIF_FREE(replay->ring);
+        GIF_FREE(replay->base);
+        GIF_FREE(replay->last);
+        GIF_FREE(replay->packed);
+        memset(replay, 0, sizeof(GifReplayBuffer));
+        return false;
+    }
+    return true;
+}
+
+// Moves base on by one frame, dropping the oldest record
+void GifReplayDropOldest( GifReplayBuffer* replay )
+{
+    GifReplayRecord record;
+    memcpy(&record, replay->ring + replay->head, sizeof(record));
+    GifXorRleApply(replay->base, replay->ring + replay->head + sizeof(record), record.size, replay->width*replay->height);
+    replay->totalDelay -= replay->baseDelay;
+    replay->baseDelay = record.delay;
+
+    size_t recordSize = sizeof(record) + record.size;
+    replay->head += recordSize;
+    replay->used -= recordSize;
+    if(--replay->numRecords == 0)
+    {
+        replay->head = replay->tail = 0;
+        replay->wrapped = false;
+    }
+    else if(replay->wrapped && replay->head == replay->end)
+    {
+        replay->head = 0;
+        replay->wrapped = false;
+    }
+}
+
+// Finds room for a record of recordSize bytes, dropping the oldest frames as needed
+uint8_t* GifReplayMakeRoom( GifReplayBuffer* replay, size_t recordSize )
+{
+    for(;;)
+    {
+        if(!replay->wrapped && replay->capacity - replay->tail >= recordSize)
+            break;
+        if(!replay->wrapped && replay->numRecords && replay->head >= recordSize)
+        {
+            replay->end = replay->tail;
+            replay->tail = 0;
+            replay->wrapped = true;
+            break;
+        }
+        if(replay->wrapped && replay->head - replay->tail >= recordSize)
+            break;
+        GifReplayDropOldest(replay);
+    }
+
+    replay->newest = replay->tail;
+    replay->tail += recordSize;
+    replay->used += recordSize;
+    ++replay->numRecords;
+    return replay->ring + replay->newest;
+}
+
+// Shows the newest frame for delay longer, as adding it again would, without the frame - for a frame known to
+// be unchanged that was never read back. Does nothing before the first frame.
+void GifReplayRepeatFrame( GifReplayBuffer* replay, uint32_t delay )
+{
+    if(!replay->hasFrames) return;
+
+    replay->totalDelay += delay;
+    if(replay->numRecords == 0)
+    {
+        replay->baseDelay += delay;
+    }
+    else
+    {
+        GifReplayRecord newest;
+        memcpy(&newest, replay->ring + replay->newest, sizeof(newest));
+        newest.delay += delay;
+        memcpy(replay->ring + replay->newest, &newest, sizeof(newest));
+    }
+
+    while(replay->maxDelay && replay->numRecords && replay->totalDelay - replay->baseDelay >= replay->maxDelay)
+        GifReplayDropOldest(replay);
+}
+
+// Adds a frame to the replay window. Costs a pass over the frame and a copy of what changed.
+void GifReplayAddFrame( GifReplayBuffer* replay, const uint8_t* image, uint32_t delay )
+{
+    uint32_t numPixels = replay->width * replay->height;
+    if(!replay->hasFrames)
+    {
+        memcpy(replay->base, image, (size_t)numPixels*4);
+        memcpy(replay->last, image, (size_t)numPixels*4);
+        replay->baseDelay = replay->totalDelay = delay;
+        replay->hasFrames = true;
+        return;
+    }
+
+    size_t size = GifXorRleEncode(replay->last, image, numPixels, replay->packed);
+
+    // a frame identical to the one before just extends how long that one is shown
+    const uint8_t* packed = replay->packed;
+    uint32_t unchanged;
+    if(GifGetRunLength(&packed, packed + size, &unchanged) && unchanged == numPixels)
+    {
+        GifReplayRepeatFrame(replay, delay);
+        return;
+    }
+
+    replay->totalDelay += delay;
+    if(sizeof(GifReplayRecord) + size > replay->capacity)
+    {
+        memcpy(replay->base, replay->last, (size_t)numPixels*4);
+        replay->baseDelay = replay->totalDelay = delay;
+        replay->numRecords = 0;
+        replay->head = replay->tail = replay->used = 0;
+        replay->wrapped = false;
+    }
+    else
+    {
+        GifReplayRecord record = { (uint32_t)size, delay };
+        uint8_t* dest = GifReplayMakeRoom(replay, sizeof(record) + size);
+        memcpy(dest, &record, sizeof(record));
+        memcpy(dest + sizeof(record), replay->packed, size);
+    }
+
+    while(replay->maxDelay && replay->numRecords && replay->totalDelay - replay->baseDelay >= replay->maxDelay)
+        GifReplayDropOldest(replay);
+}
+
+// A copy of the window being encoded on a background thread
+struct GifReplaySaveJob
+{
+    std::thread thread;
+    std::atomic<bool> done;
+    bool ok;
+    char* filename;
+    uint8_t* image;             // the oldest frame, then the records, oldest first
+    size_t size;
+    uint32_t width, height;
+    uint32_t baseDelay;
+    int paletteMaxError;
+};
+
+// Writes a frame whose delay may be more than the 16-bit delay field holds, as repeats of it
+// (which GifWriteFrame folds together as far as it can)
+bool GifWriteLongFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay,
+                        int bitDepth = 8, bool dither = false )
+{
+    bool ok = true;
+    do
+    {
+        uint32_t part = delay < 0xffff? delay : 0xffff;
+        ok = GifWriteFrame(writer, image, width, height, part, bitDepth, dither) && ok;
+        delay -= part;
+    } while(delay);
+    return ok;
+}
 
-    fputc(0x3b, writer->f); // end of file
-    fclose(writer->f);
-    GIF_FREE(writer->oldImage);
+void GifReplayEncode( GifReplaySaveJob* job )
+{
+    GifWriter writer;
+    job->ok = GifBegin(&writer, job->filename, job->width, job->height, job->baseDelay);
+    if(job->ok)
+    {
+        if(job->paletteMaxError >= 0) GifSetPaletteReuse(&writer, job->paletteMaxError);
 
-    writer->f = NULL;
-    writer->oldImage = NULL;
+        size_t imageSize = (size_t)job->width * job->height * 4;
+        uint8_t* image = job->image;
+        GifWriteLongFrame(&writer, image, job->width, job->height, job->baseDelay);
+        for(size_t pos = imageSize; pos < job->size; )
+        {
+            GifReplayRecord record;
+            memcpy(&record, image + pos, sizeof(record));
+            if(!GifXorRleApply(image, image + pos + sizeof(record), record.size, job->width*job->height))
+            {
+                job->ok = false;
+                break;
+            }
+            GifWriteLongFrame(&writer, image, job->width, job->height, record.delay);
+            pos += sizeof(record) + record.size;
+        }
+        job->ok = GifEnd(&writer) && job->ok;
+    }
+    job->done = true;
+}
+
+// Waits for the last save, if any, and frees it
+bool GifReplayFinishSave( GifReplayBuffer* replay )
+{
+    GifReplaySaveJob* job = replay->saving;
+    if(!job) return true;
+
+    job->thread.join();
+    bool ok = job->ok;
+    GIF_FREE(job->image);
+    GIF_FREE(job->filename);
+    delete job;
+    replay->saving = NULL;
+    return ok;
+}
+
+// Writes the frames in the window to a GIF on a background thread; recording carries on meanwhile. The window
+// is copied first (one whole frame plus its records), so that copy is the only memory the save adds on top of
+// the encoder's own. paletteMaxError >= 0 turns on GifSetPaletteReuse for it. Returns false if there are no
+// frames yet or the previous save is still running.
+bool GifReplaySave( GifReplayBuffer* replay, const char* filename, int paletteMaxError = -1 )
+{
+    if(!replay->hasFrames) return false;
+    if(replay->saving)
+    {
+        if(!replay->saving->done) return false;
+        GifReplayFinishSave(replay);
+    }
+
+    size_t imageSize = (size_t)replay->width * replay->height * 4;
+    GifReplaySaveJob* job = new GifReplaySaveJob;
+    job->size = imageSize + replay->used;
+    job->image = (uint8_t*)GifMalloc(job->size);
+    job->filename = (char*)GifMalloc(strlen(filename) + 1);
+    if(!job->image || !job->filename)
+    {
+        GIF_FREE(job->image);
+        GIF_FREE(job->filename);
+        delete job;
+        return false;
+    }
+    memcpy(job->filename, filename, strlen(filename) + 1);
+
+    // lay the records out in order after the oldest frame
+    memcpy(job->image, replay->base, imageSize);
+    uint8_t* dest = job->image + imageSize;
+    if(replay->numRecords && !replay->wrapped)
+    {
+        memcpy(dest, replay->ring + replay->head, replay->tail - replay->head);
+    }
+    else if(replay->numRecords)
+    {
+        memcpy(dest, replay->ring + replay->head, replay->end - replay->head);
+        memcpy(dest + replay->end - replay->head, replay->ring, replay->tail);
+    }
+
+    job->width = replay->width;
+    job->height = replay->height;
+    job->baseDelay = replay->baseDelay;
+    job->paletteMaxError = paletteMaxError;
+    job->ok = false;
+    job->done = false;
+    job->thread = std::thread(GifReplayEncode, job);
+    replay->saving = job;
+    return true;
+}
+
+typedef struct
+{
+    size_t bytesAllocated;      // everything the replay buffer holds, a save in progress included
+    size_t bytesUsed;           // of the ring, by the frames kept
+    uint32_t numFrames;
+    uint32_t delay;             // the length of the window, in hundredths of a second
+    bool saving;
+    uint8_t padding[7];
+} GifReplayStats;
+
+GifReplayStats GifReplayGetStats( const GifReplayBuffer* replay )
+{
+    size_t imageSize = (size_t)replay->width * replay->height * 4;
+    GifReplayStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.bytesAllocated = replay->capacity + imageSize*2 + GifXorRleBound(replay->width*replay->height);
+    stats.bytesUsed = replay->used;
+    stats.numFrames = replay->hasFrames? replay->numRecords + 1 : 0;
+    stats.delay = replay->hasFrames? replay->totalDelay : 0;
+    if(replay->saving)
+    {
+        stats.bytesAllocated += replay->saving->size;
+        stats.saving = !replay->saving->done;
+    }
+    return stats;
+}
+
+// Waits for a save in progress, then frees the replay buffer. Returns false if the last save failed.
+bool GifReplayEnd( GifReplayBuffer* replay )
+{
+    bool ok = GifReplayFinishSave(replay);
+    GIF_FREE(replay->ring);
+    GIF_FREE(replay->base);
+    GIF_FREE(replay->last);
+    GIF_FREE(replay->packed);
+    memset(replay, 0, sizeof(GifReplayBuffer));
+    return ok;
+}
+
+// Raw capture, see GifCaptureBegin: a file of frames stored the same way as in the replay ring, for recording
+// at full frame rate and converting to a GIF later. After a GifCaptureHeader come the frames, each a
+// GifReplayRecord and its changes from the frame before; every keyInterval-th frame is a key frame, stored
+// as its changes from an all-zero frame, so that it decodes on its own. Then comes an index with a
+// GifCaptureIndexEntry per frame, and a GifCaptureFooter. Numbers are stored in the machine's byte order.
+
+typedef struct
+{
+    char magic[8];              // "GIFCAP1"
+    uint32_t width, height;
+    uint32_t keyInterval;
+    uint32_t padding;
+} GifCaptureHeader;
+
+typedef struct
+{
+    uint64_t offset;            // of the frame's GifReplayRecord
+    uint32_t size;              // of its changes
+    uint32_t delay;
+} GifCaptureIndexEntry;
+
+typedef struct
+{
+    uint64_t indexOffset;
+    uint32_t numFrames;
+    char magic[4];              // "GCIX"
+} GifCaptureFooter;
+
+typedef struct
+{
+    FILE* f;
+    uint32_t width, height;
+    uint32_t keyInterval;
+    uint32_t numFrames;         // frames written, not counting the held one
+    uint64_t offset;            // bytes written
+    uint8_t* last;              // the newest frame, whole
+    uint8_t* packed[2];         // the held frame's changes, and room for the next frame's
+    size_t heldSize;
+    uint32_t heldDelay;
+    bool hasHeldFrame;
+    bool failed;
+    uint8_t padding[2];
+    GifBuffer index;            // a GifCaptureIndexEntry per frame written
+} GifCaptureWriter;
+
+// 64-bit file offsets, so that captures can grow past 2 GB
+bool GifSeekFile( FILE* f, uint64_t offset )
+{
+#if defined(_WIN32)
+    return _fseeki64(f, (__int64)offset, SEEK_SET) == 0;
+#else
+    return fseeko(f, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+uint64_t GifFileSize( FILE* f )
+{
+#if defined(_WIN32)
+    if(_fseeki64(f, 0, SEEK_END) != 0) return 0;
+    __int64 size = _ftelli64(f);
+#else
+    if(fseeko(f, 0, SEEK_END) != 0) return 0;
+    off_t size = ftello(f);
+#endif
+    return size > 0? (uint64_t)size : 0;
+}
+
+bool GifCaptureWrite( GifCaptureWriter* capture, const void* data, size_t size )
+{
+    if(fwrite(data, 1, size, capture->f) != size) capture->failed = true;
+    capture->offset += size;
+    return !capture->failed;
+}
+
+// Starts a raw capture file. Frames cost a pass over the image and a write of what changed, which is fast
+// enough to keep up with rendering; GifTranscodeCapture turns the file into a GIF afterwards. A key frame
+// every keyInterval frames bounds how many frames GifCaptureReadFrame decodes to get to any one of them.
+bool GifCaptureBegin( GifCaptureWriter* capture, const char* filename, uint32_t width, uint32_t height, uint32_t keyInterval = 60 )
+{
+    memset(capture, 0, sizeof(GifCaptureWriter));
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+    if(fopen_s(&capture->f, filename, "wb") != 0) capture->f = NULL;
+#else
+    capture->f = fopen(filename, "wb");
+#endif
+    if(!capture->f) return false;
+    setvbuf(capture->f, NULL, _IOFBF, 1 << 20);
+
+    size_t imageSize = (size_t)width * height * 4;
+    capture->width = width;
+    capture->height = height;
+    capture->keyInterval = keyInterval? keyInterval : 1;
+    capture->last = (uint8_t*)GifMalloc(imageSize);
+    capture->packed[0] = (uint8_t*)GifMalloc(GifXorRleBound(width*height));
+    capture->packed[1] = (uint8_t*)GifMalloc(GifXorRleBound(width*height));
+
+    GifCaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "GIFCAP1", 8);
+    header.width = width;
+    header.height = height;
+    header.keyInterval = capture->keyInterval;
+    return GifCaptureWrite(capture, &header, sizeof(header));
+}
+
+// Writes out the held frame, now that its delay is known
+void GifCaptureReleaseHeldFrame( GifCaptureWriter* capture )
+{
+    if(!capture->hasHeldFrame) return;
+    capture->hasHeldFrame = false;
+
+    GifCaptureIndexEntry entry = { capture->offset, (uint32_t)capture->heldSize, capture->heldDelay };
+    GifReplayRecord record = { (uint32_t)capture->heldSize, capture->heldDelay };
+    GifCaptureWrite(capture, &record, sizeof(record));
+    GifCaptureWrite(capture, capture->packed[0], capture->heldSize);
+    GifBufferWrite(&capture->index, &entry, sizeof(entry));
+    ++capture->numFrames;
+}
+
+// Adds a frame to the capture. A frame identical to the one before just extends how long that one is shown.
+bool GifCaptureFrame( GifCaptureWriter* capture, const uint8_t* image, uint32_t delay )
+{
+    uint32_t numPixels = capture->width * capture->height;
+    uint32_t frame = capture->numFrames + (capture->hasHeldFrame? 1 : 0);
+    bool keyFrame = frame % capture->keyInterval == 0;
+    if(keyFrame) memset(capture->last, 0, (size_t)numPixels*4);
+
+    size_t size = GifXorRleEncode(capture->last, image, numPixels, capture->packed[1]);
+    const uint8_t* packed = capture->packed[1];
+    uint32_t unchanged;
+    if(!keyFrame && GifGetRunLength(&packed, packed + size, &unchanged) && unchanged == numPixels)
+    {
+        capture->heldDelay += delay;
+        return !capture->failed;
+    }
+
+    GifCaptureReleaseHeldFrame(capture);
+    std::swap(capture->packed[0], capture->packed[1]);
+    capture->heldSize = size;
+    capture->heldDelay = delay;
+    capture->hasHeldFrame = true;
+    return !capture->failed;
+}
+
+// Shows the newest frame for delay longer, as adding it again would, without the frame - for a frame known to
+// be unchanged that was never read back. Returns false before the first frame.
+bool GifCaptureRepeatFrame( GifCaptureWriter* capture, uint32_t delay )
+{
+    if(!capture->hasHeldFrame) return false;
+
+    capture->heldDelay += delay;
+    return !capture->failed;
+}
+
+// Writes the index and closes the capture file. Returns false if anything failed to write.
+bool GifCaptureEnd( GifCaptureWriter* capture )
+{
+    if(!capture->f) return false;
+
+    GifCaptureReleaseHeldFrame(capture);
+
+    GifCaptureFooter footer;
+    footer.indexOffset = capture->offset;
+    footer.numFrames = capture->numFrames;
+    memcpy(footer.magic, "GCIX", 4);
+    if(capture->index.size) GifCaptureWrite(capture, capture->index.data, capture->index.size);
+    GifCaptureWrite(capture, &footer, sizeof(footer));
+
+    bool ok = !capture->failed;
+    if(fclose(capture->f) != 0) ok = false;
+    GIF_FREE(capture->last);
+    GIF_FREE(capture->packed[0]);
+    GIF_FREE(capture->packed[1]);
+    GifBufferFree(&capture->index);
+    memset(capture, 0, sizeof(GifCaptureWriter));
+    return ok;
+}
+
+typedef struct
+{
+    FILE* f;
+    uint32_t width, height;
+    uint32_t keyInterval;
+    uint32_t numFrames;
+    GifCaptureIndexEntry* index;
+    uint8_t* image;             // the frame read last, whole
+    GifBuffer packed;           // room for a frame's record and changes
+    uint64_t nextOffset;        // where the file is positioned, if not 0
+    uint32_t current;           // the frame in image, numFrames if none
+    uint32_t padding;
+} GifCaptureReader;
+
+// Rebuilds the index of a capture that was never ended, e.g. because the program crashed,
+// from the frames that made it to the file whole
+bool GifCaptureScan( GifCaptureReader* reader )
+{
+    GifBuffer index;
+    memset(&index, 0, sizeof(index));
+
+    uint64_t fileSize = GifFileSize(reader->f);
+    uint64_t offset = sizeof(GifCaptureHeader);
+    GifReplayRecord record;
+    while(offset + sizeof(record) <= fileSize && GifSeekFile(reader->f, offset) &&
+          fread(&record, sizeof(record), 1, reader->f) == 1 &&
+          offset + sizeof(record) + record.size <= fileSize)
+    {
+        GifCaptureIndexEntry entry = { offset, record.size, record.delay };
+        GifBufferWrite(&index, &entry, sizeof(entry));
+        offset += sizeof(record) + record.size;
+    }
+
+    reader->index = (GifCaptureIndexEntry*)index.data;
+    reader->numFrames = (uint32_t)(index.size / sizeof(GifCaptureIndexEntry));
+    return true;
+}
+
+// Opens a capture file for reading its frames in any order
+bool GifCaptureOpen( GifCaptureReader* reader, const char* filename )
+{
+    memset(reader, 0, sizeof(GifCaptureReader));
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+    if(fopen_s(&reader->f, filename, "rb") != 0) reader->f = NULL;
+#else
+    reader->f = fopen(filename, "rb");
+#endif
+    if(!reader->f) return false;
+
+    GifCaptureHeader header;
+    if(fread(&header, sizeof(header), 1, reader->f) != 1 || memcmp(header.magic, "GIFCAP1", 8) != 0 ||
+       header.width == 0 || header.height == 0 || header.keyInterval == 0)
+    {
+        fclose(reader->f);
+        reader->f = NULL;
+        return false;
+    }
+    reader->width = header.width;
+    reader->height = header.height;
+    reader->keyInterval = header.keyInterval;
+
+    // read the index from the end of the file, if it got there
+    uint64_t fileSize = GifFileSize(reader->f);
+    GifCaptureFooter footer;
+    bool hasIndex = fileSize >= sizeof(header) + sizeof(footer) &&
+                    GifSeekFile(reader->f, fileSize - sizeof(footer)) &&
+                    fread(&footer, sizeof(footer), 1, reader->f) == 1 &&
+                    memcmp(footer.magic, "GCIX", 4) == 0 &&
+                    footer.indexOffset + (uint64_t)footer.numFrames*sizeof(GifCaptureIndexEntry) + sizeof(footer) == fileSize;
+    if(hasIndex)
+    {
+        size_t indexSize = (size_t)footer.numFrames * sizeof(GifCaptureIndexEntry);
+        reader->numFrames = footer.numFrames;
+        reader->index = (GifCaptureIndexEntry*)GifMalloc(indexSize? indexSize : 1);
+        hasIndex = GifSeekFile(reader->f, footer.indexOffset) && fread(reader->index, 1, indexSize, reader->f) == indexSize;
+        if(!hasIndex) GIF_FREE(reader->index);
+    }
+    if(!hasIndex) GifCaptureScan(reader);
+
+    reader->image = (uint8_t*)GifMalloc((size_t)reader->width * reader->height * 4);
+    reader->current = reader->numFrames;
+    reader->nextOffset = 0;
+    return true;
+}
 
+// Decodes frame number frame, starting from the key frame before it, or from the frame read last if that is
+// on the way. Returns the frame, valid until the next call, and its delay; NULL if it can't be read.
+const uint8_t* GifCaptureReadFrame( GifCaptureReader* reader, uint32_t frame, uint32_t* delay = NULL )
+{
+    if(frame >= reader->numFrames) return NULL;
+
+    uint32_t numPixels = reader->width * reader->height;
+    uint32_t next = frame - frame % reader->keyInterval;
+    if(reader->current < reader->numFrames && reader->current >= next && reader->current <= frame)
+        next = reader->current + 1;
+
+    for(; next <= frame; ++next)
+    {
+        // frames read in order follow on from each other in the file
+        const GifCaptureIndexEntry* entry = reader->index + next;
+        size_t size = sizeof(GifReplayRecord) + entry->size;
+        reader->packed.size = 0;
+        GifBufferReserve(&reader->packed, size);
+        if((reader->nextOffset != entry->offset && !GifSeekFile(reader->f, entry->offset)) ||
+           fread(reader->packed.data, 1, size, reader->f) != size)
+        {
+            reader->current = reader->numFrames;
+            reader->nextOffset = 0;
+            return NULL;
+        }
+        reader->nextOffset = entry->offset + size;
+
+        // a damaged frame leaves the image half updated, so the next read starts over from a key frame
+        if(next % reader->keyInterval == 0) memset(reader->image, 0, (size_t)numPixels*4);
+        if(!GifXorRleApply(reader->image, reader->packed.data + sizeof(GifReplayRecord), entry->size, numPixels))
+        {
+            reader->current = reader->numFrames;
+            return NULL;
+        }
+        reader->current = next;
+    }
+
+    if(delay) *delay = reader->index[frame].delay;
+    return reader->image;
+}
+
+void GifCaptureClose( GifCaptureReader* reader )
+{
+    if(reader->f) fclose(reader->f);
+    GIF_FREE(reader->index);
+    GIF_FREE(reader->image);
+    GifBufferFree(&reader->packed);
+    memset(reader, 0, sizeof(GifCaptureReader));
+}
+
+// Converts a capture file to a GIF, encoding its frames on numThreads worker threads (see GifSetAsync).
+// paletteMaxError >= 0 turns on GifSetPaletteReuse.
+bool GifTranscodeCapture( const char* captureFile, const char* gifFile, uint32_t numThreads,
+                          int paletteMaxError = -1, int bitDepth = 8, bool dither = false )
+{
+    GifCaptureReader reader;
+    if(!GifCaptureOpen(&reader, captureFile)) return false;
+
+    // the first frame's delay, as GifReplaySave passes, and never 0 so the GIF always gets the looping
+    // NETSCAPE2.0 block the recorded outputs have
+    uint32_t baseDelay = reader.numFrames && reader.index[0].delay ? reader.index[0].delay : 1;
+
+    GifWriter writer;
+    bool ok = GifBegin(&writer, gifFile, reader.width, reader.height, baseDelay, bitDepth, dither);
+    if(ok)
+    {
+        if(numThreads > 1) GifSetAsync(&writer, numThreads);
+        if(paletteMaxError >= 0) GifSetPaletteReuse(&writer, paletteMaxError);
+
+        for(uint32_t ii=0; ii<reader.numFrames && ok; ++ii)
+        {
+            uint32_t delay = 0;
+            const uint8_t* image = GifCaptureReadFrame(&reader, ii, &delay);
+            ok = image && GifWriteLongFrame(&writer, image, reader.width, reader.height, delay, bitDepth, dither);
+        }
+        ok = GifEnd(&writer) && ok;
+    }
+
+    GifCaptureClose(&reader);
+    return ok;
+}
+
+// Video pipe, see GifPipeBegin: frames streamed uncompressed to an external video encoder
+const int kGifPipeY4m = 0;   // YUV4MPEG2, 4:2:0
+const int kGifPipeRgba = 1;  // raw RGBA, 4 bytes a pixel
+
+// Row y of an image counted from the top, which is the bottom row of the buffer when GIF_FLIP_VERT is set
+const uint8_t* GifImageRow( const uint8_t* image, uint32_t width, uint32_t height, uint32_t y )
+{
+    return image + (size_t)GifBufferRow(height, y)*width*4;
+}
+
+// BT.601 studio range, in 8-bit fixed point. The chroma of each 2x2 block is taken from the sum of its four
+// pixels (sumR etc.), with pixels past the right or bottom edge repeating the last ones.
+uint8_t GifRgbToY( int r, int g, int b )
+{
+    return (uint8_t)(((66*r + 129*g + 25*b + 128) >> 8) + 16);
+}
+
+uint8_t GifSumToU( int sumR, int sumG, int sumB )
+{
+    return (uint8_t)(((-38*sumR - 74*sumG + 112*sumB + 512) >> 10) + 128);
+}
+
+uint8_t GifSumToV( int sumR, int sumG, int sumB )
+{
+    return (uint8_t)(((112*sumR - 94*sumG - 18*sumB + 512) >> 10) + 128);
+}
+
+#if defined(GIF_SSE2)
+// Sums the two halves of each 64-bit lane of a _mm_madd_epi16 result and moves the sums to the low 64 bits
+__m128i GifPairSums( __m128i products )
+{
+    __m128i sums = _mm_add_epi32(products, _mm_srli_epi64(products, 32));
+    return _mm_shuffle_epi32(sums, _MM_SHUFFLE(3,1,2,0));
+}
+
+// Luma of four RGBA pixels, as 32-bit lanes
+__m128i GifRgbaToY4( __m128i pixels )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i coefs = _mm_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0);
+    __m128i lo = GifPairSums(_mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coefs));
+    __m128i hi = GifPairSums(_mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coefs));
+    __m128i y = _mm_unpacklo_epi64(lo, hi);
+    y = _mm_srai_epi32(_mm_add_epi32(y, _mm_set1_epi32(128)), 8);
+    return _mm_add_epi32(y, _mm_set1_epi32(16));
+}
+
+// Sums of the 2x2 blocks of four pixels from each of two rows: two blocks, as 16-bit R,G,B,A lanes
+__m128i GifBlockSums( __m128i top, __m128i bottom )
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    return _mm_unpacklo_epi64(lo, hi);
+}
+
+// U or V of four 2x2 blocks, from two GifBlockSums, as 32-bit lanes
+__m128i GifBlockSumsToChroma( __m128i sums01, __m128i sums23, __m128i coefs )
+{
+    __m128i c01 = GifPairSums(_mm_madd_epi16(sums01, coefs));
+    __m128i c23 = GifPairSums(_mm_madd_epi16(sums23, coefs));
+    __m128i c = _mm_unpacklo_epi64(c01, c23);
+    c = _mm_srai_epi32(_mm_add_epi32(c, _mm_set1_epi32(512)), 10);
+    return _mm_add_epi32(c, _mm_set1_epi32(128));
+}
+
+void GifStore4( uint8_t* dest, __m128i values )
+{
+    __m128i bytes = _mm_packs_epi32(values, values);
+    bytes = _mm_packus_epi16(bytes, bytes);
+    int32_t packed = _mm_cvtsi128_si32(bytes);
+    memcpy(dest, &packed, 4);
+}
+#endif
+
+// Converts an RGBA image to planar 4:2:0 YUV: a width x height Y plane, then U and V planes
+// of (width+1)/2 x (height+1)/2. Eight pixels at a time with SSE2.
+void GifRgbaToI420( const uint8_t* image, uint32_t width, uint32_t height, uint8_t* yPlane, uint8_t* uPlane, uint8_t* vPlane )
+{
+    uint32_t chromaWidth = (width+1)/2;
+    for(uint32_t yy=0; yy<height; yy+=2)
+    {
+        const uint8_t* top = GifImageRow(image, width, height, yy);
+        const uint8_t* bottom = GifImageRow(image, width, height, yy+1 < height? yy+1 : yy);
+        uint8_t* yTop = yPlane + (size_t)yy*width;
+        uint8_t* yBottom = yy+1 < height? yTop + width : NULL;
+        uint8_t* uRow = uPlane + (size_t)(yy/2)*chromaWidth;
+        uint8_t* vRow = vPlane + (size_t)(yy/2)*chromaWidth;
+
+        uint32_t xx = 0;
+#if defined(GIF_SSE2)
+        const __m128i uCoefs = _mm_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0);
+        const __m128i vCoefs = _mm_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0);
+        for(; xx+8 <= width; xx+=8)
+        {
+            __m128i top0 = _mm_loadu_si128((const __m128i*)(top + xx*4));
+            __m128i top1 = _mm_loadu_si128((const __m128i*)(top + xx*4 + 16));
+            __m128i bottom0 = _mm_loadu_si128((const __m128i*)(bottom + xx*4));
+            __m128i bottom1 = _mm_loadu_si128((const __m128i*)(bottom + xx*4 + 16));
+
+            __m128i y = _mm_packs_epi32(GifRgbaToY4(top0), GifRgbaToY4(top1));
+            _mm_storel_epi64((__m128i*)(yTop + xx), _mm_packus_epi16(y, y));
+            if(yBottom)
+            {
+                y = _mm_packs_epi32(GifRgbaToY4(bottom0), GifRgbaToY4(bottom1));
+                _mm_storel_epi64((__m128i*)(yBottom + xx), _mm_packus_epi16(y, y));
+            }
+
+            __m128i sums01 = GifBlockSums(top0, bottom0);
+            __m128i sums23 = GifBlockSums(top1, bottom1);
+            GifStore4(uRow + xx/2, GifBlockSumsToChroma(sums01, sums23, uCoefs));
+            GifStore4(vRow + xx/2, GifBlockSumsToChroma(sums01, sums23, vCoefs));
+        }
+#endif
+        for(; xx<width; xx+=2)
+        {
+            uint32_t right = xx+1 < width? xx+1 : xx;
+            const uint8_t* block[4] = { top + xx*4, top + right*4, bottom + xx*4, bottom + right*4 };
+
+            yTop[xx] = GifRgbToY(block[0][0], block[0][1], block[0][2]);
+            if(xx+1 < width) yTop[xx+1] = GifRgbToY(block[1][0], block[1][1], block[1][2]);
+            if(yBottom)
+            {
+                yBottom[xx] = GifRgbToY(block[2][0], block[2][1], block[2][2]);
+                if(xx+1 < width) yBottom[xx+1] = GifRgbToY(block[3][0], block[3][1], block[3][2]);
+            }
+
+            int sumR = block[0][0] + block[1][0] + block[2][0] + block[3][0];
+            int sumG = block[0][1] + block[1][1] + block[2][1] + block[3][1];
+            int sumB = block[0][2] + block[1][2] + block[2][2] + block[3][2];
+            uRow[xx/2] = GifSumToU(sumR, sumG, sumB);
+            vRow[xx/2] = GifSumToV(sumR, sumG, sumB);
+        }
+    }
+}
+
+// Streams frames to an external encoder through stdout or a named pipe. Frames are converted on the calling
+// thread into one of a few slots and written by a background thread, so a consumer that can't keep up makes
+// frames get dropped (and counted) instead of holding up rendering.
+struct GifPipeWriter
+{
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;      // signalled when a frame is queued or the thread is stopping
+    std::vector<uint8_t*> queue;       // converted frames waiting to be written, in order
+    std::vector<uint8_t*> spare;       // slots free for the next frame
+    uint8_t* slots;
+    uint8_t* lastFrame;                // slot holding the frame queued last, for GifPipeRepeatFrame
+    FILE* f;
+    bool ownsFile;
+    bool stopping;
+    int format;
+    uint32_t width, height;
+    size_t frameSize;                  // bytes written per frame
+    uint32_t numSlots;
+    std::atomic<uint64_t> framesWritten;
+    std::atomic<uint64_t> framesDropped;
+    std::atomic<bool> failed;
+};
+
+void GifPipeThread( GifPipeWriter* pipe )
+{
+    std::unique_lock<std::mutex> guard(pipe->lock);
+    for(;;)
+    {
+        pipe->wake.wait(guard, [pipe]{ return pipe->stopping || !pipe->queue.empty(); });
+        if(pipe->queue.empty()) break;
+
+        uint8_t* frame = pipe->queue.front();
+        pipe->queue.erase(pipe->queue.begin());
+        guard.unlock();
+
+        // once the consumer has gone, frames are still taken off the queue but go nowhere
+        if(!pipe->failed)
+        {
+            if(fwrite(frame, 1, pipe->frameSize, pipe->f) == pipe->frameSize && fflush(pipe->f) == 0)
+                ++pipe->framesWritten;
+            else
+                pipe->failed = true;
+        }
+
+        guard.lock();
+        pipe->spare.push_back(frame);
+    }
+}
+
+// Starts streaming width x height frames to filename, or to stdout if filename is "-". format is kGifPipeY4m
+// (YUV4MPEG2 at fpsNum/fpsDen frames a second, e.g. for "ffmpeg -i -") or kGifPipeRgba (raw frames, e.g. for
+// "ffmpeg -f rawvideo -pix_fmt rgba -s WxH -i -"). Up to numSlots frames wait to be written before new ones
+// are dropped. On POSIX systems, writing to a pipe whose reader has gone raises SIGPIPE, which the program
+// should ignore if it wants to carry on.
+bool GifPipeBegin( GifPipeWriter* pipe, const char* filename, uint32_t width, uint32_t height, int format,
+                   uint32_t fpsNum = 60, uint32_t fpsDen = 1, uint32_t numSlots = 3 )
+{
+    pipe->ownsFile = strcmp(filename, "-") != 0;
+    if(pipe->ownsFile)
+    {
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+        if(fopen_s(&pipe->f, filename, "wb") != 0) pipe->f = NULL;
+#else
+        pipe->f = fopen(filename, "wb");
+#endif
+    }
+    else
+    {
+        pipe->f = stdout;
+#if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+    if(!pipe->f)
+    {
+        // no writer thread and no slots: frames are dropped and GifPipeEnd has nothing to stop
+        pipe->slots = NULL;
+        pipe->lastFrame = NULL;
+        pipe->queue.clear();
+        pipe->spare.clear();
+        pipe->framesWritten = 0;
+        pipe->framesDropped = 0;
+        pipe->failed = true;
+        return false;
+    }
+
+    pipe->format = format;
+    pipe->width = width;
+    pipe->height = height;
+    pipe->frameSize = format == kGifPipeY4m?
+        6 + (size_t)width*height + 2*(size_t)((width+1)/2)*((height+1)/2) :
+        (size_t)width*height*4;
+    pipe->numSlots = numSlots? numSlots : 1;
+    pipe->slots = (uint8_t*)GifMalloc(pipe->frameSize * pipe->numSlots);
+    pipe->queue.reserve(pipe->numSlots);
+    pipe->spare.reserve(pipe->numSlots);
+    for(uint32_t ii=0; ii<pipe->numSlots; ++ii)
+        pipe->spare.push_back(pipe->slots + pipe->frameSize*ii);
+    pipe->lastFrame = NULL;
+    pipe->stopping = false;
+    pipe->framesWritten = 0;
+    pipe->framesDropped = 0;
+    pipe->failed = false;
+
+    if(format == kGifPipeY4m)
+    {
+        fprintf(pipe->f, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+                width, height, fpsNum, fpsDen? fpsDen : 1);
+        if(fflush(pipe->f) != 0) pipe->failed = true;
+    }
+
+    pipe->thread = std::thread(GifPipeThread, pipe);
+    return true;
+}
+
+// Hands a frame to the pipe. Returns false if it was dropped because the consumer is behind, or has gone.
+bool GifPipeFrame( GifPipeWriter* pipe, const uint8_t* image )
+{
+    std::unique_lock<std::mutex> guard(pipe->lock);
+    if(pipe->spare.empty() || pipe->failed)
+    {
+        ++pipe->framesDropped;
+        return false;
+    }
+    uint8_t* frame = pipe->spare.back();
+    pipe->spare.pop_back();
+    guard.unlock();
+
+    uint32_t width = pipe->width, height = pipe->height;
+    if(pipe->format == kGifPipeY4m)
+    {
+        uint8_t* yPlane = frame + 6;
+        uint8_t* uPlane = yPlane + (size_t)width*height;
+        uint8_t* vPlane = uPlane + (size_t)((width+1)/2)*((height+1)/2);
+        memcpy(frame, "FRAME\n", 6);
+        GifRgbaToI420(image, width, height, yPlane, uPlane, vPlane);
+    }
+    else
+    {
+        for(uint32_t yy=0; yy<height; ++yy)
+            memcpy(frame + (size_t)yy*width*4, GifImageRow(image, width, height, yy), (size_t)width*4);
+    }
+
+    guard.lock();
+    pipe->queue.push_back(frame);
+    pipe->lastFrame = frame;
+    pipe->wake.notify_one();
+    return true;
+}
+
+// Hands the pipe another copy of the frame before, without converting anything - for a frame known to be
+// unchanged that was never read back. Returns false if it was dropped, or there is no frame before.
+// Only the calling thread writes to slots, so the last frame's slot still holds it, and the copy is
+// taken while the writer thread at most reads it.
+bool GifPipeRepeatFrame( GifPipeWriter* pipe )
+{
+    std::unique_lock<std::mutex> guard(pipe->lock);
+    if(!pipe->lastFrame) return false;
+    if(pipe->spare.empty() || pipe->failed)
+    {
+        ++pipe->framesDropped;
+        return false;
+    }
+    uint8_t* frame = pipe->spare.back();
+    pipe->spare.pop_back();
+    guard.unlock();
+
+    if(frame != pipe->lastFrame)
+        memcpy(frame, pipe->lastFrame, pipe->frameSize);
+
+    guard.lock();
+    pipe->queue.push_back(frame);
+    pipe->lastFrame = frame;
+    pipe->wake.notify_one();
     return true;
 }
 
+// Waits for the queued frames to be written, then closes the pipe. Returns false if any write failed.
+bool GifPipeEnd( GifPipeWriter* pipe )
+{
+    {
+        std::lock_guard<std::mutex> guard(pipe->lock);
+        pipe->stopping = true;
+    }
+    pipe->wake.notify_all();
+    if(pipe->thread.joinable()) pipe->thread.join(); // not started if GifPipeBegin failed
+
+    bool ok = !pipe->failed;
+    if(pipe->f && pipe->ownsFile && fclose(pipe->f) != 0) ok = false;
+    GIF_FREE(pipe->slots);
+    pipe->slots = NULL;
+    pipe->lastFrame = NULL;
+    pipe->f = NULL;
+    pipe->queue.clear();
+    pipe->spare.clear();
+    return ok;
+}
+
 #endif
@@ -0,0 +1,128 @@
+#include "PaletteQuantizer.h"
+#include <iostream>
+
+// Cells of the color cube along each axis, as in gif.h's GifPaletteLut
+static const int lutCells = 32;
+
+// A triangle covering the viewport, with no vertex data
+static const char* quantizeVertexSource = R"(#version 330 core
+void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+// Integer texel lookups all the way, so the index is exactly the CPU table's
+static const char* quantizeFragmentSource = R"(#version 330 core
+uniform sampler2D frame;
+uniform usampler3D lut;
+out uint index;
+
+void main()
+{
+    ivec3 color = ivec3(texelFetch(frame, ivec2(gl_FragCoord.xy), 0).rgb * 255.0 + 0.5);
+    index = texelFetch(lut, color.zyx >> 3, 0).r;
+}
+)";
+
+// Function to compile one stage of the quantize program, printing the log if it fails
+static GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+
+    GLint success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        char infoLog[512];
+        glGetShaderInfoLog(shader, 512, NULL, infoLog);
+        std::cout << "Failed to compile the palette quantizer shader\n" << infoLog << std::endl;
+    }
+    return shader;
+}
+
+PaletteQuantizer::PaletteQuantizer(int width, int height, const uint8_t* lutIndices)
+    : width(width),
+    height(height)
+{
+    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, quantizeVertexSource);
+    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, quantizeFragmentSource);
+    program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    glLinkProgram(program);
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "frame"), 0);
+    glUniform1i(glGetUniformLocation(program, "lut"), 1);
+    glUseProgram(0);
+
+    // core profile draws need a vertex array bound, even with no attributes
+    glGenVertexArrays(1, &vertexArray);
+
+    // The table as a 3D texture; integer textures can only be fetched, never filtered
+    glGenTextures(1, &lutTexture);
+    glBindTexture(GL_TEXTURE_3D, lutTexture);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_R8UI, lutCells, lutCells, lutCells, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_3D, 0);
+    setPalette(lutIndices);
+
+    // The target the indices are written to and read back from
+    glGenRenderbuffers(1, &indexBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, indexBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_R8UI, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, indexBuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Method to upload a new table of palette indices
+void PaletteQuantizer::setPalette(const uint8_t* lutIndices) {
+    // the table is indexed red-major (r << 10 | g << 5 | b), so blue runs along the texture's x axis
+    glBindTexture(GL_TEXTURE_3D, lutTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, lutCells, lutCells, lutCells, GL_RED_INTEGER, GL_UNSIGNED_BYTE, lutIndices);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_3D, 0);
+}
+
+// Method to palettize a frame into the index target
+void PaletteQuantizer::quantize(GLuint frameTexture) {
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, width, height);
+
+    glUseProgram(program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, frameTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, lutTexture);
+
+    glBindVertexArray(vertexArray);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+
+    glBindTexture(GL_TEXTURE_3D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+}
+
+// Method to free the GPU objects
+void PaletteQuantizer::deleteBuffers() {
+    glDeleteProgram(program);
+    glDeleteVertexArrays(1, &vertexArray);
+    glDeleteTextures(1, &lutTexture);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &indexBuffer);
+    program = vertexArray = lutTexture = framebuffer = indexBuffer = 0;
+}
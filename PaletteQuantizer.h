@@ -0,0 +1,36 @@
+//Import libraries
+#ifndef PALETTE_QUANTIZER_H
+#define PALETTE_QUANTIZER_H
+#include <cstdint>
+#include <glad/glad.h>
+
+// Palettizes captured frames on the GPU, so only one byte per pixel has to be read back and the
+// encoder has no colors to look up. The palette comes as a 32x32x32 table of palette indices, one per
+// cell of the color cube (from GifGetPaletteLutIndices), uploaded as a 3D texture; each pixel's index
+// is the table entry for the top 5 bits of its color - exactly the index GifLutThresholdImage picks.
+class PaletteQuantizer {
+public:
+    // Constructor - needs a current OpenGL context
+    PaletteQuantizer(int width, int height, const uint8_t* lutIndices);
+
+    // Replaces the palette, e.g. when a new one is set for the next recording
+    void setPalette(const uint8_t* lutIndices);
+
+    // Writes the palette index of every pixel of frameTexture into an 8-bit integer target and leaves
+    // it bound as the read framebuffer, ready for a FrameCapture reading GL_RED_INTEGER
+    void quantize(GLuint frameTexture);
+
+    // Deletes the GPU objects - call while the context is still current
+    void deleteBuffers();
+
+private:
+    GLuint program;
+    GLuint vertexArray;
+    GLuint lutTexture;
+    GLuint framebuffer;
+    GLuint indexBuffer;
+    int width;
+    int height;
+};
+
+#endif
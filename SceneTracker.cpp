@@ -0,0 +1,23 @@
+#include "SceneTracker.h"
+
+SceneTracker::SceneTracker()
+    : view(1.0f),
+    projection(1.0f),
+    changed(true)
+{
+}
+
+// Method to compare the camera and projection with the ones the last frame was drawn with
+void SceneTracker::setCamera(const glm::mat4& newView, const glm::mat4& newProjection) {
+    if (newView != view || newProjection != projection)
+        changed = true;
+    view = newView;
+    projection = newProjection;
+}
+
+// Method to check for a change and start over for the next frame
+bool SceneTracker::takeChanged() {
+    bool wasChanged = changed;
+    changed = false;
+    return wasChanged;
+}
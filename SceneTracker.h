@@ -0,0 +1,29 @@
+//Import libraries
+#ifndef SCENE_TRACKER_H
+#define SCENE_TRACKER_H
+#include <glm/glm.hpp>
+
+// Keeps track of whether anything that changes the picture has happened since the last frame was
+// captured, so an unchanged frame needn't be read back or encoded. The characters report their
+// moves and swings (see Character::setTracker), and the camera and projection are compared each frame.
+class SceneTracker {
+public:
+    // Constructor - the first frame always counts as changed
+    SceneTracker();
+
+    // Marks the scene as changed
+    void markChanged() { changed = true; }
+
+    // Records the camera and projection the next frame is drawn with; a difference marks the scene
+    void setCamera(const glm::mat4& view, const glm::mat4& projection);
+
+    // Whether the next frame can differ from the last one captured; clears the mark
+    bool takeChanged();
+
+private:
+    glm::mat4 view;
+    glm::mat4 projection;
+    bool changed;
+};
+
+#endif
@@ -6,12 +6,19 @@
 * Date: 11/02/2024
 * Version number: g++ 13.2.0, gcc 11.4.0
 * Requirements: This program requires GLAD, GLFW, GLM, gif
-* Note: The user can move with w,s,a,d, and rotate with right and left arrow keys
+* Note: The user can move with w,s,a,d, and rotate with right and left arrow keys;
+*       F9 saves the last 10 seconds as a GIF
 * Version requirement: This program requires GLFW 3.3 or above
 */
 
 // Import the libraries that will be used in this program
 #include "Character.h"
+#include "FrameCapture.h"
+#include "CaptureTarget.h"
+#include "PaletteQuantizer.h"
+#include "SceneTracker.h"
+// OpenGL reads frames back bottom row first; the encoder flips them as it goes
+#define GIF_FLIP_VERT
 #include "gif.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -20,6 +27,8 @@
 #include <cmath>
 #include <numbers>
 #include <vector>
+#include <thread>
+#include <csignal>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -34,6 +43,32 @@ float characterRotationSpeed = 0.05f;
 // Global character instance
 Character character;
 Character scaledCharacter;
+// Tells whether a frame can differ from the last one captured; unchanged frames aren't read back or encoded
+SceneTracker sceneTracker;
+// Capture modes: record the whole session to rolling GIF segments, keep only the last few seconds
+// in memory and save them with F9 (run with --replay), record it to a raw capture file
+// that is turned into a GIF afterwards (run with --transcode capture.gcap output.gif),
+// or stream it as YUV4MPEG2 on stdout to a video encoder (e.g. Project2 | ffmpeg -i - out.mp4)
+enum CaptureMode { CAPTURE_INSTANT_REPLAY, CAPTURE_GIF_SEGMENTS, CAPTURE_RAW, CAPTURE_VIDEO_PIPE };
+CaptureMode captureMode = CAPTURE_GIF_SEGMENTS;
+// Length of the instant replay and the most memory its frame changes may take
+const uint32_t replaySeconds = 10;
+const size_t replayMaxBytes = 256u << 20;
+GifReplayBuffer replay;
+// Pixel buffers frames are read back through. 1 reads each frame back synchronously, which measured fastest
+// here (integrated/software OpenGL copies synchronously regardless). On a discrete GPU use 2 or 3: each frame
+// is then encoded captureBuffers-1 frames after it was drawn, so the readback doesn't stall rendering
+const int captureBuffers = 1;
+// Size of the recording, which the scene is drawn at offscreen whatever the window's size (e.g. 854 x 480
+// to record at 480p while displaying at 4K). A captureScale of 2, 3, 4, ... draws it that many times larger
+// and filters it down, for smoother edges at the cost of drawing more pixels
+const int captureWidth = 950;
+const int captureHeight = 950;
+const int captureScale = 1;
+// Palettize recorded frames on the GPU (GIF segments only): every frame then uses one fixed palette of
+// evenly spaced colors, a byte per pixel is read back instead of four, and the encoder looks up no colors.
+// Pays off on a real GPU; with software OpenGL the pass costs more than it saves
+const bool gpuQuantize = false;
 
 
 /*--------------------------------------------------------------
@@ -44,6 +79,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void setupBuffers(GLuint& VAO, GLuint& VBO, GLuint& EBO);
 GLuint createShaderProgram(const char* vertexSource, const char* fragmentSource);
 void processInput(GLFWwindow* window);
+void saveReplay();
 void drawCube(GLuint shaderProgram, GLuint VAO, glm::mat4 view, glm::mat4 projection, vector<float> scale, float rotationAngle, vector<float> position, vector<float> color);
 
 /*---------------------------------------------
@@ -110,8 +146,18 @@ void main() {
 }
 )";
 
-int main()
+int main(int argc, char** argv)
 {
+	// Offline: turn a raw capture into a GIF, encoding on every core, and exit
+	if (argc == 4 && strcmp(argv[1], "--transcode") == 0) {
+		bool ok = GifTranscodeCapture(argv[2], argv[3], std::thread::hardware_concurrency(), 6);
+		std::cout << (ok ? "Wrote " : "Failed to write ") << argv[3] << std::endl;
+		return ok ? 0 : 1;
+	}
+	// Instant replay instead of recording everything
+	if (argc == 2 && strcmp(argv[1], "--replay") == 0)
+		captureMode = CAPTURE_INSTANT_REPLAY;
+
 	/*-----------------------------------------------------------------------
 	Setup the Window
 	-------------------------------------------------------------------------*/
@@ -169,6 +215,10 @@ int main()
 	setupBuffers(legVAO, legVBO, armEBO);
 
 
+	// Have the characters report their changes
+	character.setTracker(&sceneTracker);
+	scaledCharacter.setTracker(&sceneTracker);
+
 	// Initialize character position and rotation
 	character.setPosition(glm::vec3(0.0f, 1.0f, 0.0f));
 	character.setRotation(glm::vec3(0.0f));
@@ -181,11 +231,124 @@ int main()
 
 	// Initialize GIF
 	GifWriter gifWriter;
-	GifBegin(&gifWriter, "output.gif", 950, 950, 0);
+	GifCaptureWriter rawCapture;
+	GifPipeWriter videoPipe;
+	bool quantizeOnGpu = gpuQuantize && captureMode == CAPTURE_GIF_SEGMENTS;
+	GifPalette capturePalette;
+	vector<uint8_t> paletteLut(1 << (3 * kGifLutBits));
+	if (captureMode == CAPTURE_INSTANT_REPLAY) {
+		// Frames are kept as their changes from the frame before, so seconds of them fit in a few MB
+		GifReplayBegin(&replay, captureWidth, captureHeight, replaySeconds * 100, replayMaxBytes);
+	}
+	else if (captureMode == CAPTURE_RAW) {
+		// Only what changed is written, about a millisecond a frame, so capture keeps up with rendering
+		GifCaptureBegin(&rawCapture, "capture.gcap", captureWidth, captureHeight);
+	}
+	else if (captureMode == CAPTURE_VIDEO_PIPE) {
+#ifndef _WIN32
+		// Keep rendering if the encoder quits
+		signal(SIGPIPE, SIG_IGN);
+#endif
+		// Frames the encoder can't take yet are dropped rather than holding up rendering
+		GifPipeBegin(&videoPipe, "-", captureWidth, captureHeight, kGifPipeY4m, 60, 1);
+	}
+	else {
+		// Record to rolling segments (output_000.gif, output_001.gif, ...) so long sessions stay shareable:
+		// a new file every 1800 frames or 64 MB, written and closed on a background thread
+		GifBeginSegments(&gifWriter, "output.gif", captureWidth, captureHeight, 0, 1800, 64u << 20);
+		// Encode frames on worker threads so the render loop doesn't wait on the encoder
+		GifSetAsync(&gifWriter, std::thread::hardware_concurrency());
+		if (quantizeOnGpu) {
+			// 6 x 7 x 6 levels of red, green and blue, and the table of them the GPU palettizes with
+			GifMakeCubePalette(6, 7, 6, &capturePalette);
+			GifSetFixedPalette(&gifWriter, &capturePalette);
+			GifGetPaletteLutIndices(&capturePalette, paletteLut.data());
+		}
+		else {
+			// Keep the palette while it still fits; the scene's colors barely change between frames
+			GifSetPaletteReuse(&gifWriter, 6);
+		}
+	}
+	// Offscreen framebuffer the recorded frames are drawn into
+	CaptureTarget captureTarget(captureWidth, captureHeight, captureScale);
+	// Pass that turns them into palette indices, when palettizing on the GPU
+	PaletteQuantizer* paletteQuantizer = quantizeOnGpu ? new PaletteQuantizer(captureWidth, captureHeight, paletteLut.data()) : NULL;
+	// Ring of pixel buffers they are read back into
+	FrameCapture frameCapture(captureWidth, captureHeight, captureBuffers, quantizeOnGpu ? GL_RED_INTEGER : GL_RGBA);
+	// Time captured so far, in hundredths of a second (the unit of GIF frame delays): the newest frame is
+	// shown from when it was drawn up to capturedTime. Nothing counts before the first frame
+	uint32_t capturedTime = 0;
+	bool anyFrameCaptured = false;
+	// Time the render loop spends on capture, for the report at the end
+	double captureSeconds = 0.0;
+	double firstFrameTime = glfwGetTime();
+	int framesRendered = 0;
+	int framesSkipped = 0;
+
+	// Shows the newest frame up to frameTime. The recordings play back in real time, so a frame lasts until
+	// the next one is drawn, which isn't known when it's added: each frame goes in with no delay, and gets its
+	// time as it passes, the way the writers fold a repeated frame into the one before
+	auto extendFrame = [&](double frameTime) {
+		uint32_t now = (uint32_t)(frameTime * 100.0);
+		uint32_t delay = now - capturedTime;
+		capturedTime = now;
+		if (!anyFrameCaptured || delay == 0)
+			return;
+
+		if (captureMode == CAPTURE_GIF_SEGMENTS)
+			GifRepeatFrame(&gifWriter, delay);
+		else if (captureMode == CAPTURE_INSTANT_REPLAY)
+			GifReplayRepeatFrame(&replay, delay);
+		else
+			GifCaptureRepeatFrame(&rawCapture, delay);
+	};
 
-	// rendering loop
-	while (!glfwWindowShouldClose(window))
-	{
+	// Hands a read-back frame, straight from the mapped buffer, to the encoder
+	auto writeFrame = [&](const uint8_t* pixels, double frameTime) {
+		if (captureMode == CAPTURE_VIDEO_PIPE) {
+			GifPipeFrame(&videoPipe, pixels);
+			return;
+		}
+
+		extendFrame(frameTime);
+		anyFrameCaptured = true;
+		if (captureMode == CAPTURE_GIF_SEGMENTS) {
+			if (quantizeOnGpu)
+				GifWriteIndexedFrame(&gifWriter, pixels, captureWidth, captureHeight, 0);
+			else
+				GifWriteFrame(&gifWriter, pixels, captureWidth, captureHeight, 0);
+		}
+		else if (captureMode == CAPTURE_INSTANT_REPLAY)
+			GifReplayAddFrame(&replay, pixels, 0);
+		else
+			GifCaptureFrame(&rawCapture, pixels, 0);
+	};
+
+	// Stands in for a frame that was skipped because nothing in it changed
+	auto repeatFrame = [&](double frameTime) {
+		if (captureMode == CAPTURE_VIDEO_PIPE)
+			GifPipeRepeatFrame(&videoPipe);
+		else
+			extendFrame(frameTime);
+	};
+
+	// Set up a static camera position and view
+	glm::vec3 cameraPos = glm::vec3(0.0f, 3.0f, 15.0f);  // Fixed camera position
+	glm::vec3 cameraTarget = glm::vec3(0.0f, 1.0f, 0.0f); // Looking at the center
+	glm::mat4 view = glm::lookAt(
+		cameraPos,
+		cameraTarget,
+		glm::vec3(0.0f, 1.0f, 0.0f)  // Up vector
+	);
+
+	// Perspective projection for a framebuffer of the given aspect ratio
+	auto makeProjection = [](float aspect) {
+		return glm::perspective(glm::radians(45.0f), aspect, 0.1f, 100.0f);
+	};
+
+	// Draws the scene into the bound framebuffer with the given projection; called for the
+	// recording and for the window, so each gets the whole view at its own size
+	auto drawScene = [&](const glm::mat4& projection) {
 		// Set the background color to light blue (clear sky)
 		glClearColor(0.5f, 0.7f, 1.0f, 1.0f);
 		// Clear the color and depth buffer
@@ -193,23 +356,6 @@ int main()
 		// Enable depth testing for 3D rendering
 		glEnable(GL_DEPTH_TEST);
 
-		// Get window dimensions for calculating aspect ratio
-		int width, height;
-		glfwGetFramebufferSize(window, &width, &height);
-		float aspect = (float)width / (float)height;
-
-		// Set up perspective projection matrix
-		glm::mat4 projection = glm::perspective(glm::radians(45.0f), aspect, 0.1f, 100.0f);
-
-		// Set up a static camera position and view
-		glm::vec3 cameraPos = glm::vec3(0.0f, 3.0f, 15.0f);  // Fixed camera position
-		glm::vec3 cameraTarget = glm::vec3(0.0f, 1.0f, 0.0f); // Looking at the center
-		glm::mat4 view = glm::lookAt(
-			cameraPos,
-			cameraTarget,
-			glm::vec3(0.0f, 1.0f, 0.0f)  // Up vector
-		);
-
 		// Draw the ground
 		drawCube(shaderProgram, cubeVAO, view, projection,
 			{ 20.0f, 0.1f, 20.0f },    // Scale: wide and flat
@@ -230,42 +376,96 @@ int main()
 			glm::vec3(1.5, 1.5, 1.5),      // scale
 			scaledCharacter.getRotation(), // rotation
 			scaledCharacter.getPosition()); // position
+	};
 
-		// Process user input for character movement
-		processInput(window);
-
-		// Capture the frame
-		std::vector<uint8_t> frame(950 * 950 * 4); // RGBA
-		glReadPixels(0, 0, 950, 950, GL_RGBA, GL_UNSIGNED_BYTE, frame.data());
-
-		// Flip the frame vertically
-		for (int y = 0; y < 950 / 2; ++y) {
-			for (int x = 0; x < 950; ++x) {
-				int topIndex = (y * 950 + x) * 4;
-				int bottomIndex = ((950 - y - 1) * 950 + x) * 4;
-
-				// Swap the pixels
-				std::swap(frame[topIndex], frame[bottomIndex]);
-				std::swap(frame[topIndex + 1], frame[bottomIndex + 1]);
-				std::swap(frame[topIndex + 2], frame[bottomIndex + 2]);
-				std::swap(frame[topIndex + 3], frame[bottomIndex + 3]);
+	// rendering loop
+	while (!glfwWindowShouldClose(window))
+	{
+		// Capture the frame: draw it offscreen at the capture size, queue its readback, then add the
+		// oldest frame read back to the GIF - this one, unless captureBuffers is more than 1
+		double captureStart = glfwGetTime();
+		glm::mat4 captureProjection = makeProjection(captureTarget.getAspect());
+		sceneTracker.setCamera(view, captureProjection);
+		if (sceneTracker.takeChanged()) {
+			captureTarget.bind();
+			drawScene(captureProjection);
+			captureTarget.resolve();
+			if (paletteQuantizer)
+				paletteQuantizer->quantize(captureTarget.getColorTexture());
+			frameCapture.readFrame(captureStart);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			if (const uint8_t* pixels = frameCapture.mapFrame()) {
+				writeFrame(pixels, frameCapture.getFrameTime());
+				frameCapture.unmapFrame();
+			}
+		}
+		else {
+			// Nothing moved, so this frame would be the same as the last: hand out the frames still being
+			// read back (their copies were queued a frame or more ago), then let the last one last longer
+			while (const uint8_t* pixels = frameCapture.mapFrame(true)) {
+				writeFrame(pixels, frameCapture.getFrameTime());
+				frameCapture.unmapFrame();
 			}
+			repeatFrame(captureStart);
+			++framesSkipped;
 		}
-		// Add frame to GIF
-		GifWriteFrame(&gifWriter, frame.data(), 950, 950, 0);
+		captureSeconds += glfwGetTime() - captureStart;
+		++framesRendered;
+
+		// Draw the scene again for the window at its current size; a minimized window has none,
+		// but the recording goes on
+		int width, height;
+		glfwGetFramebufferSize(window, &width, &height);
+		if (width > 0 && height > 0) {
+			glViewport(0, 0, width, height);
+			drawScene(makeProjection((float)width / (float)height));
+		}
+
+		// Process user input for character movement
+		processInput(window);
 
 		// Swap the back buffer with the front buffer
 		glfwSwapBuffers(window);
 		// Take care of all GLFW events
 		glfwPollEvents();
 	}
-	// end the gif writer
-	GifEnd(&gifWriter);
+	// Add the frames still in the pixel buffers, and show the last one until now
+	while (const uint8_t* pixels = frameCapture.mapFrame(true)) {
+		writeFrame(pixels, frameCapture.getFrameTime());
+		frameCapture.unmapFrame();
+	}
+	if (captureMode != CAPTURE_VIDEO_PIPE)
+		extendFrame(glfwGetTime());
+	if (framesRendered > 0) {
+		std::cerr << "Capture: " << captureSeconds * 1000.0 / framesRendered << " ms per frame on the render loop, "
+			<< (glfwGetTime() - firstFrameTime) * 1000.0 / framesRendered << " ms frame time, " << framesRendered
+			<< " frames (" << captureBuffers << " pixel buffers), " << framesSkipped << " skipped as unchanged" << std::endl;
+	}
+
+	// end the gif writer (waiting for a replay still being saved)
+	if (captureMode == CAPTURE_INSTANT_REPLAY)
+		GifReplayEnd(&replay);
+	else if (captureMode == CAPTURE_RAW)
+		GifCaptureEnd(&rawCapture);
+	else if (captureMode == CAPTURE_VIDEO_PIPE) {
+		// stdout carries the video, so report on stderr
+		GifPipeEnd(&videoPipe);
+		std::cerr << "Video pipe: " << videoPipe.framesWritten << " frames written, "
+			<< videoPipe.framesDropped << " dropped" << std::endl;
+	}
+	else
+		GifEnd(&gifWriter);
 
 	// Delete all the objects we've created
 	/*glDeleteVertexArrays(1, &planet1VAO);
 	glDeleteBuffers(1, &planet1VBO);*/
 	glDeleteProgram(shaderProgram);
+	frameCapture.deleteBuffers();
+	captureTarget.deleteBuffers();
+	if (paletteQuantizer) {
+		paletteQuantizer->deleteBuffers();
+		delete paletteQuantizer;
+	}
 	// Delete window before ending the program
 	glfwDestroyWindow(window);
 	// Terminate GLFW before ending the program
@@ -500,4 +700,35 @@ void processInput(GLFWwindow* window) {
 
 	// Update character's swing animation
 	character.updateSwing(deltaTime, isMoving);
+
+	// Save the instant replay with F9, once per key press
+	static bool replayKeyDown = false;
+	bool replayKey = glfwGetKey(window, GLFW_KEY_F9) == GLFW_PRESS;
+	if (captureMode == CAPTURE_INSTANT_REPLAY && replayKey && !replayKeyDown)
+		saveReplay();
+	replayKeyDown = replayKey;
+}
+
+/*
+Function to save the instant replay to replay_000.gif, replay_001.gif, ...
+The GIF is encoded on a background thread; prints how much memory the replay holds
+*/
+void saveReplay() {
+	static int replayIndex = 0;
+	char filename[32];
+	snprintf(filename, sizeof(filename), "replay_%03d.gif", replayIndex);
+
+	GifReplayStats stats = GifReplayGetStats(&replay);
+	// Keep the palette while it still fits, as for recording
+	if (GifReplaySave(&replay, filename, 6)) {
+		++replayIndex;
+		std::cout << "Saving the last " << stats.delay / 100.0 << " s (" << stats.numFrames << " frames) to " << filename << std::endl;
+	}
+	else {
+		std::cout << "Replay not saved: the last one is still being written" << std::endl;
+	}
+
+	stats = GifReplayGetStats(&replay);
+	std::cout << "Replay memory: " << stats.bytesAllocated / (1 << 20) << " MB allocated, "
+		<< stats.bytesUsed / 1024 << " KB of " << replayMaxBytes / (1 << 20) << " MB of frame changes in use" << std::endl;
 }
\ No newline at end of file
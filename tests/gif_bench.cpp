@@ -0,0 +1,1447 @@
+// Benchmarks and round-trip checks for gif.h, run on frames decoded from a recorded GIF.
+// Build and run with the Makefile next to this file: make check
+//
+// gif_bench [recording.gif] [section...] runs the named sections, or all of them:
+//   search - nearest-palette-color search, checked against every entry and timed against the k-d tree walk
+//   lzw    - LZW throughput and peak memory, and a decode of the encoded frames
+//   strips - images compressed in parallel LZW strips, decoded and compared with one strip
+//   lossy  - bytes per frame and color error of lossy LZW at several error budgets
+//   dither - Floyd-Steinberg dithering against the original serial ditherer, and on worker threads
+//   repeats - repeated frames folded into the frame before, passed in again or through GifRepeatFrame
+//   capture - raw capture files read back frame by frame, and damaged ones rejected
+//   allocs - allocations while writing frames a writer has already seen, for each kind of writer
+//   rects  - frames changing a small rectangle, or nothing, decoded and compared
+//   cache  - thresholding with the color cache, checked against searching the palette for every pixel
+//   sink   - output to a file and to memory compared, writes counted, and a failing sink reported
+//   palettes - palettes kept while they fit, and frames on the global color table
+//   histogram - palettes from color histograms: scratch memory, exact colors, and order independence
+//   bitdepth - palette sizes picked for frames of 1 to 255 colors, under several bit depth limits
+//   twopass - one palette from every frame's colors: global color table, color error and repeats
+//   lut    - the fixed-palette lookup table against GifFindPaletteColor, and timed against searching
+//   segments - rolling segments compared with their frames encoded on their own, and split by size
+//   replay - the instant replay ring dropping frames by time and by size, and saved
+//   pipe   - Y4M and raw RGBA output sizes, and the planes against the scalar color conversion
+//
+// Prints the measurements, and exits with 1 if any check fails.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "gif.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+typedef std::vector<uint8_t> Frame;
+
+static int failures = 0;
+
+// Function to report a check, counting it if it failed
+static void check(bool ok, const char* what)
+{
+    printf("  %s: %s\n", ok ? "ok" : "FAILED", what);
+    if(!ok) ++failures;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Decodes up to maxFrames frames of a GIF, as stb_image's stbi_load_gif_from_memory does
+// but one frame at a time, so a long recording doesn't have to fit in memory whole.
+// delays, if given, gets each frame's delay in hundredths of a second.
+static std::vector<Frame> decodeGif(const uint8_t* data, size_t size, size_t maxFrames, int* width, int* height,
+                                    std::vector<int>* delays = NULL)
+{
+    std::vector<Frame> frames;
+    stbi__context context;
+    stbi__start_mem(&context, data, (int)size);
+    stbi__gif gif;
+    memset(&gif, 0, sizeof(gif));
+
+    while(frames.size() < maxFrames)
+    {
+        int comp;
+        stbi_uc* image = stbi__gif_load_next(&context, &gif, &comp, 4, NULL);
+        if(!image || image == (stbi_uc*)&context) break; // error, or the end of the animation
+        frames.push_back(Frame(image, image + (size_t)gif.w * gif.h * 4));
+        if(delays) delays->push_back(gif.delay / 10);
+        *width = gif.w;
+        *height = gif.h;
+    }
+
+    STBI_FREE(gif.out);
+    STBI_FREE(gif.history);
+    STBI_FREE(gif.background);
+    return frames;
+}
+
+// Largest amount of memory the process has had resident so far, in MB
+static double peakRssMb()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1048576.0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1048576.0; // bytes
+#else
+    return usage.ru_maxrss / 1024.0;    // kilobytes
+#endif
+#endif
+}
+
+// Encodes frames into a GIF in memory, 2/100 s each. configure, if given, sets the writer up before the
+// first frame. quantized, if given, gets each frame the decoder should show - the colors the encoder
+// picked - and needs a writer that encodes on the calling thread; seconds gets the time spent writing.
+static Frame encodeFrames(const std::vector<Frame>& frames, int width, int height,
+                          std::function<void(GifWriter*)> configure = nullptr,
+                          std::vector<Frame>* quantized = NULL, double* seconds = NULL, bool dither = false)
+{
+    GifBuffer out;
+    memset(&out, 0, sizeof(out));
+    GifWriter writer;
+    GifBeginSink(&writer, GifBufferSink, &out, width, height, 2);
+    if(configure) configure(&writer);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(size_t ii=0; ii<frames.size(); ++ii)
+    {
+        GifWriteFrame(&writer, frames[ii].data(), width, height, 2, 8, dither);
+
+        // a repeat is folded into the frame before, so the decoder doesn't see it
+        if(quantized && (ii == 0 || frames[ii] != frames[ii-1]))
+        {
+            Frame shown(writer.oldImage, writer.oldImage + frames[ii].size());
+            for(size_t jj=3; jj<shown.size(); jj+=4) shown[jj] = 255;
+            quantized->push_back(shown);
+        }
+    }
+    GifEnd(&writer);
+    if(seconds) *seconds = secondsSince(start);
+
+    Frame gif(out.data, out.data + out.size);
+    GifBufferFree(&out);
+    return gif;
+}
+
+// The color table of every image in a GIF, as the bytes stored for it: the local one, or an empty Frame for an
+// image that uses the global one, which goes in global (empty if there is none). Stops at anything malformed.
+static std::vector<Frame> colorTables(const Frame& gif, Frame* global)
+{
+    std::vector<Frame> tables;
+    global->clear();
+    if(gif.size() < 13) return tables;
+
+    size_t pos = 13;
+    if(gif[10] & 0x80)
+    {
+        size_t size = 3u << ((gif[10] & 7) + 1);
+        if(pos + size > gif.size()) return tables;
+        global->assign(gif.begin() + pos, gif.begin() + pos + size);
+        pos += size;
+    }
+
+    while(pos < gif.size() && gif[pos] != 0x3b)
+    {
+        if(gif[pos] == 0x21)
+        {
+            pos += 2; // extension introducer and label
+        }
+        else if(gif[pos] == 0x2c && pos + 10 < gif.size())
+        {
+            uint8_t flags = gif[pos + 9];
+            pos += 10;
+            Frame table;
+            if(flags & 0x80)
+            {
+                size_t size = 3u << ((flags & 7) + 1);
+                if(pos + size > gif.size()) break;
+                table.assign(gif.begin() + pos, gif.begin() + pos + size);
+                pos += size;
+            }
+            tables.push_back(table);
+            ++pos; // LZW minimum code size
+        }
+        else
+        {
+            break;
+        }
+
+        // data sub-blocks, up to the empty one
+        while(pos < gif.size() && gif[pos] != 0)
+            pos += gif[pos] + 1;
+        ++pos;
+    }
+    return tables;
+}
+
+static Frame readFile(const char* path)
+{
+    Frame data;
+    FILE* f = fopen(path, "rb");
+    if(!f) return data;
+    uint8_t chunk[65536];
+    size_t n;
+    while((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        data.insert(data.end(), chunk, chunk + n);
+    fclose(f);
+    return data;
+}
+
+// The nearest palette entry to a color by sum of absolute differences, the lowest index of equally near
+// ones, skipping the transparent entry: what GifFindPaletteColor must pick
+static int nearestEntry(const GifPalette* pal, int r, int g, int b, int* diff)
+{
+    int bestInd = kGifTransIndex, bestDiff = 1000000;
+    for(int ii=0; ii<(1 << pal->bitDepth); ++ii)
+    {
+        int d = abs(r - pal->r[ii]) + abs(g - pal->g[ii]) + abs(b - pal->b[ii]);
+        if(ii != kGifTransIndex && d < bestDiff)
+        {
+            bestInd = ii;
+            bestDiff = d;
+        }
+    }
+    if(diff) *diff = bestDiff;
+    return bestInd;
+}
+
+// GifFindPaletteColor - SIMD distances to the whole palette, and the first smallest - must pick the nearest
+// entry, and should be faster than the recursive GifGetClosestPaletteColor walk it replaced, for the palettes
+// the encoder builds: full frames, the changes from the frame before, and 4-bit dither palettes queried with
+// random colors, some of them outside 0-255 as dithering asks for. Without SIMD it is the walk, which finds
+// an entry as near but breaks ties its own way.
+static void benchSearch(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("search: nearest palette color, %d frames\n", (int)frames.size());
+    size_t numPixels = (size_t)width * height;
+    std::mt19937 rng(1);
+    std::vector<int> colors(numPixels * 3), walked(numPixels), found(numPixels), foundDiff(numPixels);
+    double recursiveSeconds = 0, findSeconds = 0;
+    uint64_t queries = 0, farther = 0, otherTies = 0;
+
+    for(size_t ii=0; ii<frames.size(); ++ii)
+    {
+        for(int mode=0; mode<3; ++mode)
+        {
+            const uint8_t* lastFrame = (mode == 1 && ii > 0) ? frames[ii-1].data() : NULL;
+            GifPalette pal;
+            GifMakePalette(lastFrame, frames[ii].data(), width, height, mode == 2 ? 4 : 8, mode == 2, &pal);
+
+            for(size_t jj=0; jj<numPixels; ++jj)
+                for(int cc=0; cc<3; ++cc)
+                    colors[jj*3+cc] = mode == 2 ? (int)(rng() % 512) - 128 : frames[ii][jj*4+cc];
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for(size_t jj=0; jj<numPixels; ++jj)
+            {
+                int bestInd = 1, bestDiff = 1000000;
+                GifGetClosestPaletteColor(&pal, colors[jj*3], colors[jj*3+1], colors[jj*3+2], &bestInd, &bestDiff, 1);
+                walked[jj] = bestInd;
+            }
+            recursiveSeconds += secondsSince(start);
+
+            start = std::chrono::steady_clock::now();
+            for(size_t jj=0; jj<numPixels; ++jj)
+            {
+                int bestInd = 1, bestDiff = 1000000;
+                GifFindPaletteColor(&pal, colors[jj*3], colors[jj*3+1], colors[jj*3+2], &bestInd, &bestDiff);
+                found[jj] = bestInd;
+                foundDiff[jj] = bestDiff;
+            }
+            findSeconds += secondsSince(start);
+
+            for(size_t jj=0; jj<numPixels; ++jj)
+            {
+                int nearestDiff = 0;
+                int nearest = nearestEntry(&pal, colors[jj*3], colors[jj*3+1], colors[jj*3+2], &nearestDiff);
+                farther += foundDiff[jj] != nearestDiff;
+                otherTies += foundDiff[jj] == nearestDiff && found[jj] != nearest;
+            }
+            queries += numPixels;
+        }
+    }
+
+    printf("  recursive walk       %6.1f Mpx/s\n", queries / recursiveSeconds / 1e6);
+    printf("  GifFindPaletteColor  %6.1f Mpx/s\n", queries / findSeconds / 1e6);
+    char what[128];
+    snprintf(what, sizeof(what), "an entry at the nearest distance for all %llu queries (%llu farther)",
+             (unsigned long long)queries, (unsigned long long)farther);
+    check(farther == 0, what);
+#if defined(GIF_SSE2)
+    snprintf(what, sizeof(what), "the lowest index of equally near entries (%llu not)", (unsigned long long)otherTies);
+    check(otherTies == 0, what);
+    check(recursiveSeconds > findSeconds * 2, "over twice as fast as the recursive walk");
+#endif
+}
+
+// The LZW coder on its own - a whole frame, and the small changed rectangle a typical delta frame is - then
+// the whole encoder, whose output must decode to exactly the colors it picked. The coder's scratch memory
+// (its dictionary) comes from the arena, whose high-water mark is exact; the process's peak RSS is read
+// before and after each stage for the encoder as a whole.
+static void benchLzw(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("lzw: LZW coder and whole encoder, %d frames\n", (int)frames.size());
+    double rssLoaded = peakRssMb();
+
+    GifPalette pal;
+    GifMakePalette(NULL, frames[0].data(), width, height, 8, false, &pal);
+    Frame indexed(frames[0].size());
+    GifThresholdImage(NULL, frames[0].data(), indexed.data(), width, height, &pal, NULL);
+
+    GifBuffer out;
+    memset(&out, 0, sizeof(out));
+    GifArena arena;
+    memset(&arena, 0, sizeof(arena));
+
+    const int wholeFrames = 20;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int ii=0; ii<wholeFrames; ++ii)
+    {
+        out.size = 0;
+        GifWriteLzwImage(&out, indexed.data(), width, height, 0, 0, width, height, 2, &pal, false, 1, &arena);
+    }
+    double wholeSeconds = secondsSince(start);
+
+    const int rects = 2000;
+    start = std::chrono::steady_clock::now();
+    for(int ii=0; ii<rects; ++ii)
+    {
+        out.size = 0;
+        GifWriteLzwImage(&out, indexed.data(), width, height, (ii * 37) % (width - 64), (ii * 53) % (height - 64), 64, 64, 2, &pal, false, 1, &arena);
+    }
+    double rectSeconds = secondsSince(start);
+    size_t lzwScratch = arena.peak;
+    GifBufferFree(&out);
+    GifArenaRelease(&arena);
+    double rssLzw = peakRssMb();
+
+    double encodeSeconds = 0;
+    Frame gif = encodeFrames(frames, width, height, nullptr, NULL, &encodeSeconds);
+    double rssEncoded = peakRssMb();
+
+    printf("  whole %dx%d frame    %6.1f Mpx/s\n", width, height, (double)width * height * wholeFrames / wholeSeconds / 1e6);
+    printf("  64x64 rectangle       %6.1f us\n", rectSeconds / rects * 1e6);
+    printf("  whole encoder, sync   %6.2f ms/frame, %d bytes/frame\n", encodeSeconds / frames.size() * 1000, (int)(gif.size() / frames.size()));
+    printf("  LZW scratch memory    %6.1f KB\n", lzwScratch / 1024.0);
+    printf("  peak RSS              %6.1f MB with the frames loaded, +%.1f MB after the LZW coder, +%.1f MB after encoding\n",
+           rssLoaded, rssLzw - rssLoaded, rssEncoded - rssLoaded);
+
+    check(lzwScratch <= 64 * 1024, "the LZW coder needs at most 64 KB of scratch memory");
+
+    std::vector<Frame> quantized;
+    encodeFrames(frames, width, height, nullptr, &quantized);
+    int decodedWidth = 0, decodedHeight = 0;
+    std::vector<Frame> decoded = decodeGif(gif.data(), gif.size(), frames.size() + 1, &decodedWidth, &decodedHeight);
+    check(decoded == quantized, "decodes to the colors the encoder picked, frame for frame");
+
+    Frame asyncGif = encodeFrames(frames, width, height, [](GifWriter* writer) { GifSetAsync(writer, 4); });
+    check(asyncGif == gif, "4 worker threads write the same bytes as the calling thread");
+}
+
+// Random image of runs of random colors - 2 to 255 of them, so the palette, and with it the starting code size,
+// varies; few colors make the short codes whose width changes at the end of a strip trip decoders up
+static Frame randomImage(std::mt19937& rng, int width, int height)
+{
+    int numColors = 2 + rng() % (rng() % 2 ? 14 : 254);
+    std::vector<uint32_t> colors(numColors);
+    for(int ii=0; ii<numColors; ++ii) colors[ii] = rng() | 0xff000000u;
+
+    Frame image((size_t)width * height * 4);
+    size_t numPixels = (size_t)width * height;
+    for(size_t ii=0; ii<numPixels; )
+    {
+        uint32_t color = colors[rng() % numColors];
+        for(size_t run = 1 + rng() % 64; run > 0 && ii < numPixels; --run, ++ii)
+            memcpy(&image[ii*4], &color, 4);
+    }
+    return image;
+}
+
+// Strips are each compressed from an empty dictionary and stitched together at whatever bit the previous
+// one ended on; any mistake in the stitching or in a strip's closing clear code makes the image undecodable
+// or changes its pixels. Every encoding must decode to the single-strip one, which must decode to the
+// colors the encoder picked.
+static void benchStrips(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("strips: parallel LZW strips\n");
+    const int stripCounts[] = { 1, 2, 4, 8 };
+
+    std::vector<Frame> quantized;
+    encodeFrames(frames, width, height, nullptr, &quantized);
+    for(int ii=0; ii<4; ++ii)
+    {
+        int numStrips = stripCounts[ii];
+        double seconds = 0;
+        Frame gif = encodeFrames(frames, width, height, [numStrips](GifWriter* writer) { GifSetLzwStrips(writer, numStrips); }, NULL, &seconds);
+        int decodedWidth = 0, decodedHeight = 0;
+        bool same = decodeGif(gif.data(), gif.size(), frames.size() + 1, &decodedWidth, &decodedHeight) == quantized;
+        printf("  %d strips: %7d bytes, %6.2f ms/frame\n", numStrips, (int)gif.size(), seconds / frames.size() * 1000);
+        char what[128];
+        snprintf(what, sizeof(what), "the recorded frames decode the same with %d strips", numStrips);
+        check(same, what);
+    }
+
+    // large images are split into several strips; small ones have one, but end with so few codes written
+    // that the dictionary often ends up exactly one entry short of the next code size
+    std::mt19937 rng(11);
+    const int numImages = 1000;
+    int failed = 0;
+    for(int ii=0; ii<numImages; ++ii)
+    {
+        bool large = ii % 4 == 0;
+        int imageWidth = large ? 200 + rng() % 700 : 1 + rng() % 48;
+        int imageHeight = large ? 200 + rng() % 700 : 1 + rng() % 48;
+        int numStrips = 2 + rng() % 7;
+        std::vector<Frame> image(1, randomImage(rng, imageWidth, imageHeight));
+
+        std::vector<Frame> oneStripColors;
+        Frame oneStrip = encodeFrames(image, imageWidth, imageHeight, nullptr, &oneStripColors);
+        Frame strips = encodeFrames(image, imageWidth, imageHeight, [numStrips](GifWriter* writer) { GifSetLzwStrips(writer, numStrips); });
+
+        int decodedWidth = 0, decodedHeight = 0;
+        std::vector<Frame> oneStripDecoded = decodeGif(oneStrip.data(), oneStrip.size(), 2, &decodedWidth, &decodedHeight);
+        std::vector<Frame> stripsDecoded = decodeGif(strips.data(), strips.size(), 2, &decodedWidth, &decodedHeight);
+        if(oneStripDecoded != oneStripColors || stripsDecoded != oneStripColors)
+            ++failed;
+    }
+    char what[128];
+    snprintf(what, sizeof(what), "%d random images with 1-8 strips decode to the colors picked (%d don't)", numImages, failed);
+    check(failed == 0, what);
+}
+
+// Lossy LZW lets a pixel be shown as a palette color up to maxError away (sum of absolute RGB differences)
+// when that makes a longer run; every decoded pixel must be within maxError of the lossless encoding's,
+// thresholded and dithered, and the worker threads must produce the same bytes as the calling thread.
+static void benchLossy(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("lossy: lossy LZW error budgets\n");
+    const int budgets[] = { 0, 8, 16, 32 };
+
+    for(int dither=0; dither<2; ++dither)
+    {
+        // dithering is slower, and its noise is what lossy LZW saves the most on, so fewer frames do
+        std::vector<Frame> source(frames.begin(), frames.begin() + (dither && frames.size() > 5 ? 5 : frames.size()));
+        int decodedWidth = 0, decodedHeight = 0;
+        std::vector<Frame> lossless;
+
+        for(int ii=0; ii<4; ++ii)
+        {
+            int maxError = budgets[ii];
+            double seconds = 0;
+            Frame gif = encodeFrames(source, width, height, [maxError](GifWriter* writer) { GifSetLossyLzw(writer, maxError); },
+                                     NULL, &seconds, dither != 0);
+            std::vector<Frame> decoded = decodeGif(gif.data(), gif.size(), source.size() + 1, &decodedWidth, &decodedHeight);
+            if(maxError == 0) lossless = decoded;
+
+            int worstError = 0;
+            double sumError = 0;
+            size_t numPixels = 0;
+            for(size_t ff=0; ff<decoded.size() && ff<lossless.size(); ++ff)
+            {
+                for(size_t jj=0; jj<decoded[ff].size(); jj+=4)
+                {
+                    int error = abs(decoded[ff][jj] - lossless[ff][jj]) + abs(decoded[ff][jj+1] - lossless[ff][jj+1]) +
+                                abs(decoded[ff][jj+2] - lossless[ff][jj+2]);
+                    if(error > worstError) worstError = error;
+                    sumError += error;
+                    ++numPixels;
+                }
+            }
+
+            printf("  %s, lossy %2d   %6d bytes/frame, %6.2f ms/frame, mean error %.2f\n", dither ? "dithered" : "threshold",
+                   maxError, (int)(gif.size() / source.size()), seconds / source.size() * 1000, numPixels ? sumError / numPixels : 0.0);
+            char what[128];
+            snprintf(what, sizeof(what), "no pixel is more than %d from the lossless decode (worst %d)", maxError, worstError);
+            check(decoded.size() == lossless.size() && worstError <= maxError, what);
+
+            if(maxError == 16)
+            {
+                Frame asyncGif = encodeFrames(source, width, height,
+                                              [](GifWriter* writer) { GifSetLossyLzw(writer, 16); GifSetLzwStrips(writer, 4); GifSetAsync(writer, 4); },
+                                              NULL, NULL, dither != 0);
+                Frame stripsGif = encodeFrames(source, width, height,
+                                               [](GifWriter* writer) { GifSetLossyLzw(writer, 16); GifSetLzwStrips(writer, 4); },
+                                               NULL, NULL, dither != 0);
+                check(asyncGif == stripsGif, "4 worker threads write the same bytes as the calling thread");
+            }
+        }
+    }
+}
+
+// A frame the same as the one before, passed in again or through GifRepeatFrame, must only add its delay to
+// that frame's, also when the frames are encoded on worker threads
+static void benchRepeats(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("repeats: repeated frames\n");
+
+    // every frame shown for 1, 2 or 3 frame times, by repeating it or calling GifRepeatFrame
+    std::vector<Frame> source, distinct;
+    std::vector<int> delays, expectedDelays;
+    for(size_t ii=0; ii<frames.size(); ++ii)
+    {
+        if(!distinct.empty() && frames[ii] == distinct.back())
+        {
+            expectedDelays.back() += 2;
+        }
+        else
+        {
+            distinct.push_back(frames[ii]);
+            expectedDelays.push_back(2);
+        }
+        source.push_back(frames[ii]);
+        delays.push_back(2);
+        for(size_t rr=0; rr<ii % 3; ++rr)
+        {
+            source.push_back(frames[ii]);
+            delays.push_back(rr ? -2 : 2); // negative: GifRepeatFrame
+            expectedDelays.back() += 2;
+        }
+    }
+
+    std::vector<Frame> quantized;
+    encodeFrames(distinct, width, height, nullptr, &quantized);
+
+    for(int async=0; async<2; ++async)
+    {
+        GifBuffer out;
+        memset(&out, 0, sizeof(out));
+        GifWriter writer;
+        GifBeginSink(&writer, GifBufferSink, &out, width, height, 2);
+        if(async) GifSetAsync(&writer, 4);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(size_t ii=0; ii<source.size(); ++ii)
+        {
+            if(delays[ii] < 0) GifRepeatFrame(&writer, -delays[ii]);
+            else GifWriteFrame(&writer, source[ii].data(), width, height, delays[ii]);
+        }
+        GifEnd(&writer);
+        double seconds = secondsSince(start);
+
+        int decodedWidth = 0, decodedHeight = 0;
+        std::vector<int> decodedDelays;
+        std::vector<Frame> decoded = decodeGif(out.data, out.size, source.size() + 1, &decodedWidth, &decodedHeight, &decodedDelays);
+        printf("  %s: %d frames in, %d out, %6.2f ms/frame in\n", async ? "4 worker threads" : "calling thread",
+               (int)source.size(), (int)decoded.size(), seconds / source.size() * 1000);
+        check(decoded == quantized && decodedDelays == expectedDelays,
+              async ? "repeats fold into the frame before on worker threads" : "repeats fold into the frame before");
+        GifBufferFree(&out);
+    }
+
+    // a frame differing from the one before in a single bit is not a repeat
+    std::vector<Frame> nearlySame(2, frames[0]);
+    nearlySame[1][nearlySame[1].size() / 2] ^= 1;
+    Frame gif = encodeFrames(nearlySame, width, height);
+    int decodedWidth = 0, decodedHeight = 0;
+    check(decodeGif(gif.data(), gif.size(), 3, &decodedWidth, &decodedHeight).size() == 2, "a one-bit change is not a repeat");
+}
+
+// gif.h's original Floyd-Steinberg ditherer, kept as the reference GifDitherImage must match pixel for pixel;
+// it searches the palette with GifFindPaletteColor, which the search section checks on its own
+static void referenceDither(const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, int width, int height, GifPalette* pal)
+{
+    int numPixels = width * height;
+    std::vector<int32_t> quant((size_t)numPixels * 4);
+    for(int ii=0; ii<numPixels*4; ++ii) quant[ii] = nextFrame[ii] * 256;
+
+    for(int ii=0; ii<numPixels; ++ii)
+    {
+        int32_t* pix = &quant[(size_t)ii*4];
+        int32_t rr = (pix[0] + 127) / 256, gg = (pix[1] + 127) / 256, bb = (pix[2] + 127) / 256;
+        if(lastFrame && lastFrame[ii*4] == rr && lastFrame[ii*4+1] == gg && lastFrame[ii*4+2] == bb)
+        {
+            pix[0] = rr; pix[1] = gg; pix[2] = bb; pix[3] = kGifTransIndex;
+            continue;
+        }
+
+        int bestInd = kGifTransIndex, bestDiff = 1000000;
+        GifFindPaletteColor(pal, rr, gg, bb, &bestInd, &bestDiff);
+        int32_t err[3] = { pix[0] - pal->r[bestInd] * 256, pix[1] - pal->g[bestInd] * 256, pix[2] - pal->b[bestInd] * 256 };
+        pix[0] = pal->r[bestInd]; pix[1] = pal->g[bestInd]; pix[2] = pal->b[bestInd]; pix[3] = bestInd;
+
+        // the error wraps from the end of a row to the start of the next, as it always has
+        const int offsets[4] = { 1, width - 1, width, width + 1 };
+        const int weights[4] = { 7, 3, 5, 1 };
+        for(int nn=0; nn<4; ++nn)
+        {
+            if(ii + offsets[nn] >= numPixels) continue;
+            int32_t* to = &quant[(size_t)(ii + offsets[nn])*4];
+            for(int cc=0; cc<3; ++cc) to[cc] += std::max(-to[cc], err[cc] * weights[nn] / 16);
+        }
+    }
+    for(int ii=0; ii<numPixels*4; ++ii) outFrame[ii] = (uint8_t)quant[ii];
+}
+
+static void benchDither(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("dither: Floyd-Steinberg\n");
+    std::vector<Frame> source(frames.begin(), frames.begin() + (frames.size() > 5 ? 5 : frames.size()));
+    size_t imageSize = (size_t)width * height * 4;
+
+    int differ = 0;
+    double seconds = 0;
+    const int bitDepths[2] = { 8, 5 };
+    for(int dd=0; dd<2; ++dd)
+    {
+        Frame last, lastReference;
+        for(size_t ii=0; ii<source.size(); ++ii)
+        {
+            GifPalette pal;
+            GifMakePalette(ii ? last.data() : NULL, source[ii].data(), width, height, bitDepths[dd], true, &pal);
+            Frame out(imageSize), reference(imageSize);
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            GifDitherImage(ii ? last.data() : NULL, source[ii].data(), out.data(), width, height, &pal);
+            seconds += secondsSince(start);
+            referenceDither(ii ? lastReference.data() : NULL, source[ii].data(), reference.data(), width, height, &pal);
+            differ += out != reference;
+            last.swap(out);
+            lastReference.swap(reference);
+        }
+    }
+    printf("  GifDitherImage  %6.2f ms/frame\n", seconds / (2 * source.size()) * 1000);
+    char what[128];
+    snprintf(what, sizeof(what), "the same pixels as the original ditherer, 8 and 5 bits (%d frames differ)", differ);
+    check(differ == 0, what);
+
+    Frame serial = encodeFrames(source, width, height, nullptr, NULL, NULL, true);
+    Frame async = encodeFrames(source, width, height, [](GifWriter* writer) { GifSetAsync(writer, 4); }, NULL, NULL, true);
+    check(serial == async, "dithered frames encode to the same bytes on 4 worker threads");
+}
+
+// Overwrites size bytes of a file at offset
+static void patchFile(const char* path, long offset, const void* data, size_t size)
+{
+    FILE* f = fopen(path, "r+b");
+    if(!f) return;
+    fseek(f, offset, SEEK_SET);
+    fwrite(data, 1, size, f);
+    fclose(f);
+}
+
+// A capture file must give back every frame as it went in, with repeats folded into the frame before, and
+// GifCaptureReadFrame must return NULL rather than write outside its image when a frame's runs are damaged
+static void benchCapture(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("capture: raw capture files\n");
+    const char* path = "gif_bench_capture.tmp";
+    uint32_t numPixels = (uint32_t)(width * height);
+
+    GifCaptureWriter capture;
+    bool ok = GifCaptureBegin(&capture, path, width, height, 4);
+    for(size_t ii=0; ii<frames.size(); ++ii)
+        ok = GifCaptureFrame(&capture, frames[ii].data(), 2) && ok;
+    ok = GifCaptureEnd(&capture) && ok;
+    check(ok, "the capture file is written");
+
+    std::vector<Frame> distinct;
+    for(size_t ii=0; ii<frames.size(); ++ii)
+        if(ii == 0 || frames[ii] != frames[ii-1]) distinct.push_back(frames[ii]);
+
+    GifCaptureReader reader;
+    ok = GifCaptureOpen(&reader, path) && reader.numFrames == distinct.size();
+    for(uint32_t ii=0; ok && ii<reader.numFrames; ++ii)
+    {
+        // backwards, so that every read starts over from a key frame
+        uint32_t frame = reader.numFrames - 1 - ii;
+        const uint8_t* image = GifCaptureReadFrame(&reader, frame);
+        ok = image && memcmp(image, distinct[frame].data(), (size_t)numPixels*4) == 0;
+    }
+    GifCaptureClose(&reader);
+    check(ok, "every frame reads back as it was captured");
+
+    // the first frame's changes start right after the header and its record
+    long changes = (long)(sizeof(GifCaptureHeader) + sizeof(GifReplayRecord));
+    uint8_t tooLong[8];
+    int tooLongSize = GifPutRunLength(tooLong, numPixels + 1);
+    patchFile(path, changes, tooLong, tooLongSize);
+    ok = GifCaptureOpen(&reader, path) && reader.numFrames > 1 && !GifCaptureReadFrame(&reader, 0) &&
+         GifCaptureReadFrame(&reader, reader.numFrames - 1);
+    GifCaptureClose(&reader);
+    check(ok, "a run past the end of the image is rejected, and later key frames still read");
+
+    const uint8_t unterminated[5] = { 0xff, 0xff, 0xff, 0xff, 0xff };
+    patchFile(path, changes, unterminated, sizeof(unterminated));
+    ok = GifCaptureOpen(&reader, path) && !GifCaptureReadFrame(&reader, 0) && !GifCaptureReadFrame(&reader, 1);
+    GifCaptureClose(&reader);
+    check(ok, "a run length too long for 32 bits is rejected, and frames built on it too");
+
+    remove(path);
+}
+
+// Once a writer has seen the frames, writing them again must not allocate: scratch memory comes from the
+// arenas and threads from the pools the options started.
+static void benchAllocs(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("allocs: allocations in steady frames\n");
+    struct Setup { const char* name; bool dither; std::function<void(GifWriter*)> configure; };
+    const Setup setups[] = {
+        { "the calling thread", false, nullptr },
+        { "dithering", true, nullptr },
+        { "4 strips", false, [](GifWriter* writer) { GifSetLzwStrips(writer, 4); } },
+        { "workers and 4 strips", false, [](GifWriter* writer) { GifSetLzwStrips(writer, 4); GifSetAsync(writer, 2); } },
+        { "two-pass counting", false, [](GifWriter* writer) { GifSetTwoPass(writer); } },
+    };
+
+    for(size_t ii=0; ii<sizeof(setups)/sizeof(setups[0]); ++ii)
+    {
+        // the GIF only goes to a count of its bytes, so that growing a buffer for it isn't counted
+        size_t numBytes = 0;
+        GifWriter writer;
+        GifBeginSink(&writer, [](const void*, size_t size, void* user) { *(size_t*)user += size; return true; }, &numBytes, width, height, 2);
+        if(setups[ii].configure) setups[ii].configure(&writer);
+
+        for(size_t jj=0; jj<frames.size(); ++jj)
+            GifWriteFrame(&writer, frames[jj].data(), width, height, 2, 8, setups[ii].dither);
+        GifAllocStats before = GifGetAllocStats();
+        for(size_t jj=0; jj<frames.size(); ++jj)
+            GifWriteFrame(&writer, frames[jj].data(), width, height, 2, 8, setups[ii].dither);
+        GifAllocStats after = GifGetAllocStats();
+        GifEnd(&writer);
+
+        uint64_t numAllocs = after.numAllocs - before.numAllocs + after.numTempAllocs - before.numTempAllocs;
+        printf("  %-22s %d allocations in %d frames\n", setups[ii].name, (int)numAllocs, (int)frames.size());
+        char what[128];
+        snprintf(what, sizeof(what), "steady frames on %s don't allocate", setups[ii].name);
+        check(numAllocs == 0, what);
+    }
+}
+
+// A frame is encoded as the rectangle it changes, or as an empty frame that only takes up its delay
+// when it changes nothing - e.g. a repeat too long for the frame before's 16-bit delay. Both must decode
+// to the frames the encoder picked, and a small change must cost about as much as its rectangle.
+static void benchRects(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("rects: changed rectangles and empty frames\n");
+
+    // the first frame, then a 40x30 patch of its colors inverted, at a few places including the corners
+    const int patchWidth = 40, patchHeight = 30;
+    const int corners[][2] = { { 100, 200 }, { 0, 0 }, { width - patchWidth, height - patchHeight }, { width / 2, 0 } };
+    std::vector<Frame> source(1, frames[0]);
+    for(int pp=0; pp<4; ++pp)
+    {
+        Frame patched = source.back();
+        for(int yy=corners[pp][1]; yy<corners[pp][1] + patchHeight; ++yy)
+        {
+            size_t row = ((size_t)yy * width + corners[pp][0]) * 4;
+            for(size_t jj=row; jj<row + patchWidth * 4; ++jj)
+                if(jj % 4 != 3) patched[jj] = (uint8_t)(255 - patched[jj]);
+        }
+        source.push_back(patched);
+    }
+
+    std::vector<Frame> quantized;
+    Frame gif = encodeFrames(source, width, height, nullptr, &quantized);
+    Frame firstOnly = encodeFrames(std::vector<Frame>(1, frames[0]), width, height);
+    int decodedWidth = 0, decodedHeight = 0;
+    std::vector<Frame> decoded = decodeGif(gif.data(), gif.size(), source.size() + 1, &decodedWidth, &decodedHeight);
+    size_t patchBytes = (gif.size() - firstOnly.size()) / (source.size() - 1);
+    printf("  %dx%d patch: %d bytes/frame, whole frame %d bytes\n", patchWidth, patchHeight, (int)patchBytes, (int)firstOnly.size());
+    check(decoded == quantized, "patched frames decode to the colors the encoder picked");
+    check(patchBytes < (size_t)patchWidth * patchHeight + 1024, "a patched frame costs no more than its rectangle and a palette");
+
+    // repeats adding up to more than 0xffff hundredths go on in an empty frame
+    GifBuffer out;
+    memset(&out, 0, sizeof(out));
+    GifWriter writer;
+    GifBeginSink(&writer, GifBufferSink, &out, width, height, 2);
+    GifWriteFrame(&writer, frames[0].data(), width, height, 2);
+    GifRepeatFrame(&writer, 0xfff0);
+    GifRepeatFrame(&writer, 100);
+    GifWriteFrame(&writer, source[1].data(), width, height, 3);
+    GifEnd(&writer);
+
+    std::vector<int> delays;
+    decoded = decodeGif(out.data, out.size, 5, &decodedWidth, &decodedHeight, &delays);
+    std::vector<int> expectedDelays = { 0xfff2, 100, 3 };
+    printf("  %d frames, delays", (int)decoded.size());
+    for(size_t ii=0; ii<delays.size(); ++ii) printf(" %d", delays[ii]);
+    printf("\n");
+    check(decoded.size() == 3 && decoded[0] == quantized[0] && decoded[1] == quantized[0] && decoded[2] == quantized[1] &&
+          delays == expectedDelays, "an empty frame shows the frame before for its delay");
+    GifBufferFree(&out);
+}
+
+// The color cache must only ever change how fast GifThresholdImage runs: with or without it, and with the
+// palette kept from frame to frame or changed under it, every frame must come out the same.
+static void benchCache(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("cache: palette lookups cached by color\n");
+
+    GifColorCache* cache = (GifColorCache*)malloc(sizeof(GifColorCache));
+    memset(cache, 0, sizeof(GifColorCache));
+    GifPalette wholePal, ditherPal;
+    GifMakePalette(NULL, frames[0].data(), width, height, 8, false, &wholePal);
+    GifMakePalette(NULL, frames[0].data(), width, height, 4, true, &ditherPal);
+
+    // the whole-frame palette for most frames, so cached entries carry over, with a 4-bit one every third
+    Frame plain(frames[0].size()), cached(frames[0].size());
+    double plainSeconds = 0, cachedSeconds = 0;
+    int mismatches = 0;
+    for(size_t ii=0; ii<frames.size(); ++ii)
+    {
+        GifPalette* pal = ii % 3 == 2 ? &ditherPal : &wholePal;
+        const uint8_t* lastFrame = ii ? frames[ii-1].data() : NULL;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        GifThresholdImage(lastFrame, frames[ii].data(), plain.data(), width, height, pal, NULL);
+        plainSeconds += secondsSince(start);
+
+        start = std::chrono::steady_clock::now();
+        GifColorCacheSetPalette(cache, pal);
+        GifThresholdImage(lastFrame, frames[ii].data(), cached.data(), width, height, pal, cache);
+        cachedSeconds += secondsSince(start);
+
+        if(plain != cached) ++mismatches;
+    }
+    free(cache);
+
+    printf("  searched %6.2f ms/frame, cached %6.2f ms/frame\n", plainSeconds / frames.size() * 1000, cachedSeconds / frames.size() * 1000);
+    char what[128];
+    snprintf(what, sizeof(what), "cached lookups palettize every frame the same (%d frames don't)", mismatches);
+    check(mismatches == 0, what);
+}
+
+// Output goes through a sink in a few large writes - the header, then one per frame, then the trailer - and a
+// GIF written to a file must be byte for byte the one written to memory. A sink that fails must be reported,
+// by the frames written after it failed and by GifEnd, also when frames are encoded on worker threads.
+static void benchSink(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("sink: buffered output\n");
+    Frame gif = encodeFrames(frames, width, height);
+
+    const char* path = "gif_bench_sink.gif";
+    GifWriter writer;
+    GifBegin(&writer, path, width, height, 2);
+    for(size_t ii=0; ii<frames.size(); ++ii)
+        GifWriteFrame(&writer, frames[ii].data(), width, height, 2);
+    bool ended = GifEnd(&writer);
+    check(ended && readFile(path) == gif, "GifBegin writes the same file as a memory sink");
+    remove(path);
+
+    struct Counted { int numWrites; int failAfter; };
+    auto countingSink = [](const void*, size_t, void* user) {
+        Counted* counted = (Counted*)user;
+        return ++counted->numWrites <= counted->failAfter;
+    };
+
+    int distinctFrames = 1;
+    for(size_t ii=1; ii<frames.size(); ++ii)
+        if(frames[ii] != frames[ii-1]) ++distinctFrames;
+    Counted counted = { 0, 1 << 30 };
+    GifBeginSink(&writer, countingSink, &counted, width, height, 2);
+    for(size_t ii=0; ii<frames.size(); ++ii)
+        GifWriteFrame(&writer, frames[ii].data(), width, height, 2);
+    GifEnd(&writer);
+    printf("  %d writes for %d frames\n", counted.numWrites, distinctFrames);
+    check(counted.numWrites == distinctFrames + 2, "one write for the header, each frame and the trailer");
+
+    for(int async=0; async<2; ++async)
+    {
+        Counted failing = { 0, 3 };
+        GifBeginSink(&writer, countingSink, &failing, width, height, 2);
+        if(async) GifSetAsync(&writer, 4);
+        bool frameFailed = false;
+        for(size_t ii=0; ii<frames.size(); ++ii)
+            if(!GifWriteFrame(&writer, frames[ii].data(), width, height, 2)) frameFailed = true;
+        ended = GifEnd(&writer);
+        check(frameFailed && !ended, async ? "a failed write is reported on worker threads" : "a failed write is reported");
+    }
+}
+
+// With palette reuse, a frame keeps the palette of the one before as long as the mean error of the pixels it
+// changes stays within the budget, and frames on the first frame's palette use the global color table instead
+// of a local one. Without it, every frame has a local color table of its own.
+static void benchPalettes(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("palettes: palette reuse and the global color table\n");
+    const int maxError = 6;
+
+    std::vector<Frame> distinct;
+    for(size_t ii=0; ii<frames.size(); ++ii)
+        if(distinct.empty() || frames[ii] != distinct.back()) distinct.push_back(frames[ii]);
+
+    // and one with its colors inverted, which no palette before fits
+    Frame inverted = distinct.back();
+    for(size_t jj=0; jj<inverted.size(); ++jj)
+        if(jj % 4 != 3) inverted[jj] = (uint8_t)(255 - inverted[jj]);
+    distinct.push_back(inverted);
+
+    Frame global;
+    Frame plain = encodeFrames(distinct, width, height);
+    std::vector<Frame> plainTables = colorTables(plain, &global);
+    int plainLocal = 0;
+    for(size_t ii=0; ii<plainTables.size(); ++ii)
+        if(!plainTables[ii].empty()) ++plainLocal;
+    check(plainLocal == (int)distinct.size(), "without reuse every frame has a local color table");
+
+    std::vector<Frame> quantized;
+    Frame gif = encodeFrames(distinct, width, height, [maxError](GifWriter* writer) { GifSetPaletteReuse(writer, maxError); }, &quantized);
+    int decodedWidth = 0, decodedHeight = 0;
+    std::vector<Frame> decoded = decodeGif(gif.data(), gif.size(), distinct.size() + 1, &decodedWidth, &decodedHeight);
+    check(decoded == quantized, "frames decode to the colors the encoder picked");
+
+    // a frame with the same color table as the one before kept its palette, so must be within the budget
+    std::vector<Frame> tables = colorTables(gif, &global);
+    int numGlobal = 0, numReused = 0, overBudget = 0;
+    for(size_t ii=0; ii<tables.size() && ii<decoded.size(); ++ii)
+    {
+        const Frame& table = tables[ii].empty() ? global : tables[ii];
+        if(tables[ii].empty()) ++numGlobal;
+        const Frame& lastTable = ii && !tables[ii-1].empty() ? tables[ii-1] : global;
+        if(ii == 0 || table != lastTable) continue;
+        ++numReused;
+
+        uint64_t totalError = 0, numChanged = 0;
+        for(size_t jj=0; jj<distinct[ii].size(); jj+=4)
+        {
+            if(!memcmp(&distinct[ii][jj], &decoded[ii-1][jj], 3)) continue;
+            for(int cc=0; cc<3; ++cc) totalError += abs(distinct[ii][jj+cc] - decoded[ii][jj+cc]);
+            ++numChanged;
+        }
+        if(numChanged && totalError > (uint64_t)maxError * numChanged) ++overBudget;
+    }
+    printf("  %d frames: %d on the global color table, %d keeping the palette before, %d bytes (%d without reuse)\n",
+           (int)tables.size(), numGlobal, numReused, (int)gif.size(), (int)plain.size());
+    check(!global.empty() && tables.size() == distinct.size() && tables[0].empty(), "the first frame's palette is the global color table");
+    check(numReused > 0 && overBudget == 0, "frames keep the palette before only within the error budget");
+    check(!tables.back().empty(), "a frame the palette doesn't fit gets a palette of its own");
+    check(gif.size() < plain.size(), "reusing palettes makes the file smaller");
+}
+
+// Palettes are built from a histogram of the frame's colors rather than a copy of its pixels: the scratch
+// memory must stay well under a frame's size, a frame with fewer colors than the palette holds must get every
+// one of them exactly, and the palette must only depend on which colors there are, not on where they are.
+static void benchHistogram(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("histogram: palettes from color histograms\n");
+
+    GifArena arena;
+    memset(&arena, 0, sizeof(arena));
+    GifPalette pal;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(size_t ii=0; ii<frames.size(); ++ii)
+        GifMakePalette(NULL, frames[ii].data(), width, height, 8, false, &pal, &arena);
+    double seconds = secondsSince(start);
+    size_t scratch = arena.peak;
+    GifArenaRelease(&arena);
+    printf("  %6.2f ms/frame, %.1f KB of scratch memory for a %.1f KB frame\n", seconds / frames.size() * 1000,
+           scratch / 1024.0, frames[0].size() / 1024.0);
+    check(scratch < frames[0].size() / 2, "the histogram takes under half a frame's memory");
+
+    // random images of up to 255 colors, and the same pixels shuffled
+    std::mt19937 rng(5);
+    int inexact = 0, orderDependent = 0;
+    const int numImages = 50;
+    for(int ii=0; ii<numImages; ++ii)
+    {
+        Frame image = randomImage(rng, 64 + rng() % 200, 64 + rng() % 200);
+        uint32_t numPixels = (uint32_t)image.size() / 4;
+        GifMakePalette(NULL, image.data(), numPixels, 1, 8, false, &pal);
+
+        Frame indexed(image.size());
+        GifThresholdImage(NULL, image.data(), indexed.data(), numPixels, 1, &pal, NULL);
+        for(size_t jj=0; jj<image.size(); jj+=4)
+        {
+            if(memcmp(&image[jj], &indexed[jj], 3)) { ++inexact; break; }
+        }
+
+        std::vector<uint32_t> pixels(numPixels);
+        memcpy(pixels.data(), image.data(), image.size());
+        std::shuffle(pixels.begin(), pixels.end(), rng);
+        GifPalette shuffledPal;
+        GifMakePalette(NULL, (const uint8_t*)pixels.data(), numPixels, 1, 8, false, &shuffledPal);
+        if(!GifSamePaletteColors(&pal, &shuffledPal)) ++orderDependent;
+    }
+    char what[128];
+    snprintf(what, sizeof(what), "%d images of up to 255 colors get all of them exactly (%d don't)", numImages, inexact);
+    check(inexact == 0, what);
+    snprintf(what, sizeof(what), "shuffling the pixels gives the same palette (%d images don't)", orderDependent);
+    check(orderDependent == 0, what);
+}
+
+// A frame gets the smallest palette that holds all its colors next to the transparent entry - but never
+// fewer than 4 entries, the least LZW allows, nor more than the bitDepth it was written with - and must
+// still decode to the colors the encoder picked.
+static void benchBitDepth(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("bitdepth: palette size picked per frame\n");
+    (void)frames; (void)width; (void)height;
+
+    std::mt19937 rng(17);
+    const int colorCounts[] = { 1, 2, 3, 4, 7, 8, 15, 16, 31, 64, 100, 127, 128, 255 };
+    const int maxDepths[] = { 8, 5, 3 };
+    int wrongSize = 0, wrongColors = 0, numImages = 0;
+    for(int dd=0; dd<3; ++dd)
+    {
+        for(size_t cc=0; cc<sizeof(colorCounts)/sizeof(colorCounts[0]); ++cc)
+        {
+            // numColors distinct colors, every one of them used
+            int numColors = colorCounts[cc];
+            const int imageWidth = 61, imageHeight = 37;
+            std::vector<uint32_t> colors;
+            while((int)colors.size() < numColors)
+            {
+                uint32_t color = (rng() & 0xffffff) | 0xff000000u;
+                if(std::find(colors.begin(), colors.end(), color) == colors.end()) colors.push_back(color);
+            }
+            Frame image((size_t)imageWidth * imageHeight * 4);
+            for(int ii=0; ii<imageWidth * imageHeight; ++ii)
+                memcpy(&image[ii*4], &colors[ii < numColors ? ii : rng() % numColors], 4);
+
+            GifBuffer out;
+            memset(&out, 0, sizeof(out));
+            GifWriter writer;
+            GifBeginSink(&writer, GifBufferSink, &out, imageWidth, imageHeight, 2);
+            GifWriteFrame(&writer, image.data(), imageWidth, imageHeight, 2, maxDepths[dd]);
+            GifEnd(&writer);
+            Frame gif(out.data, out.data + out.size);
+            GifBufferFree(&out);
+
+            int expectedDepth = 2;
+            while(expectedDepth < maxDepths[dd] && (1 << expectedDepth) < numColors + 1) ++expectedDepth;
+            Frame global;
+            std::vector<Frame> tables = colorTables(gif, &global);
+            if(tables.size() != 1 || tables[0].size() != 3u << expectedDepth) ++wrongSize;
+
+            // with room for every color, each must come out exactly
+            int decodedWidth = 0, decodedHeight = 0;
+            std::vector<Frame> decoded = decodeGif(gif.data(), gif.size(), 2, &decodedWidth, &decodedHeight);
+            if(numColors < (1 << maxDepths[dd]) && (decoded.size() != 1 || decoded[0] != image)) ++wrongColors;
+            ++numImages;
+        }
+    }
+    char what[128];
+    snprintf(what, sizeof(what), "%d images get the smallest palette that holds their colors (%d don't)", numImages, wrongSize);
+    check(wrongSize == 0, what);
+    snprintf(what, sizeof(what), "images with room for every color decode exactly (%d don't)", wrongColors);
+    check(wrongColors == 0, what);
+}
+
+// Two-pass mode stores the frames until GifEnd, makes one palette from all their colors and writes it as the
+// global color table: no frame may have a local one, every decoded color must be in it, repeats must still
+// fold into the frame before, and the colors must stay about as close to the frames as per-frame palettes get
+// (which on frames decoded from a GIF is exactly, so the comparison allows a little on top).
+static void benchTwoPass(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("twopass: one palette for the whole animation\n");
+
+    int decodedWidth = 0, decodedHeight = 0;
+    std::vector<int> delays, expectedDelays;
+    std::vector<Frame> distinct;
+    for(size_t ii=0; ii<frames.size(); ++ii)
+    {
+        if(!distinct.empty() && frames[ii] == distinct.back())
+        {
+            expectedDelays.back() += 2;
+        }
+        else
+        {
+            distinct.push_back(frames[ii]);
+            expectedDelays.push_back(2);
+        }
+    }
+
+    double seconds = 0;
+    Frame gif = encodeFrames(frames, width, height, [](GifWriter* writer) { GifSetTwoPass(writer); }, NULL, &seconds);
+    std::vector<Frame> decoded = decodeGif(gif.data(), gif.size(), frames.size() + 1, &decodedWidth, &decodedHeight, &delays);
+    Frame plain = encodeFrames(frames, width, height);
+    std::vector<Frame> plainDecoded = decodeGif(plain.data(), plain.size(), frames.size() + 1, &decodedWidth, &decodedHeight);
+
+    Frame global;
+    std::vector<Frame> tables = colorTables(gif, &global);
+    bool allGlobal = !global.empty() && tables.size() == distinct.size();
+    for(size_t ii=0; ii<tables.size(); ++ii)
+        if(!tables[ii].empty()) allGlobal = false;
+
+    // colors of the global table, as 0xRRGGBB
+    std::vector<bool> inTable(1 << 24, false);
+    for(size_t ii=0; ii+2<global.size(); ii+=3)
+        inTable[global[ii] << 16 | global[ii+1] << 8 | global[ii+2]] = true;
+
+    int outsideTable = 0;
+    double error = 0, plainError = 0;
+    for(size_t ff=0; ff<decoded.size() && ff<distinct.size() && ff<plainDecoded.size(); ++ff)
+    {
+        for(size_t jj=0; jj<decoded[ff].size(); jj+=4)
+        {
+            if(!inTable[decoded[ff][jj] << 16 | decoded[ff][jj+1] << 8 | decoded[ff][jj+2]]) ++outsideTable;
+            for(int cc=0; cc<3; ++cc)
+            {
+                error += abs(decoded[ff][jj+cc] - distinct[ff][jj+cc]);
+                plainError += abs(plainDecoded[ff][jj+cc] - distinct[ff][jj+cc]);
+            }
+        }
+    }
+    size_t numPixels = distinct.size() * distinct[0].size() / 4;
+    printf("  %d bytes (%d with a palette per frame), %6.2f ms/frame, mean error %.2f (%.2f with a palette per frame)\n",
+           (int)gif.size(), (int)plain.size(), seconds / frames.size() * 1000, error / numPixels, plainError / numPixels);
+    check(allGlobal, "every frame uses the global color table");
+    check(decoded.size() == distinct.size() && outsideTable == 0, "every frame decodes to colors of the global color table");
+    check(delays == expectedDelays, "repeats fold into the frame before");
+    check(error <= plainError * 2 + numPixels, "the mean color error is at most twice that of a palette per frame, plus 1");
+}
+
+// The fixed-palette lookup table must pick, for every color, the entry GifFindPaletteColor picks for the center
+// of its cell - so no entry is more than twice the distance to the center further than the nearest - with previous-frame
+// pixels kept transparent exactly as a pixel-by-pixel reference does, SIMD or not; and it should beat searching.
+static void benchLut(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("lut: fixed-palette lookup table\n");
+
+    GifPalette cubePal, framePal;
+    GifMakeCubePalette(6, 7, 6, &cubePal);
+    GifMakePalette(NULL, frames[0].data(), width, height, 8, false, &framePal);
+    GifPalette* palettes[] = { &cubePal, &framePal };
+    const char* names[] = { "6x7x6 cube palette", "first frame's palette" };
+
+    const int cellSize = 256 >> kGifLutBits;
+    GifPaletteLut* lut = (GifPaletteLut*)malloc(sizeof(GifPaletteLut));
+    for(int pp=0; pp<2; ++pp)
+    {
+        GifPalette* pal = palettes[pp];
+        GifBuildPaletteLut(pal, lut);
+
+        // the recorded frames, and a frame of random colors
+        std::vector<Frame> source(frames);
+        std::mt19937 rng(23);
+        Frame noise(frames[0].size());
+        for(size_t jj=0; jj<noise.size(); ++jj) noise[jj] = (uint8_t)(jj % 4 == 3 ? 255 : rng());
+        source.push_back(noise);
+
+        int mismatches = 0, tooFar = 0;
+        double lutSeconds = 0, searchSeconds = 0;
+        Frame out(frames[0].size()), searched(frames[0].size());
+        for(size_t ff=0; ff<source.size(); ++ff)
+        {
+            const uint8_t* lastFrame = ff ? source[ff-1].data() : NULL;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            GifLutThresholdImage(lastFrame, source[ff].data(), out.data(), width * height, lut);
+            lutSeconds += secondsSince(start);
+            start = std::chrono::steady_clock::now();
+            GifThresholdImage(lastFrame, source[ff].data(), searched.data(), width, height, pal, NULL);
+            searchSeconds += secondsSince(start);
+
+            for(size_t jj=0; jj<out.size(); jj+=4)
+            {
+                const uint8_t* next = &source[ff][jj];
+                int32_t centerInd = 1, centerDiff = 1000000;
+                GifFindPaletteColor(pal, next[0] / cellSize * cellSize + cellSize / 2, next[1] / cellSize * cellSize + cellSize / 2,
+                                    next[2] / cellSize * cellSize + cellSize / 2, &centerInd, &centerDiff);
+                uint8_t expected[4] = { pal->r[centerInd], pal->g[centerInd], pal->b[centerInd], (uint8_t)centerInd };
+                const uint8_t* last = lastFrame ? lastFrame + jj : NULL;
+                if(last && (!memcmp(last, next, 3) || !memcmp(last, expected, 3)))
+                {
+                    memcpy(expected, last, 3);
+                    expected[3] = kGifTransIndex;
+                }
+                if(memcmp(&out[jj], expected, 4))
+                    ++mismatches;
+
+                int nearestDiff = 0;
+                nearestEntry(pal, next[0], next[1], next[2], &nearestDiff);
+                int lutDiff = abs(next[0] - pal->r[centerInd]) + abs(next[1] - pal->g[centerInd]) + abs(next[2] - pal->b[centerInd]);
+                if(lutDiff > nearestDiff + 3 * cellSize)
+                    ++tooFar;
+            }
+        }
+
+        printf("  %s: lookup %6.2f ms/frame, search %6.2f ms/frame\n", names[pp], lutSeconds / source.size() * 1000, searchSeconds / source.size() * 1000);
+        char what[160];
+        snprintf(what, sizeof(what), "%s: every pixel as the reference picks it (%d aren't)", names[pp], mismatches);
+        check(mismatches == 0, what);
+        snprintf(what, sizeof(what), "%s: no entry more than a cell further than the nearest (%d are)", names[pp], tooFar);
+        check(tooFar == 0, what);
+    }
+    free(lut);
+}
+
+// Rolling segments: each file must be a whole GIF of its own, the same bytes as encoding its frames on their
+// own would give - on the calling thread or worker threads - and a byte limit must start a new file once
+// the current one has reached it.
+static void benchSegments(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("segments: rolling GIF segments\n");
+    const char* path = "gif_bench_segment.gif";
+    auto segmentPath = [](int index) {
+        char name[64];
+        snprintf(name, sizeof(name), "gif_bench_segment_%03d.gif", index);
+        return std::string(name);
+    };
+
+    for(int async=0; async<2; ++async)
+    {
+        const uint32_t maxFrames = 6;
+        GifWriter writer;
+        GifBeginSegments(&writer, path, width, height, 2, maxFrames, 0);
+        if(async) GifSetAsync(&writer, 4);
+        for(size_t ii=0; ii<frames.size(); ++ii)
+            GifWriteFrame(&writer, frames[ii].data(), width, height, 2);
+        bool ended = GifEnd(&writer);
+
+        int numSegments = (int)((frames.size() + maxFrames - 1) / maxFrames), wrong = 0;
+        for(int ss=0; ss<numSegments; ++ss)
+        {
+            std::vector<Frame> own(frames.begin() + ss * maxFrames, frames.begin() + std::min(frames.size(), (size_t)(ss + 1) * maxFrames));
+            if(readFile(segmentPath(ss).c_str()) != encodeFrames(own, width, height)) ++wrong;
+            remove(segmentPath(ss).c_str());
+        }
+        bool noMore = readFile(segmentPath(numSegments).c_str()).empty();
+        char what[128];
+        snprintf(what, sizeof(what), "%d frames in %d segments of %d, each as if encoded on its own%s (%d aren't)",
+                 (int)frames.size(), numSegments, (int)maxFrames, async ? ", on worker threads" : "", wrong);
+        check(ended && wrong == 0 && noMore, what);
+    }
+
+    // a byte limit: every segment but the last reaches it
+    const uint64_t maxBytes = 40000;
+    GifWriter writer;
+    GifBeginSegments(&writer, path, width, height, 2, 0, maxBytes);
+    for(size_t ii=0; ii<frames.size(); ++ii)
+        GifWriteFrame(&writer, frames[ii].data(), width, height, 2);
+    bool ended = GifEnd(&writer);
+
+    std::vector<size_t> sizes;
+    int undecodable = 0;
+    for(int ss=0; ; ++ss)
+    {
+        Frame segment = readFile(segmentPath(ss).c_str());
+        if(segment.empty()) break;
+        sizes.push_back(segment.size());
+        remove(segmentPath(ss).c_str());
+
+        int decodedWidth = 0, decodedHeight = 0;
+        if(decodeGif(segment.data(), segment.size(), 1, &decodedWidth, &decodedHeight).empty()) ++undecodable;
+    }
+    int underLimit = 0;
+    printf("  %d-byte limit:", (int)maxBytes);
+    for(size_t ss=0; ss<sizes.size(); ++ss)
+    {
+        printf(" %d", (int)sizes[ss]);
+        if(ss + 1 < sizes.size() && sizes[ss] < maxBytes) ++underLimit;
+    }
+    printf(" bytes\n");
+    check(ended && sizes.size() > 1 && underLimit == 0 && undecodable == 0, "a new segment starts once the current one reaches the byte limit, and each decodes");
+}
+
+// The instant replay ring drops its oldest frames as newer ones come in, by the length of the window or by the
+// bytes the changes take, wrapping around the ring as it goes. Whatever is left must save to the same GIF as
+// encoding the frames still in the window would give; a frame too large for the ring starts the window over.
+static void benchReplay(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("replay: instant replay ring\n");
+
+    // the distinct frames, three times over so the ring wraps around
+    std::vector<Frame> source;
+    for(int pass=0; pass<3; ++pass)
+        for(size_t ii=0; ii<frames.size(); ++ii)
+            if(source.empty() || frames[ii] != source.back()) source.push_back(frames[ii]);
+
+    const char* path = "gif_bench_replay.gif";
+    struct Limits { const char* name; uint32_t maxDelay; size_t maxBytes; bool wraps; };
+    const Limits limits[] = {
+        { "a 0.2 s window", 20, 64u << 20, false },
+        { "a 60 KB ring", 0, 60000, true },
+        { "a 0.3 s window in a 100 KB ring", 30, 100000, true },
+        { "a ring too small for any frame's changes", 0, 64, false },
+    };
+
+    for(size_t ll=0; ll<sizeof(limits)/sizeof(limits[0]); ++ll)
+    {
+        GifReplayBuffer replay;
+        GifReplayBegin(&replay, width, height, limits[ll].maxDelay, limits[ll].maxBytes);
+        bool withinLimits = true, wrapped = false;
+        for(size_t ii=0; ii<source.size(); ++ii)
+        {
+            GifReplayAddFrame(&replay, source[ii].data(), 2);
+            wrapped = wrapped || replay.wrapped;
+            GifReplayStats stats = GifReplayGetStats(&replay);
+            if(stats.bytesUsed > limits[ll].maxBytes || (limits[ll].maxDelay && stats.delay - 2 >= limits[ll].maxDelay))
+                withinLimits = false;
+        }
+
+        GifReplayStats stats = GifReplayGetStats(&replay);
+        bool saved = GifReplaySave(&replay, path);
+        bool ended = GifReplayEnd(&replay);
+        std::vector<Frame> kept(source.end() - std::min((size_t)stats.numFrames, source.size()), source.end());
+        bool same = saved && ended && readFile(path) == encodeFrames(kept, width, height);
+        remove(path);
+
+        printf("  %-40s %3d of %d frames kept, %7d bytes of changes%s\n", limits[ll].name, (int)stats.numFrames, (int)source.size(),
+               (int)stats.bytesUsed, wrapped ? ", wrapped around" : "");
+        char what[128];
+        snprintf(what, sizeof(what), "%s: within its limits, and saves the frames kept", limits[ll].name);
+        check(withinLimits && stats.numFrames > 0 && stats.numFrames < source.size() && same, what);
+        if(limits[ll].wraps) check(wrapped, "the records wrap around the end of the ring");
+    }
+}
+
+// The video pipe writes a YUV4MPEG2 header and then every frame, a repeat included, as FRAME and the Y, U and V
+// planes - with odd sizes rounding the chroma planes up - so the file's size is exactly known. Its planes must
+// hold the values of the scalar BT.601 conversion (the SIMD one included), and raw RGBA the frames as they are.
+static void benchPipe(const std::vector<Frame>& frames, int width, int height)
+{
+    printf("pipe: YUV4MPEG2 and raw RGBA video pipe\n");
+
+    // an odd size, so the chroma planes have a half block at the right and bottom edges
+    const uint32_t oddWidth = (uint32_t)width - 1 - width % 2, oddHeight = (uint32_t)height - 1 - height % 2;
+    std::vector<Frame> source;
+    for(size_t ii=0; ii<frames.size(); ++ii)
+    {
+        Frame cropped((size_t)oddWidth * oddHeight * 4);
+        for(uint32_t yy=0; yy<oddHeight; ++yy)
+            memcpy(&cropped[(size_t)yy * oddWidth * 4], &frames[ii][(size_t)yy * width * 4], (size_t)oddWidth * 4);
+        source.push_back(cropped);
+    }
+
+    const char* path = "gif_bench_pipe.y4m";
+    const uint32_t numFrames = (uint32_t)source.size() + 1; // the last one repeated
+    for(int format=0; format<2; ++format)
+    {
+        GifPipeWriter pipe;
+        GifPipeBegin(&pipe, path, oddWidth, oddHeight, format, 30, 1, numFrames);
+        for(size_t ii=0; ii<source.size(); ++ii)
+            GifPipeFrame(&pipe, source[ii].data());
+        GifPipeRepeatFrame(&pipe);
+        bool ended = GifPipeEnd(&pipe);
+        bool allWritten = pipe.framesWritten == numFrames && pipe.framesDropped == 0;
+        Frame video = readFile(path);
+        remove(path);
+
+        if(format == kGifPipeRgba)
+        {
+            Frame expected;
+            for(uint32_t ii=0; ii<numFrames; ++ii)
+            {
+                const Frame& frame = source[std::min((size_t)ii, source.size() - 1)];
+                for(uint32_t yy=0; yy<oddHeight; ++yy)
+                {
+                    const uint8_t* row = GifImageRow(frame.data(), oddWidth, oddHeight, yy);
+                    expected.insert(expected.end(), row, row + oddWidth * 4);
+                }
+            }
+            check(ended && allWritten && video == expected, "raw RGBA is every frame's rows, top first, and the repeat");
+            continue;
+        }
+
+        char header[128];
+        snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F30:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n", oddWidth, oddHeight);
+        size_t headerSize = strlen(header);
+        size_t chromaSize = (size_t)((oddWidth + 1) / 2) * ((oddHeight + 1) / 2);
+        size_t frameSize = 6 + (size_t)oddWidth * oddHeight + 2 * chromaSize;
+        printf("  %ux%u, %u frames: %d bytes, %d expected\n", oddWidth, oddHeight, numFrames, (int)video.size(), (int)(headerSize + numFrames * frameSize));
+        check(ended && allWritten && video.size() == headerSize + numFrames * frameSize && !memcmp(video.data(), header, headerSize),
+              "the Y4M stream is the header and every frame, the repeat included, at 4:2:0 rounded up");
+        if(video.size() != headerSize + numFrames * frameSize) continue;
+
+        // every plane against the scalar conversion, pixels past the edges repeating the last ones
+        int wrongPlanes = 0;
+        for(uint32_t ff=0; ff<numFrames; ++ff)
+        {
+            const Frame& frame = source[std::min((size_t)ff, source.size() - 1)];
+            const uint8_t* marker = &video[headerSize + ff * frameSize];
+            const uint8_t* yPlane = marker + 6;
+            const uint8_t* uPlane = yPlane + (size_t)oddWidth * oddHeight;
+            const uint8_t* vPlane = uPlane + chromaSize;
+            bool same = !memcmp(marker, "FRAME\n", 6);
+            for(uint32_t yy=0; yy<oddHeight && same; ++yy)
+            {
+                const uint8_t* row = GifImageRow(frame.data(), oddWidth, oddHeight, yy);
+                for(uint32_t xx=0; xx<oddWidth; ++xx)
+                    if(yPlane[(size_t)yy * oddWidth + xx] != GifRgbToY(row[xx*4], row[xx*4+1], row[xx*4+2])) same = false;
+            }
+            for(uint32_t by=0; by<(oddHeight + 1) / 2 && same; ++by)
+            {
+                for(uint32_t bx=0; bx<(oddWidth + 1) / 2; ++bx)
+                {
+                    int sums[3] = { 0, 0, 0 };
+                    for(uint32_t dy=0; dy<2; ++dy)
+                    {
+                        const uint8_t* row = GifImageRow(frame.data(), oddWidth, oddHeight, std::min(by * 2 + dy, oddHeight - 1));
+                        for(uint32_t dx=0; dx<2; ++dx)
+                            for(int cc=0; cc<3; ++cc) sums[cc] += row[std::min(bx * 2 + dx, oddWidth - 1) * 4 + cc];
+                    }
+                    size_t block = (size_t)by * ((oddWidth + 1) / 2) + bx;
+                    if(uPlane[block] != GifSumToU(sums[0], sums[1], sums[2]) || vPlane[block] != GifSumToV(sums[0], sums[1], sums[2]))
+                        same = false;
+                }
+            }
+            if(!same) ++wrongPlanes;
+        }
+        char what[128];
+        snprintf(what, sizeof(what), "Y, U and V planes match the scalar conversion (%d frames don't)", wrongPlanes);
+        check(wrongPlanes == 0, what);
+    }
+
+    GifPipeWriter failed;
+    bool began = GifPipeBegin(&failed, "gif_bench_no_such_directory/pipe.y4m", oddWidth, oddHeight, kGifPipeY4m);
+    bool dropped = !GifPipeFrame(&failed, source[0].data());
+    check(!began && dropped && !GifPipeEnd(&failed), "a pipe that can't be opened drops frames and reports failure");
+}
+
+int main(int argc, char** argv)
+{
+    const char* source = "../A2outputGIF_Halmuhammet.gif";
+    std::vector<std::string> sections;
+    for(int ii=1; ii<argc; ++ii)
+    {
+        if(strstr(argv[ii], ".gif")) source = argv[ii];
+        else sections.push_back(argv[ii]);
+    }
+    bool all = sections.empty();
+    auto wanted = [&](const char* name) {
+        for(size_t ii=0; ii<sections.size(); ++ii)
+            if(sections[ii] == name) return true;
+        return all;
+    };
+
+    Frame data = readFile(source);
+    int width = 0, height = 0;
+    std::vector<Frame> frames = decodeGif(data.data(), data.size(), 20, &width, &height);
+    if(frames.empty())
+    {
+        fprintf(stderr, "Couldn't read frames from %s\n", source);
+        return 1;
+    }
+    printf("%d frames of %s, %dx%d\n", (int)frames.size(), source, width, height);
+
+    if(wanted("search")) benchSearch(frames, width, height);
+    if(wanted("lzw")) benchLzw(frames, width, height);
+    if(wanted("strips")) benchStrips(frames, width, height);
+    if(wanted("lossy")) benchLossy(frames, width, height);
+    if(wanted("repeats")) benchRepeats(frames, width, height);
+    if(wanted("dither")) benchDither(frames, width, height);
+    if(wanted("capture")) benchCapture(frames, width, height);
+    if(wanted("allocs")) benchAllocs(frames, width, height);
+    if(wanted("rects")) benchRects(frames, width, height);
+    if(wanted("cache")) benchCache(frames, width, height);
+    if(wanted("sink")) benchSink(frames, width, height);
+    if(wanted("palettes")) benchPalettes(frames, width, height);
+    if(wanted("histogram")) benchHistogram(frames, width, height);
+    if(wanted("bitdepth")) benchBitDepth(frames, width, height);
+    if(wanted("twopass")) benchTwoPass(frames, width, height);
+    if(wanted("lut")) benchLut(frames, width, height);
+    if(wanted("segments")) benchSegments(frames, width, height);
+    if(wanted("replay")) benchReplay(frames, width, height);
+    if(wanted("pipe")) benchPipe(frames, width, height);
+
+    printf(failures ? "%d checks FAILED\n" : "all checks passed\n", failures);
+    return failures ? 1 : 0;
+}